@@ -0,0 +1,100 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "copse/cps.h"
+
+#include "bench.h"
+
+#define RESUMES  50000000
+
+
+/*-----------------------------------------------------------------------
+ * Continuation chains
+ */
+
+/* Measures the cost of passing control from one continuation to the next,
+ * without any fibers or schedulers involved.  Each continuation in the chain
+ * jumps to the next one, and the last one finishes.  One operation is one
+ * continuation. */
+
+struct chain_link {
+    struct cps_cont  cont;
+    struct chain_link  *next_link;
+};
+
+struct chain {
+    struct chain_link  *links;
+    size_t  length;
+    bool  trampolined;
+};
+
+static void
+chain_link__resume(void *user_data, struct cps_cont *next)
+{
+    struct chain_link  *self = user_data;
+    if (self->next_link == NULL) {
+        cps_call(next);
+    } else {
+        cps_jump(&self->next_link->cont, next);
+    }
+}
+
+static void
+bench_chain(void *user_data, unsigned long ops)
+{
+    struct chain  *self = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops / self->length; i++) {
+        if (self->trampolined) {
+            cps_run_trampolined(&self->links[0].cont);
+        } else {
+            cps_run(&self->links[0].cont);
+        }
+    }
+}
+
+static void
+run_chain(size_t length, bool trampolined)
+{
+    struct chain  chain;
+    char  name[64];
+    size_t  i;
+
+    chain.links = cork_calloc(length, sizeof(struct chain_link));
+    chain.length = length;
+    chain.trampolined = trampolined;
+    for (i = 0; i < length; i++) {
+        struct chain_link  *link = &chain.links[i];
+        cps_cont_init(&link->cont);
+        cps_cont_set(&link->cont, link, NULL, chain_link__resume);
+        link->next_link = (i == length - 1)? NULL: &chain.links[i + 1];
+    }
+    snprintf(name, sizeof(name), "resume chain of %zu%s",
+             length, trampolined? " (trampolined)": "");
+    bench_run(name, bench_chain, &chain, RESUMES);
+    for (i = 0; i < length; i++) {
+        cps_cont_done(&chain.links[i].cont);
+    }
+    cork_cfree(chain.links, length, sizeof(struct chain_link));
+}
+
+int
+main(int argc, const char **argv)
+{
+    size_t  lengths[] = { 1, 16, 1024 };
+    size_t  i;
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        run_chain(lengths[i], false);
+        run_chain(lengths[i], true);
+    }
+    return EXIT_SUCCESS;
+}
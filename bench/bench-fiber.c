@@ -0,0 +1,104 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/stack.h"
+
+#include "bench.h"
+
+#define FIBERS  1000000
+#define STACK_SIZE  (64 * 1024)
+
+
+/*-----------------------------------------------------------------------
+ * Fiber creation
+ */
+
+/* Measures the cost of creating a fiber, running it to completion, and
+ * freeing it, with each of the different ways of getting a stack.  One
+ * operation is one fiber. */
+
+static void
+noop__run(void *user_data, struct cps_fiber *fiber)
+{
+}
+
+static void
+bench_new_free(void *user_data, unsigned long ops)
+{
+    unsigned int  *stack_flags = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops; i++) {
+        struct cps_fiber  *fiber =
+            cps_fiber_new_ex(NULL, NULL, noop__run, STACK_SIZE, *stack_flags);
+        cps_call(cps_fiber_cont(fiber));
+        cps_fiber_free(fiber);
+    }
+}
+
+static void
+run_new_free(const char *name, unsigned int stack_flags)
+{
+    bench_run(name, bench_new_free, &stack_flags, FIBERS);
+}
+
+static void
+bench_stack_pool(void *user_data, unsigned long ops)
+{
+    struct cps_stack_pool  *pool = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops; i++) {
+        struct cps_fiber  *fiber =
+            cps_fiber_new_from_pool(NULL, NULL, noop__run, pool);
+        cps_call(cps_fiber_cont(fiber));
+        cps_fiber_free(fiber);
+    }
+}
+
+static void
+run_stack_pool(const char *name)
+{
+    struct cps_stack_pool  *pool = cps_stack_pool_new(STACK_SIZE, 0, 1, 16);
+    bench_run(name, bench_stack_pool, pool, FIBERS);
+    cps_stack_pool_free(pool);
+}
+
+static void
+bench_worker_pool(void *user_data, unsigned long ops)
+{
+    struct cps_worker_pool  *pool = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops; i++) {
+        struct cps_fiber  *fiber =
+            cps_worker_pool_spawn(pool, NULL, NULL, noop__run);
+        cps_call(cps_fiber_cont(fiber));
+    }
+}
+
+static void
+run_worker_pool(const char *name)
+{
+    struct cps_worker_pool  *pool = cps_worker_pool_new(STACK_SIZE, 0);
+    bench_run(name, bench_worker_pool, pool, FIBERS);
+    cps_worker_pool_free(pool);
+}
+
+int
+main(int argc, const char **argv)
+{
+    run_new_free("fiber new+run+free", 0);
+    run_new_free("fiber new+run+free (embedded)", CPS_STACK_EMBED_FIBER);
+    run_stack_pool("fiber from stack pool");
+    run_worker_pool("worker pool spawn");
+    return EXIT_SUCCESS;
+}
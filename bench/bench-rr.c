@@ -0,0 +1,88 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "copse/cps.h"
+#include "copse/round-robin.h"
+
+#include "bench.h"
+
+#define CONTINUATIONS  20000000
+
+
+/*-----------------------------------------------------------------------
+ * Round-robin throughput
+ */
+
+/* Measures the cost of adding a continuation to a round-robin scheduler and
+ * draining it, with different numbers of continuations in the work queue at
+ * once.  The continuations don't do anything, so this is pure scheduler
+ * overhead.  One operation is one continuation added and run. */
+
+struct queue_bench {
+    struct cps_rr  *rr;
+    struct cps_cont  *conts;
+    size_t  queue_size;
+};
+
+static void
+noop__resume(void *user_data, struct cps_cont *next)
+{
+    cps_call(next);
+}
+
+static void
+bench_add_drain(void *user_data, unsigned long ops)
+{
+    struct queue_bench  *self = user_data;
+    unsigned long  i;
+    size_t  j;
+    for (i = 0; i < ops / self->queue_size; i++) {
+        for (j = 0; j < self->queue_size; j++) {
+            cps_rr_add(self->rr, &self->conts[j]);
+        }
+        cps_rr_drain(self->rr);
+    }
+}
+
+static void
+run_add_drain(size_t queue_size)
+{
+    struct queue_bench  bench;
+    char  name[64];
+    size_t  i;
+
+    bench.rr = cps_rr_new();
+    bench.conts = cork_calloc(queue_size, sizeof(struct cps_cont));
+    bench.queue_size = queue_size;
+    for (i = 0; i < queue_size; i++) {
+        cps_cont_init(&bench.conts[i]);
+        cps_cont_set(&bench.conts[i], NULL, NULL, noop__resume);
+    }
+    snprintf(name, sizeof(name), "rr add+drain, queue of %zu", queue_size);
+    bench_run(name, bench_add_drain, &bench, CONTINUATIONS);
+    for (i = 0; i < queue_size; i++) {
+        cps_cont_done(&bench.conts[i]);
+    }
+    cork_cfree(bench.conts, queue_size, sizeof(struct cps_cont));
+    cps_rr_free(bench.rr);
+}
+
+int
+main(int argc, const char **argv)
+{
+    size_t  queue_sizes[] = { 1, 16, 256, 4096, 65536 };
+    size_t  i;
+    for (i = 0; i < sizeof(queue_sizes) / sizeof(queue_sizes[0]); i++) {
+        run_add_drain(queue_sizes[i]);
+    }
+    return EXIT_SUCCESS;
+}
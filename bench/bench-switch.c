@@ -0,0 +1,210 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+#include <ucontext.h>
+#define HAVE_UCONTEXT  1
+#else
+#define HAVE_UCONTEXT  0
+#endif
+
+#include "copse/context.h"
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/round-robin.h"
+#include "copse/stack.h"
+
+#include "bench.h"
+
+#define ROUND_TRIPS  10000000
+#define STACK_SIZE  (64 * 1024)
+
+
+/*-----------------------------------------------------------------------
+ * Raw context switches
+ */
+
+/* Measures a round trip into and back out of a bare context, with none of the
+ * fiber bookkeeping on top. */
+
+struct context_bench {
+    struct cps_context  main;
+    struct cps_context  *context;
+    void  *stack;
+    bool  preserve_fpu;
+};
+
+static void
+context_bounce(void *param)
+{
+    struct context_bench  *self = param;
+    for (;;) {
+        cps_context_jump(self->context, &self->main, self, self->preserve_fpu);
+    }
+}
+
+static void
+bench_context_jump(void *user_data, unsigned long ops)
+{
+    struct context_bench  *self = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops; i++) {
+        cps_context_jump(&self->main, self->context, self, self->preserve_fpu);
+    }
+}
+
+static void
+run_context_jump(const char *name, bool preserve_fpu)
+{
+    struct context_bench  bench;
+    bench.stack = cps_stack_allocate(STACK_SIZE, 0);
+    bench.context = cps_context_new(bench.stack, STACK_SIZE, context_bounce);
+    bench.preserve_fpu = preserve_fpu;
+    bench_run(name, bench_context_jump, &bench, ROUND_TRIPS);
+    cps_stack_deallocate(bench.stack, STACK_SIZE, 0);
+}
+
+
+/*-----------------------------------------------------------------------
+ * ucontext baseline
+ */
+
+#if HAVE_UCONTEXT
+
+/* makecontext can only pass ints to the context's function, so the contexts
+ * live in globals. */
+static ucontext_t  uc_main;
+static ucontext_t  uc_fiber;
+
+static void
+ucontext_bounce(void)
+{
+    for (;;) {
+        swapcontext(&uc_fiber, &uc_main);
+    }
+}
+
+static void
+bench_swapcontext(void *user_data, unsigned long ops)
+{
+    unsigned long  i;
+    for (i = 0; i < ops; i++) {
+        swapcontext(&uc_main, &uc_fiber);
+    }
+}
+
+static void
+run_swapcontext(const char *name)
+{
+    void  *stack = cps_stack_allocate(STACK_SIZE, 0);
+    getcontext(&uc_fiber);
+    uc_fiber.uc_stack.ss_sp = stack;
+    uc_fiber.uc_stack.ss_size = STACK_SIZE;
+    uc_fiber.uc_link = NULL;
+    makecontext(&uc_fiber, ucontext_bounce, 0);
+    /* swapcontext saves and restores the signal mask, which means a system
+     * call in each direction, so it gets fewer iterations. */
+    bench_run(name, bench_swapcontext, NULL, ROUND_TRIPS / 10);
+    cps_stack_deallocate(stack, STACK_SIZE, 0);
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Fiber switch cost
+ */
+
+/* Measures the cost of a round trip into and back out of a fiber, with and
+ * without preserving the floating-point control state. */
+
+static void
+yield_forever(void *user_data, struct cps_fiber *fiber)
+{
+    for (;;) {
+        cps_fiber_yield(fiber);
+    }
+}
+
+static void
+bench_round_trip(void *user_data, unsigned long ops)
+{
+    struct cps_cont  *cont = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops; i++) {
+        cps_call(cont);
+    }
+}
+
+static void
+run_round_trip(const char *name, bool preserve_fpu)
+{
+    struct cps_fiber  *fiber =
+        cps_fiber_new(NULL, NULL, yield_forever, STACK_SIZE);
+    cps_fiber_set_preserve_fpu(fiber, preserve_fpu);
+    bench_run(name, bench_round_trip, cps_fiber_cont(fiber), ROUND_TRIPS);
+    cps_fiber_free(fiber);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Round-robin fiber handoff
+ */
+
+/* Measures the cost of passing control from one fiber to the next in a
+ * round-robin scheduler.  Fibers switch directly to each other, so each
+ * handoff should cost a single context switch.  One operation is one
+ * handoff. */
+
+#define FIBER_COUNT  16
+
+static void
+bench_rr_handoff(void *user_data, unsigned long ops)
+{
+    struct cps_rr  *rr = user_data;
+    unsigned long  i;
+    for (i = 0; i < ops / FIBER_COUNT; i++) {
+        cps_rr_run_one_lap(rr);
+    }
+}
+
+static void
+run_rr_handoff(const char *name)
+{
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *fibers[FIBER_COUNT];
+    unsigned long  i;
+
+    for (i = 0; i < FIBER_COUNT; i++) {
+        fibers[i] = cps_fiber_new(NULL, NULL, yield_forever, STACK_SIZE);
+        cps_rr_add(rr, cps_fiber_cont(fibers[i]));
+    }
+    bench_run(name, bench_rr_handoff, rr, ROUND_TRIPS);
+    cps_rr_free(rr);
+    for (i = 0; i < FIBER_COUNT; i++) {
+        cps_fiber_free(fibers[i]);
+    }
+}
+
+int
+main(int argc, const char **argv)
+{
+    run_context_jump("context jump (preserve FPU)", true);
+    run_context_jump("context jump (skip FPU)", false);
+#if HAVE_UCONTEXT
+    run_swapcontext("swapcontext");
+#endif
+    run_round_trip("fiber round trip (preserve FPU)", true);
+    run_round_trip("fiber round trip (skip FPU)", false);
+    run_rr_handoff("round-robin handoff");
+    return EXIT_SUCCESS;
+}
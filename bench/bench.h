@@ -0,0 +1,94 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC  1
+#else
+#define BENCH_HAVE_TSC  0
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Benchmark harness
+ */
+
+/* Each benchmark is a function that performs `ops` operations.  We call it
+ * once (with a tenth of the operations) to warm up caches and branch
+ * predictors, and then BENCH_REPETITIONS more times, timing each repetition.
+ * We report the fastest repetition, which is the least disturbed by the rest
+ * of the system, along with the median, so that you can see how noisy the
+ * measurement was.  Cycle counts come from the timestamp counter, which ticks
+ * at a constant rate that isn't necessarily the core's current clock
+ * speed. */
+
+#if !defined(BENCH_REPETITIONS)
+#define BENCH_REPETITIONS  5
+#endif
+
+typedef void
+(*bench_f)(void *user_data, unsigned long ops);
+
+static inline uint64_t
+bench_now(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+bench_cycles(void)
+{
+#if BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int
+bench_compare(const void *vleft, const void *vright)
+{
+    const double  *left = vleft;
+    const double  *right = vright;
+    return (*left > *right) - (*left < *right);
+}
+
+static void
+bench_run(const char *name, bench_f func, void *user_data, unsigned long ops)
+{
+    double  ns[BENCH_REPETITIONS];
+    double  cycles[BENCH_REPETITIONS];
+    unsigned int  i;
+
+    func(user_data, ops / 10 + 1);
+    for (i = 0; i < BENCH_REPETITIONS; i++) {
+        uint64_t  start_ns = bench_now();
+        uint64_t  start_cycles = bench_cycles();
+        func(user_data, ops);
+        cycles[i] = (double) (bench_cycles() - start_cycles) / ops;
+        ns[i] = (double) (bench_now() - start_ns) / ops;
+    }
+    qsort(ns, BENCH_REPETITIONS, sizeof(double), bench_compare);
+    qsort(cycles, BENCH_REPETITIONS, sizeof(double), bench_compare);
+    printf("%-36s %9.2f ns/op %9.1f cycles/op   (median %.2f ns/op)\n",
+           name, ns[0], cycles[0], ns[BENCH_REPETITIONS / 2]);
+}
+
+
+#endif /* BENCH_BENCH_H */
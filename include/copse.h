@@ -11,10 +11,19 @@
 #define COPSE_H
 
 /* include all of the parts */
+#include <copse/channel.h>
 #include <copse/context.h>
 #include <copse/cps.h>
 #include <copse/detect.h>
 #include <copse/fiber.h>
+#include <copse/future.h>
+#include <copse/priority.h>
+#include <copse/reactor.h>
 #include <copse/round-robin.h>
+#include <copse/stack.h>
+#include <copse/sync.h>
+#include <copse/timer.h>
+#include <copse/trace.h>
+#include <copse/work-stealing.h>
 
 #endif /* COPSE_H */
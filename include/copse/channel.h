@@ -0,0 +1,169 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_CHANNEL_H
+#define COPSE_CHANNEL_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <copse/fiber.h>
+#include <copse/timer.h>
+
+
+/*-----------------------------------------------------------------------
+ * Channels
+ */
+
+/* A channel passes messages (which are void pointers) from one set of fibers
+ * to another, in FIFO order.
+ *
+ * A bounded channel has a fixed-size buffer.  Sending to a full channel parks
+ * the sender until a receiver makes room; receiving from an empty channel
+ * parks the receiver until a sender provides a message.  A channel with a
+ * capacity of 0 has no buffer at all; each send waits until a receiver takes
+ * the message.  An unbounded channel stores its buffer in a list of
+ * fixed-size segments, and sending never waits.
+ *
+ * If a sender finds a receiver already waiting (or vice versa), the message is
+ * handed directly to the waiting fiber, without passing through the buffer.
+ * On an unbuffered channel, a sender that finds a waiting receiver then
+ * switches straight to it, without going through the scheduler; the sender
+ * goes to the back of the scheduler's work queue.  Otherwise, the waiting
+ * fiber is added to the work queue, so that the current fiber can keep
+ * filling or emptying the buffer without a context switch per message.
+ *
+ * Like the primitives in copse/sync.h, channels aren't thread-safe, and any
+ * fiber that uses one must be run by a round-robin scheduler in the channel's
+ * thread.  The functions that can wait must be called from within the fiber
+ * that's passed in. */
+
+struct cps_chan;
+
+/* Create a bounded channel, which can hold up to capacity messages. */
+struct cps_chan *
+cps_chan_new(size_t capacity);
+
+struct cps_chan *
+cps_chan_new_unbounded(void);
+
+/* No fibers can be waiting on the channel.  Any messages still in the buffer
+ * are discarded. */
+void
+cps_chan_free(struct cps_chan *chan);
+
+/* The number of messages in the channel's buffer. */
+size_t
+cps_chan_size(const struct cps_chan *chan);
+
+/* Send a message, waiting for room if needed.  Returns false if the channel is
+ * closed (either before we call this, or while we're waiting), in which case
+ * the message wasn't sent. */
+bool
+cps_chan_send(struct cps_chan *chan, struct cps_fiber *fiber, void *msg);
+
+/* Send a message if that doesn't require waiting.  Returns whether we sent
+ * it. */
+bool
+cps_chan_try_send(struct cps_chan *chan, void *msg);
+
+/* Receive a message, waiting for one if needed.  Returns false if the channel
+ * is closed and there aren't any messages left in its buffer. */
+bool
+cps_chan_recv(struct cps_chan *chan, struct cps_fiber *fiber, void **msg);
+
+/* Receive a message if that doesn't require waiting.  Returns whether we
+ * received one. */
+bool
+cps_chan_try_recv(struct cps_chan *chan, void **msg);
+
+/* Close the channel.  Waiting senders are woken up, and their sends fail.
+ * Receivers can still receive any buffered messages; after that, their
+ * receives fail. */
+void
+cps_chan_close(struct cps_chan *chan);
+
+bool
+cps_chan_is_closed(const struct cps_chan *chan);
+
+
+/*-----------------------------------------------------------------------
+ * Select
+ */
+
+/* Wait for whichever of several operations can happen first: sending to a
+ * channel, receiving from a channel, or reaching a deadline.  The fiber
+ * registers itself with every channel at once, and as soon as one of the
+ * operations happens, the others are cancelled before any other fiber can see
+ * them, so exactly one operation takes place.
+ *
+ * Fill in an array of cases with cps_select_send, cps_select_recv, and
+ * cps_select_deadline, and pass it to cps_select.  If more than one case is
+ * ready right away, the earliest one in the array wins. */
+
+enum cps_select_op {
+    CPS_SELECT_SEND,
+    CPS_SELECT_RECV,
+    CPS_SELECT_DEADLINE
+};
+
+struct cps_select_state;
+
+/* A fiber that's waiting to send to or receive from a channel.  You don't
+ * need to touch this yourself; it's only public so that select cases can
+ * embed it. */
+struct cps_chan_waiter {
+    struct cork_dllist_item  item;
+    struct cps_fiber  *fiber;
+    struct cps_rr  *rr;
+    void  *msg;
+    bool  ok;
+    /* If the waiter belongs to a select, the select and the index of the
+     * waiter's case. */
+    struct cps_select_state  *select;
+    size_t  index;
+};
+
+struct cps_select_case {
+    enum cps_select_op  op;
+    struct cps_chan  *chan;
+    /* The message to send, or the message that we received. */
+    void  *msg;
+    uint64_t  deadline;
+    /* Whether a send or receive succeeded; false if the channel was closed.
+     * Only filled in for the case that wins. */
+    bool  ok;
+    struct cps_chan_waiter  waiter;
+};
+
+void
+cps_select_send(struct cps_select_case *scase, struct cps_chan *chan,
+                void *msg);
+
+void
+cps_select_recv(struct cps_select_case *scase, struct cps_chan *chan);
+
+void
+cps_select_deadline(struct cps_select_case *scase, uint64_t deadline);
+
+/* Wait until one of the cases happens, and return its index.  A send or
+ * receive on a closed channel happens right away, with its ok field set to
+ * false.  If there are no deadline cases, this can wait forever.  The fiber
+ * must be run by a round-robin scheduler. */
+size_t
+cps_select(struct cps_fiber *fiber, struct cps_select_case *cases,
+           size_t count);
+
+/* Like cps_select, but return -1 instead of waiting if none of the cases can
+ * happen right away. */
+int
+cps_try_select(struct cps_select_case *cases, size_t count);
+
+
+#endif /* COPSE_CHANNEL_H */
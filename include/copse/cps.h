@@ -28,12 +28,28 @@ struct cps_cont {
     cps_cont_resume_f  resume;
 };
 
+/* Continuations are allocated from a per-thread cache of previously freed
+ * continuations, so creating and freeing them is cheap.  A continuation can
+ * be freed in a different thread than the one that created it. */
 struct cps_cont *
 cps_cont_new(void);
 
 void
 cps_cont_free(struct cps_cont *cont);
 
+/* Release the calling thread's cache of freed continuations.  You should call
+ * this before a thread that has freed continuations exits. */
+void
+cps_cont_free_cache(void);
+
+/* Initialize and finalize a continuation that you've embedded directly in some
+ * other struct, instead of allocating with cps_cont_new. */
+void
+cps_cont_init(struct cps_cont *cont);
+
+void
+cps_cont_done(struct cps_cont *cont);
+
 void
 cps_cont_set(struct cps_cont *cont,
              void *user_data, cork_free_f free_user_data,
@@ -61,4 +77,37 @@ int
 cps_run(struct cps_cont *cont);
 
 
+
+/*-----------------------------------------------------------------------
+ * Trampolines
+ */
+
+/* Normally, each continuation passes control to the next by calling it
+ * directly, which means that a chain of continuations only runs in constant
+ * stack space if the compiler turns those calls into sibling calls.  In
+ * unoptimized or instrumented builds, it usually won't.
+ *
+ * A trampoline avoids this.  If a continuation passes control with cps_jump
+ * instead of cps_resume, and it's running under a trampoline, then cps_jump
+ * just records the continuation to run next and returns.  Once the current
+ * continuation returns, the trampoline's driver loop invokes the recorded
+ * continuation.  cps_jump must be the last thing that a continuation does.
+ * If there's no trampoline running, cps_jump is the same as cps_resume.
+ *
+ * Trampolines are tracked per thread, and can be nested.  A fiber must not
+ * yield while it's running a trampoline of its own. */
+
+void
+cps_jump(struct cps_cont *cont, struct cps_cont *next);
+
+/* Resume cont under a new trampoline, returning once there are no more pending
+ * jumps. */
+void
+cps_trampoline(struct cps_cont *cont, struct cps_cont *next);
+
+/* Like cps_run, but under a trampoline. */
+int
+cps_run_trampolined(struct cps_cont *cont);
+
+
 #endif /* COPSE_CPS_H */
@@ -20,6 +20,15 @@
 #if defined(__linux__)
 #define CPS_CONFIG_BINARY_ELF    1
 #define CPS_CONFIG_ABI_SYSV      1
+#define CPS_HAVE_EVENTFD         1
+#define CPS_HAVE_EPOLL           1
+/* We check for io_uring support at runtime, but we need the kernel headers to
+ * build it. */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CPS_HAVE_IO_URING        1
+#endif
+#endif
 
 #elif defined(__APPLE__)
 #define CPS_CONFIG_BINARY_MACHO  1
@@ -10,9 +10,12 @@
 #ifndef COPSE_FIBER_H
 #define COPSE_FIBER_H
 
+#include <stdio.h>
+
 #include <libcork/core.h>
 
 #include <copse/context.h>
+#include <copse/stack.h>
 
 
 /*-----------------------------------------------------------------------
@@ -28,14 +31,217 @@ struct cps_fiber *
 cps_fiber_new(void *user_data, cork_free_f free_user_data, cps_fiber_f func,
               size_t stack_size);
 
+/* Like cps_fiber_new, but with stack allocation flags (see copse/stack.h). */
+struct cps_fiber *
+cps_fiber_new_ex(void *user_data, cork_free_f free_user_data, cps_fiber_f func,
+                 size_t stack_size, unsigned int stack_flags);
+
+/* Create a new fiber whose stack is taken from the given pool.  When the fiber
+ * is freed, its stack is returned to the pool. */
+struct cps_fiber *
+cps_fiber_new_from_pool(void *user_data, cork_free_f free_user_data,
+                        cps_fiber_f func, struct cps_stack_pool *pool);
+
+/* If the fiber's stack was created with the CPS_STACK_EMBED_FIBER flag, its
+ * continuation lives inside of the stack, and you must use this function to
+ * free the fiber, and not cps_cont_free on its continuation. */
 void
 cps_fiber_free(struct cps_fiber *fiber);
 
 struct cps_cont *
 cps_fiber_cont(struct cps_fiber *fiber);
 
+/* By default, we save and restore the floating-point control state (the MXCSR
+ * register and x87 control word on x86) each time we switch into or out of a
+ * fiber.  If you know that a fiber never changes that state, you can skip
+ * this, which makes each switch noticeably cheaper.  (You can change the
+ * default for all fibers with the PRESERVE_FPU build option.) */
+void
+cps_fiber_set_preserve_fpu(struct cps_fiber *fiber, bool preserve_fpu);
+
 void
 cps_fiber_yield(struct cps_fiber *fiber);
 
+/* Return whether the fiber's function has returned. */
+bool
+cps_fiber_is_finished(struct cps_fiber *fiber);
+
+/* Reuse a finished fiber to run a new function.  The fiber keeps its existing
+ * stack and continuation, so this doesn't allocate anything.  We free the
+ * fiber's old user_data, if needed. */
+void
+cps_fiber_reset(struct cps_fiber *fiber,
+                void *user_data, cork_free_f free_user_data, cps_fiber_f func);
+
+/* Return the maximum number of bytes of the fiber's stack that have been used
+ * so far.  The fiber's stack must have been allocated with the
+ * CPS_STACK_PAINT flag; if it wasn't, we return 0.  If the fiber is embedded
+ * in its stack (CPS_STACK_EMBED_FIBER), the embedded fiber itself doesn't
+ * count.  cps_fiber_reset repaints the stack, so this starts over each time
+ * the fiber is reused. */
+size_t
+cps_fiber_stack_high_water(struct cps_fiber *fiber);
+
+/* Accounting for how much CPU time a fiber uses.  These are only collected if
+ * copse was built with the FIBER_STATS build option; otherwise, enabled is
+ * false and everything else is 0.  A run starts whenever we switch into the
+ * fiber (by resuming it, or by another fiber transferring control to it), and
+ * ends when the fiber yields, parks, transfers control away, or finishes.
+ * Times come from cps_now, and include any time that the fiber spends blocked
+ * in a system call.  The counters start over when the fiber is reset. */
+struct cps_fiber_stats {
+    bool  enabled;
+    /* The number of times we've switched into the fiber. */
+    uint64_t  resumes;
+    /* The total time that the fiber has spent running, and its longest single
+     * run, in nanoseconds.  A fiber with a large max_run_ns is one that
+     * doesn't yield often enough, and holds up every other fiber in its
+     * scheduler. */
+    uint64_t  run_ns;
+    uint64_t  max_run_ns;
+};
+
+void
+cps_fiber_get_stats(const struct cps_fiber *fiber,
+                    struct cps_fiber_stats *dest);
+
+
+/*-----------------------------------------------------------------------
+ * Generators
+ */
+
+/* These functions let you pass pointers into and out of a fiber without going
+ * through a continuation.  Nothing is copied or allocated; the pointer is
+ * just handed across the context switch.
+ *
+ * cps_fiber_resume_with resumes a paused fiber directly (and not via its
+ * continuation), passing in `value`.  When the fiber next yields, this returns
+ * whatever value the fiber yielded.  If the fiber's function returns instead,
+ * this returns NULL, and cps_fiber_is_finished will return true.
+ *
+ * cps_fiber_yield_value must be called from within the fiber.  It yields
+ * `value` back to whoever resumed the fiber, and returns the value that's
+ * passed in the next time the fiber is resumed.  (If the fiber is resumed via
+ * its continuation, that value is NULL.) */
+
+void *
+cps_fiber_resume_with(struct cps_fiber *fiber, void *value);
+
+void *
+cps_fiber_yield_value(struct cps_fiber *fiber, void *value);
+
+
+/*-----------------------------------------------------------------------
+ * Symmetric transfer
+ */
+
+/* Return the fiber that a continuation belongs to, or NULL if the continuation
+ * isn't a fiber's continuation. */
+struct cps_fiber *
+cps_fiber_from_cont(struct cps_cont *cont);
+
+/* Pause `from`, which must be the currently running fiber, and switch directly
+ * into `to`, which must be paused, with a single context switch.  `to` takes
+ * over `from`'s place: when `to` yields or finishes, control passes to
+ * whatever `from` would have passed control to.  It's up to you to make sure
+ * that someone eventually resumes `from`, either via its continuation or with
+ * another call to this function.  Both fibers must have the same
+ * preserve_fpu setting. */
+void
+cps_fiber_transfer(struct cps_fiber *from, struct cps_fiber *to);
+
+
+/*-----------------------------------------------------------------------
+ * Parking and sleeping
+ */
+
+/* Suspend the fiber without rescheduling it.  Unlike cps_fiber_yield, the
+ * fiber's continuation is *not* passed to the continuation that resumed it;
+ * something else must arrange to resume the fiber's continuation later on
+ * (for instance, by adding it to a scheduler when some event occurs).  Must
+ * be called from within the fiber. */
+void
+cps_fiber_park(struct cps_fiber *fiber);
+
+/* Park the fiber until the given deadline (see cps_now).  The fiber must
+ * have been resumed by a round-robin scheduler, whose timer wheel is used to
+ * wake the fiber back up.  The fiber doesn't take up any space in the
+ * scheduler's work queue while it sleeps. */
+void
+cps_fiber_sleep_until(struct cps_fiber *fiber, uint64_t deadline);
+
+
+/*-----------------------------------------------------------------------
+ * Worker pools
+ */
+
+/* A worker pool hands out fibers for running short-lived tasks.  When a task's
+ * function returns, its fiber goes back into the pool, and the next call to
+ * cps_worker_pool_spawn resets it with cps_fiber_reset instead of allocating a
+ * new fiber.  Once the pool has warmed up, spawning a task doesn't allocate
+ * anything.
+ *
+ * Fibers returned by cps_worker_pool_spawn belong to the pool; you must not
+ * free them, or use them after their function returns.  Like stack pools,
+ * worker pools aren't thread-safe. */
+
+struct cps_worker_pool;
+
+/* Each worker fiber will be created with cps_fiber_new_ex, using the given
+ * stack size and flags. */
+struct cps_worker_pool *
+cps_worker_pool_new(size_t stack_size, unsigned int stack_flags);
+
+/* All of the pool's fibers must have finished before you free the pool. */
+void
+cps_worker_pool_free(struct cps_worker_pool *pool);
+
+struct cps_fiber *
+cps_worker_pool_spawn(struct cps_worker_pool *pool,
+                      void *user_data, cork_free_f free_user_data,
+                      cps_fiber_f func);
+
+size_t
+cps_worker_pool_idle_count(const struct cps_worker_pool *pool);
+
+size_t
+cps_worker_pool_busy_count(const struct cps_worker_pool *pool);
+
+/* Free idle fibers until at most max_idle remain.  You can't call this from
+ * within one of the pool's fibers. */
+void
+cps_worker_pool_trim(struct cps_worker_pool *pool, size_t max_idle);
+
+
+/*-----------------------------------------------------------------------
+ * Fiber registry
+ */
+
+/* If copse is built with the FIBER_REGISTRY build option, every fiber is
+ * added to a process-wide registry when it's created, and removed when it's
+ * freed.  You can then dump a description of every live fiber, which is useful
+ * for figuring out why a process has wedged.  For each fiber, we print its
+ * state, its stack size, and the function that it's running.  For each paused
+ * fiber, we also print a backtrace of where it's suspended, by following the
+ * frame pointer chain from the registers that were saved when it switched
+ * away.  The backtrace is only available on x86_64, and is only complete if
+ * everything on the fiber's stack was compiled with frame pointers.  We can't
+ * unwind a fiber that's currently running on some thread, and if other
+ * threads are running fibers while you dump, what we print for them might
+ * already be out of date.
+ *
+ * Adding and removing fibers takes a lock, which makes creating and freeing
+ * fibers a bit slower.  cps_fiber_dump takes the same lock, and allocates
+ * memory, so you can't call it from a signal handler; instead, have a thread
+ * wait for the signal (with sigwait, say) and dump from there.  Returns -1 and
+ * sets an error if we can't write to `out`.  Without the FIBER_REGISTRY
+ * option, there's nothing to dump, and we only print a note saying so. */
+
+bool
+cps_fiber_registry_is_enabled(void);
+
+int
+cps_fiber_dump(FILE *out);
+
 
 #endif /* COPSE_FIBER_H */
@@ -0,0 +1,151 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_FUTURE_H
+#define COPSE_FUTURE_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <copse/fiber.h>
+
+
+/*-----------------------------------------------------------------------
+ * Futures
+ */
+
+/* A future holds a value (a void pointer) that isn't available yet.  Whoever
+ * produces the value (the promise side) calls cps_future_set exactly once;
+ * anyone who wants the value can wait for that to happen.
+ *
+ * Fibers wait with cps_future_wait, which parks the fiber until the value is
+ * set, and then adds it back to the work queue of the round-robin scheduler
+ * that was running it.  Plain continuations (or anything else) can register a
+ * waiter, whose callback is called as soon as the value is set; the callback
+ * will usually add a continuation to a scheduler.  Nothing polls, and nothing
+ * allocates any memory, except for cps_future_when_any when it has to wait on
+ * more than a handful of futures (see below).
+ *
+ * Like the primitives in copse/sync.h, futures aren't thread-safe; everything
+ * that touches a particular future must run in the same thread. */
+
+struct cps_future {
+    bool  ready;
+    void  *value;
+    struct cork_dllist  waiters;
+};
+
+void
+cps_future_init(struct cps_future *future);
+
+/* No one can be waiting on the future. */
+void
+cps_future_done(struct cps_future *future);
+
+/* Forget the future's value, so that it can be set again.  No one can be
+ * waiting on the future. */
+void
+cps_future_reset(struct cps_future *future);
+
+#define cps_future_is_ready(future)  ((future)->ready)
+
+/* Return the future's value, which must already be set. */
+void *
+cps_future_get(const struct cps_future *future);
+
+/* Set the future's value, and notify everyone who's waiting for it, in the
+ * order that they started waiting.  The future can't already be set. */
+void
+cps_future_set(struct cps_future *future, void *value);
+
+/* Wait until the future's value is set, and return it.  If it's already set,
+ * we return right away.  Must be called from within the fiber, which must be
+ * run by a round-robin scheduler. */
+void *
+cps_future_wait(struct cps_future *future, struct cps_fiber *fiber);
+
+
+/*-----------------------------------------------------------------------
+ * Waiters
+ */
+
+struct cps_future_waiter;
+
+typedef void
+(*cps_future_ready_f)(struct cps_future_waiter *waiter);
+
+/* A callback that's called when a future's value is set.  Like a timer, the
+ * waiter doesn't allocate any memory of its own, and must stay alive until
+ * it's called or removed. */
+struct cps_future_waiter {
+    struct cork_dllist_item  item;
+    cps_future_ready_f  ready;
+    void  *user_data;
+};
+
+void
+cps_future_waiter_init(struct cps_future_waiter *waiter,
+                       cps_future_ready_f ready, void *user_data);
+
+/* If the future is already set, the waiter's callback is called right away,
+ * before this function returns. */
+void
+cps_future_add_waiter(struct cps_future *future,
+                      struct cps_future_waiter *waiter);
+
+/* Remove a waiter whose callback hasn't been called yet. */
+void
+cps_future_remove_waiter(struct cps_future *future,
+                         struct cps_future_waiter *waiter);
+
+
+/*-----------------------------------------------------------------------
+ * Combinators
+ */
+
+/* Wait until every one of the futures is set. */
+void
+cps_future_when_all(struct cps_fiber *fiber,
+                    struct cps_future **futures, size_t count);
+
+/* Wait until at least one of the futures is set, and return its index.  If
+ * more than one is already set, the earliest one in the array wins.  The
+ * array must not be empty, but it can contain the same future more than once.
+ * The fiber stops waiting on all of the other futures before this returns.  We
+ * need a waiter for each future; if there are more than 8 futures, and none
+ * of them are set yet, we allocate the waiters on the heap, and free them
+ * before returning. */
+size_t
+cps_future_when_any(struct cps_fiber *fiber,
+                    struct cps_future **futures, size_t count);
+
+
+/*-----------------------------------------------------------------------
+ * Joining fibers
+ */
+
+/* Every fiber has a future, which is set when the fiber's function returns.
+ * Its value is the fiber's result, which is NULL unless the fiber calls
+ * cps_fiber_set_result.  You can pass this future to the combinators above to
+ * wait for several fibers at once.  The future is reset when the fiber is
+ * reset. */
+struct cps_future *
+cps_fiber_future(struct cps_fiber *fiber);
+
+/* Must be called from within the fiber. */
+void
+cps_fiber_set_result(struct cps_fiber *fiber, void *result);
+
+/* Wait until `target` finishes, and return its result.  Must be called from
+ * within `fiber`, which must be run by a round-robin scheduler. */
+void *
+cps_fiber_join(struct cps_fiber *fiber, struct cps_fiber *target);
+
+
+#endif /* COPSE_FUTURE_H */
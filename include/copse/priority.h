@@ -0,0 +1,68 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_PRIORITY_H
+#define COPSE_PRIORITY_H
+
+
+#include <copse/cps.h>
+
+
+/* A priority scheduler has a fixed number of priority levels, each with its
+ * own round-robin work queue.  Level 0 is the highest priority.
+ *
+ * To keep the lower levels from starving, each level has a quota: the number
+ * of continuations that it can run in each scheduling cycle.  The scheduler
+ * always runs the highest-priority continuation whose level still has some of
+ * its quota left.  Once every level with pending work has used up its quota,
+ * a new cycle starts.  A busy level can therefore delay a lower level by at
+ * most the sum of the higher levels' quotas. */
+
+#define CPS_PRIO_LEVEL_COUNT  4
+
+struct cps_prio;
+
+struct cps_prio *
+cps_prio_new(void);
+
+void
+cps_prio_free(struct cps_prio *prio);
+
+/* Set the quota of a priority level.  The quota must be at least 1.  By
+ * default, each level's quota is four times the quota of the level below it,
+ * and the lowest level's quota is 1. */
+void
+cps_prio_set_quota(struct cps_prio *prio, unsigned int level,
+                   unsigned int quota);
+
+/* Run the scheduler's continuations under a trampoline; see
+ * cps_rr_set_trampolined. */
+void
+cps_prio_set_trampolined(struct cps_prio *prio, bool trampolined);
+
+/* Add a continuation to the end of one of the priority levels' work queues.
+ * Like cps_rr_add, this can be called from a continuation that the scheduler
+ * started, but it's not thread-safe. */
+void
+cps_prio_add(struct cps_prio *prio, unsigned int level,
+             struct cps_cont *cont);
+
+/* Each level has its own yield continuation, which requeues the continuation
+ * that's passed to it at that level.  The scheduler always passes in the yield
+ * continuation for the level that the continuation was scheduled at. */
+struct cps_cont *
+cps_prio_get_yield(struct cps_prio *prio, unsigned int level);
+
+/* Execute continuations, in priority order, until all of the work queues are
+ * empty. */
+int
+cps_prio_drain(struct cps_prio *prio);
+
+
+#endif /* COPSE_PRIORITY_H */
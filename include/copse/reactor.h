@@ -0,0 +1,127 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_REACTOR_H
+#define COPSE_REACTOR_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <libcork/core.h>
+
+#include <copse/cps.h>
+#include <copse/fiber.h>
+#include <copse/round-robin.h>
+
+
+/*-----------------------------------------------------------------------
+ * I/O readiness
+ */
+
+/* Each round-robin scheduler can have a reactor, which waits for file
+ * descriptors to become ready (using epoll, where available).  A continuation
+ * that's waiting for a descriptor doesn't take up any space in the
+ * scheduler's work queue; the reactor adds it back to the work queue once the
+ * descriptor is ready.  The scheduler checks the reactor every so often while
+ * it's running, and cps_rr_drain blocks in the reactor once its work queue is
+ * empty.
+ *
+ * Descriptors are registered in edge-triggered mode, so they must be
+ * nonblocking, and you should only wait for a descriptor after a read or write
+ * fails with EAGAIN.  (Otherwise you might wait for an edge that's already
+ * happened.) */
+
+/* Create the scheduler's reactor ahead of time.  You only need to call this
+ * if you want to pass in flags; cps_io_init creates the reactor on demand
+ * otherwise.  Returns -1 and sets an error if the reactor can't be created. */
+int
+cps_rr_enable_reactor(struct cps_rr *rr, unsigned int flags);
+
+/* Don't use io_uring for cps_fiber_read and friends, even if the kernel
+ * supports it. */
+#define CPS_REACTOR_NO_URING  0x01
+
+/* Whether the scheduler's reactor is using io_uring. */
+bool
+cps_rr_reactor_has_uring(struct cps_rr *rr);
+
+#define CPS_IO_READ   0x01
+#define CPS_IO_WRITE  0x02
+
+struct cps_reactor;
+
+/* A file descriptor that's registered with a scheduler's reactor.  At most one
+ * continuation can wait for each direction at a time. */
+struct cps_io {
+    int  fd;
+    struct cps_reactor  *reactor;
+    struct cps_cont  *reader;
+    struct cps_cont  *writer;
+    /* False for descriptors that epoll doesn't support, like regular files,
+     * which are always ready. */
+    bool  pollable;
+};
+
+/* Register fd with the scheduler's reactor, creating the reactor if needed.
+ * Returns -1 and sets an error if the descriptor can't be registered. */
+int
+cps_io_init(struct cps_io *io, struct cps_rr *rr, int fd);
+
+/* Unregister the descriptor.  Nothing can be waiting for it.  You must call
+ * this before closing the descriptor. */
+void
+cps_io_done(struct cps_io *io);
+
+/* Add cont to the scheduler's work queue once the descriptor is ready for any
+ * of the given events (CPS_IO_READ and/or CPS_IO_WRITE).  An error or hangup
+ * on the descriptor counts as ready for both. */
+void
+cps_io_wait(struct cps_io *io, unsigned int events, struct cps_cont *cont);
+
+/* Park a fiber until the descriptor is ready for any of the given events.
+ * Like cps_fiber_sleep_until, the fiber must be run by the same round-robin
+ * scheduler that the descriptor is registered with. */
+void
+cps_fiber_wait_io(struct cps_fiber *fiber, struct cps_io *io,
+                  unsigned int events);
+
+
+/*-----------------------------------------------------------------------
+ * Fiber I/O
+ */
+
+/* Blocking-style I/O for fibers.  Each of these parks the fiber until the
+ * operation finishes, while the scheduler runs other continuations.  Where
+ * io_uring is available, the operation is queued up, and the scheduler
+ * submits every operation that its continuations have queued in a single
+ * batch, at the end of each lap (or before it blocks, while draining).
+ * Otherwise, we perform the operation directly, waiting for the descriptor to
+ * become ready as needed.  (fsync blocks the whole scheduler in that case.)
+ *
+ * These return the same results as the corresponding system calls.  On
+ * error, they return -1, and set errno and the current error. */
+
+ssize_t
+cps_fiber_read(struct cps_fiber *fiber, struct cps_io *io,
+               void *buf, size_t size);
+
+ssize_t
+cps_fiber_write(struct cps_fiber *fiber, struct cps_io *io,
+                const void *buf, size_t size);
+
+/* The new socket is nonblocking and close-on-exec. */
+int
+cps_fiber_accept(struct cps_fiber *fiber, struct cps_io *io,
+                 struct sockaddr *addr, socklen_t *addr_len);
+
+int
+cps_fiber_fsync(struct cps_fiber *fiber, struct cps_io *io);
+
+
+#endif /* COPSE_REACTOR_H */
@@ -12,6 +12,7 @@
 
 
 #include <copse/cps.h>
+#include <copse/timer.h>
 
 
 struct cps_rr;
@@ -19,15 +20,66 @@ struct cps_rr;
 struct cps_rr *
 cps_rr_new(void);
 
+/* The scheduler doesn't own any of the continuations or timers that you add
+ * to it, so freeing it doesn't free any that are still in its work queue, its
+ * inbox, or its timer wheel; those are simply forgotten.  (It does free its
+ * own bookkeeping for any cps_sleep_cont calls that haven't fired yet.)  If
+ * you need those continuations to run, or to clean up after them, drain the
+ * scheduler before freeing it. */
 void
 cps_rr_free(struct cps_rr *rr);
 
+/* Run the scheduler's continuations under a trampoline (see copse/cps.h), so
+ * that the scheduler uses a constant amount of stack space even if the
+ * compiler doesn't perform sibling call optimization.  The default for new
+ * schedulers is controlled by the TRAMPOLINE build option. */
+void
+cps_rr_set_trampolined(struct cps_rr *rr, bool trampolined);
+
 /* Add a continuation to the end of the round-robin scheduler's work queue.
  * This can be safely called from a continuation that the scheduler started.
  * It's *not* thread-safe, though. */
 void
 cps_rr_add(struct cps_rr *rr, struct cps_cont *cont);
 
+/* Add a continuation to the scheduler from some other thread.  This is
+ * thread-safe and lock-free; the continuation is placed in an inbox, which the
+ * scheduler's own thread moves into the work queue at the start of each lap
+ * (and after each continuation, while draining). */
+void
+cps_rr_add_remote(struct cps_rr *rr, struct cps_cont *cont);
+
+/* Create a file descriptor (an eventfd, if available) that becomes readable
+ * whenever another thread adds a continuation to an empty inbox.  This lets
+ * an idle scheduler sleep until there's something for it to do.  Returns -1
+ * and sets an error if the file descriptor can't be created. */
+int
+cps_rr_enable_wakeup(struct cps_rr *rr);
+
+/* Returns the wakeup file descriptor, or -1 if wakeups aren't enabled.  You
+ * can add this to your own event loop, if you have one.  Don't read from it
+ * yourself; the scheduler clears it. */
+int
+cps_rr_get_wakeup_fd(struct cps_rr *rr);
+
+/* Block until the inbox isn't empty.  Wakeups must be enabled. */
+int
+cps_rr_wait(struct cps_rr *rr);
+
+/* Each scheduler has its own timer wheel.  Expired timers fire from within
+ * the scheduler's thread, while it's running a lap or draining.  A timer's
+ * fire function will usually add a continuation to the scheduler. */
+void
+cps_rr_add_timer(struct cps_rr *rr, struct cps_timer *timer);
+
+void
+cps_rr_cancel_timer(struct cps_rr *rr, struct cps_timer *timer);
+
+/* Add cont to the scheduler's work queue once the deadline passes.  Until
+ * then, it doesn't take up any space in the work queue. */
+void
+cps_sleep_cont(struct cps_rr *rr, uint64_t deadline, struct cps_cont *cont);
+
 struct cps_cont *
 cps_rr_get_yield(struct cps_rr *rr);
 
@@ -41,9 +93,58 @@ cps_rr_run_one_lap(struct cps_rr *rr);
 /* Execute all of the continuations that are in the round-robin scheduler's work
  * queue.  If these continuations add anything to the work queue, execute those
  * continuations as well.  Repeat until there is nothing left in the work queue,
- * then invoke the `next` continuation. */
+ * then invoke the `next` continuation.  If the work queue is empty but there
+ * are timers that haven't fired yet, or continuations that are waiting for
+ * file descriptors (see copse/reactor.h), we block until one of those events
+ * occurs, rather than returning. */
 int
 cps_rr_drain(struct cps_rr *rr);
 
+/* Runtime statistics.  These are only collected if copse was built with the
+ * RR_STATS build option; otherwise, enabled is false and everything else is
+ * 0.  When they're compiled out, they cost nothing; when they're compiled in,
+ * they cost a few increments per continuation, plus two clock reads per
+ * drain. */
+struct cps_rr_stats {
+    bool  enabled;
+    /* The number of times the scheduler has passed control to a
+     * continuation (including fibers that switch directly to each other). */
+    uint64_t  resumed;
+    /* The number of calls to cps_rr_run_one_lap, the number of continuations
+     * that ran during the most recent one, and the most that ran during any
+     * one lap. */
+    uint64_t  laps;
+    uint64_t  last_lap_resumed;
+    uint64_t  max_lap_resumed;
+    /* The number of calls to cps_rr_drain, and how long they took. */
+    uint64_t  drains;
+    uint64_t  last_drain_ns;
+    uint64_t  max_drain_ns;
+    uint64_t  total_drain_ns;
+    /* The number of times that cps_rr_drain blocked, waiting for timers,
+     * I/O, or wakeups, and how long it spent blocked in total. */
+    uint64_t  waits;
+    uint64_t  wait_ns;
+    /* The number of continuations added with cps_rr_add_remote. */
+    uint64_t  remote_adds;
+    /* The number of continuations in the work queue right now, and the most
+     * that there have ever been. */
+    size_t  queue_length;
+    size_t  peak_queue_length;
+    /* The work queue's allocated size, and the number of times it has been
+     * resized. */
+    size_t  queue_size;
+    uint64_t  queue_resizes;
+};
+
+/* Take a snapshot of the scheduler's statistics. */
+void
+cps_rr_get_stats(const struct cps_rr *rr, struct cps_rr_stats *dest);
+
+/* Reset the scheduler's counters to 0 (and its peak queue length to the
+ * current length), so that you can collect statistics over an interval. */
+void
+cps_rr_reset_stats(struct cps_rr *rr);
+
 
 #endif /* COPSE_ROUND_ROBIN_H */
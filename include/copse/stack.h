@@ -0,0 +1,135 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_STACK_H
+#define COPSE_STACK_H
+
+#include <libcork/core.h>
+
+
+/*-----------------------------------------------------------------------
+ * Stacks
+ */
+
+#define CPS_DEFAULT_STACK_SIZE  (1 << 20)  /* 1 MB */
+
+/* Flags that control how a stack is allocated. */
+
+/* Reserve the stack using mmap instead of the heap.  The stack's pages are
+ * only committed as they're touched, and there is an inaccessible guard page
+ * just past the end of the stack, so that an overflow causes a segfault
+ * instead of corrupting some other part of memory. */
+#define CPS_STACK_MMAP  0x0001
+
+/* Fill the stack with a known byte pattern when it's allocated, so that we can
+ * later measure how much of the stack was actually used.  (Note that painting
+ * touches every page of the stack, so this negates the lazy commit that you'd
+ * otherwise get from CPS_STACK_MMAP.) */
+#define CPS_STACK_PAINT  0x0002
+
+/* Only meaningful for fiber stacks.  Instead of allocating the fiber's control
+ * block and continuation separately, carve them out of the top of the stack,
+ * right next to the fiber's saved context.  This means that creating a fiber
+ * needs only a single allocation (or none at all, if the stack comes from a
+ * pool). */
+#define CPS_STACK_EMBED_FIBER  0x0004
+
+/* Allocate a new stack that is at least size bytes long.  The result points at
+ * the lowest address of the stack, regardless of which direction stacks grow
+ * on this platform. */
+void *
+cps_stack_allocate(size_t size, unsigned int flags);
+
+/* Free a stack that was allocated with cps_stack_allocate.  You must pass in
+ * the same size and flags that you used to allocate it. */
+void
+cps_stack_deallocate(void *stack, size_t size, unsigned int flags);
+
+/* Return the maximum number of bytes of a painted stack that have ever been
+ * used.  This scans the unused portion of the stack, so it's not free. */
+size_t
+cps_stack_high_water(const void *stack, size_t size);
+
+
+/*-----------------------------------------------------------------------
+ * Stack pools
+ */
+
+struct cps_stack_pool;
+
+/* Create a new pool of stacks, all of which are stack_size bytes long.  (If
+ * stack_size is 0, we use CPS_DEFAULT_STACK_SIZE.)  Each pool handles a single
+ * size class; we round stack_size up to a multiple of the page size.  The
+ * flags parameter controls how each stack is allocated, just like for
+ * cps_stack_allocate.
+ *
+ * We preallocate low_watermark stacks when the pool is created.  When a stack
+ * is released back into the pool, we keep it around for later reuse, unless
+ * there are already high_watermark idle stacks, in which case we free it.
+ *
+ * A pool is *not* thread-safe; all of the fibers that use a pool must be
+ * created and freed in the same thread. */
+struct cps_stack_pool *
+cps_stack_pool_new(size_t stack_size, unsigned int flags,
+                   size_t low_watermark, size_t high_watermark);
+
+/* All of the stacks that were acquired from the pool must have been released
+ * before you free the pool. */
+void
+cps_stack_pool_free(struct cps_stack_pool *pool);
+
+size_t
+cps_stack_pool_stack_size(const struct cps_stack_pool *pool);
+
+unsigned int
+cps_stack_pool_flags(const struct cps_stack_pool *pool);
+
+/* The number of stacks in the pool that are ready to be reused. */
+size_t
+cps_stack_pool_idle_count(const struct cps_stack_pool *pool);
+
+/* The number of stacks that have been acquired and not yet released. */
+size_t
+cps_stack_pool_used_count(const struct cps_stack_pool *pool);
+
+/* Free idle stacks until only low_watermark of them remain. */
+void
+cps_stack_pool_trim(struct cps_stack_pool *pool);
+
+/* Return a stack from the pool, allocating a new one if there aren't any idle
+ * stacks available.  Like cps_stack_allocate, the result points at the lowest
+ * address of the stack. */
+void *
+cps_stack_pool_acquire(struct cps_stack_pool *pool);
+
+void
+cps_stack_pool_release(struct cps_stack_pool *pool, void *stack);
+
+/* If a pool was created with the CPS_STACK_PAINT flag, we measure the
+ * high-water mark of each stack when it's released back into the pool, and
+ * keep a histogram of the results.  Bucket i counts the stacks whose
+ * high-water mark was at least 2^i bytes but less than 2^(i+1) bytes.  (Bucket
+ * 0 also counts the stacks that were never used at all.)  For fibers, we
+ * measure the same part of the stack as cps_fiber_stack_high_water, and we
+ * also record a high-water mark each time a fiber is reset. */
+
+#define CPS_STACK_HISTOGRAM_SIZE  32
+
+struct cps_stack_histogram {
+    size_t  counts[CPS_STACK_HISTOGRAM_SIZE];
+    /* The largest high-water mark that we've seen for any stack. */
+    size_t  max;
+};
+
+void
+cps_stack_pool_get_histogram(const struct cps_stack_pool *pool,
+                             struct cps_stack_histogram *dest);
+
+
+#endif /* COPSE_STACK_H */
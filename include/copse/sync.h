@@ -0,0 +1,129 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_SYNC_H
+#define COPSE_SYNC_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <copse/fiber.h>
+
+
+/* Synchronization primitives for fibers.  A fiber that has to wait is parked,
+ * rather than blocking the whole thread, and is added back to the work queue
+ * of the round-robin scheduler that was running it once it can continue.  The
+ * waiting fiber's bookkeeping lives on its own stack, so none of these
+ * functions allocate any memory.
+ *
+ * Any function that can wait must be called from within the fiber that's
+ * passed in, and that fiber must be run by a round-robin scheduler.  These
+ * primitives aren't thread-safe; every fiber that uses a particular mutex,
+ * condition variable, or semaphore must run in the same thread.  Waiters are
+ * always woken up in the order that they started waiting. */
+
+
+/*-----------------------------------------------------------------------
+ * Mutexes
+ */
+
+struct cps_mutex {
+    bool  locked;
+    struct cork_dllist  waiters;
+};
+
+void
+cps_mutex_init(struct cps_mutex *mutex);
+
+/* The mutex must be unlocked. */
+void
+cps_mutex_done(struct cps_mutex *mutex);
+
+void
+cps_mutex_lock(struct cps_mutex *mutex, struct cps_fiber *fiber);
+
+/* Lock the mutex if that doesn't require waiting.  Returns whether we locked
+ * it. */
+bool
+cps_mutex_try_lock(struct cps_mutex *mutex);
+
+/* If any fibers are waiting for the mutex, ownership passes directly to the
+ * first one, so a fiber that keeps relocking the mutex can't starve the
+ * others. */
+void
+cps_mutex_unlock(struct cps_mutex *mutex);
+
+
+/*-----------------------------------------------------------------------
+ * Condition variables
+ */
+
+struct cps_cond {
+    struct cork_dllist  waiters;
+};
+
+void
+cps_cond_init(struct cps_cond *cond);
+
+/* No fibers can be waiting on the condition variable. */
+void
+cps_cond_done(struct cps_cond *cond);
+
+/* Unlock the mutex and wait until the condition variable is signalled; the
+ * mutex is locked again when this returns.  The fiber must hold the mutex.
+ * There are no spurious wakeups, but another fiber might have changed the
+ * state you're waiting for before you get the mutex back, so you should still
+ * check it in a loop. */
+void
+cps_cond_wait(struct cps_cond *cond, struct cps_mutex *mutex,
+              struct cps_fiber *fiber);
+
+/* Wake up the first fiber that's waiting on the condition variable, if any.
+ * If its mutex is locked, the fiber moves straight to the mutex's wait list,
+ * instead of being scheduled only to find the mutex locked. */
+void
+cps_cond_signal(struct cps_cond *cond);
+
+/* Wake up every fiber that's waiting on the condition variable. */
+void
+cps_cond_broadcast(struct cps_cond *cond);
+
+
+/*-----------------------------------------------------------------------
+ * Semaphores
+ */
+
+struct cps_sem {
+    size_t  value;
+    struct cork_dllist  waiters;
+};
+
+void
+cps_sem_init(struct cps_sem *sem, size_t value);
+
+/* No fibers can be waiting on the semaphore. */
+void
+cps_sem_done(struct cps_sem *sem);
+
+/* Wait until the semaphore's value is positive, and then decrement it. */
+void
+cps_sem_wait(struct cps_sem *sem, struct cps_fiber *fiber);
+
+/* Decrement the semaphore's value if that doesn't require waiting.  Returns
+ * whether we decremented it. */
+bool
+cps_sem_try_wait(struct cps_sem *sem);
+
+/* Increment the semaphore's value.  If any fibers are waiting, the first one
+ * takes the increment directly. */
+void
+cps_sem_post(struct cps_sem *sem);
+
+
+#endif /* COPSE_SYNC_H */
@@ -0,0 +1,104 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_TIMER_H
+#define COPSE_TIMER_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+
+/*-----------------------------------------------------------------------
+ * Time
+ */
+
+/* All times are measured in nanoseconds, using a monotonic clock.  The epoch
+ * is arbitrary, so times are only meaningful relative to each other. */
+
+#define CPS_NSEC_PER_MSEC  1000000ULL
+#define CPS_NSEC_PER_SEC   1000000000ULL
+
+uint64_t
+cps_now(void);
+
+
+/*-----------------------------------------------------------------------
+ * Timers
+ */
+
+struct cps_timer;
+
+typedef void
+(*cps_timer_f)(struct cps_timer *timer);
+
+/* A timer that will fire at some deadline.  The timer doesn't allocate any
+ * memory of its own; you'll usually embed a timer in some larger struct, and
+ * use cork_container_of or the user_data field to get back to it when it
+ * fires.  The timer must stay alive until it fires or is cancelled. */
+struct cps_timer {
+    struct cork_dllist_item  item;
+    uint64_t  deadline;
+    cps_timer_f  fire;
+    void  *user_data;
+    bool  active;
+};
+
+void
+cps_timer_init(struct cps_timer *timer, uint64_t deadline,
+               cps_timer_f fire, void *user_data);
+
+/* Whether the timer has been added to a wheel and hasn't fired or been
+ * cancelled yet. */
+#define cps_timer_is_active(timer)  ((timer)->active)
+
+
+/*-----------------------------------------------------------------------
+ * Timer wheels
+ */
+
+/* A hierarchical timer wheel.  Deadlines are rounded up to the next multiple
+ * of CPS_TIMER_TICK nanoseconds (1ms by default), and a timer never fires
+ * before its deadline.  Adding and cancelling timers takes constant time, as
+ * does advancing the wheel by one tick. */
+
+struct cps_timer_wheel;
+
+struct cps_timer_wheel *
+cps_timer_wheel_new(void);
+
+/* Any timers that are still in the wheel are discarded without firing. */
+void
+cps_timer_wheel_free(struct cps_timer_wheel *wheel);
+
+/* The number of timers that haven't fired yet. */
+size_t
+cps_timer_wheel_count(const struct cps_timer_wheel *wheel);
+
+void
+cps_timer_wheel_add(struct cps_timer_wheel *wheel, struct cps_timer *timer);
+
+/* Cancel a timer, if it's still active. */
+void
+cps_timer_wheel_cancel(struct cps_timer_wheel *wheel, struct cps_timer *timer);
+
+/* Return the time that the wheel should next be advanced to, or UINT64_MAX if
+ * there aren't any active timers.  This is no later than the tick at which the
+ * earliest timer will fire.  (The wheel might need to be advanced several
+ * times before that timer actually fires.) */
+uint64_t
+cps_timer_wheel_next_deadline(const struct cps_timer_wheel *wheel);
+
+/* Fire every timer whose deadline, rounded up to the next tick, is no later
+ * than now.  A timer's fire function can safely add and cancel other
+ * timers. */
+void
+cps_timer_wheel_advance(struct cps_timer_wheel *wheel, uint64_t now);
+
+
+#endif /* COPSE_TIMER_H */
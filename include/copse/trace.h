@@ -0,0 +1,64 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_TRACE_H
+#define COPSE_TRACE_H
+
+#include <stdio.h>
+
+#include <libcork/core.h>
+
+
+/*-----------------------------------------------------------------------
+ * Event tracing
+ */
+
+/* If copse is built with the TRACE build option, fibers and round-robin
+ * schedulers record an event each time a fiber is created, resumed, yields,
+ * parks, or finishes, and each time a scheduler starts or finishes a lap or a
+ * drain.  Each thread records its events into its own fixed-size ring buffer,
+ * without any locking; once a buffer fills up, the oldest events are
+ * overwritten.  Without the TRACE option, nothing is recorded, and the hooks
+ * compile away to nothing.
+ *
+ * You can write out all of the recorded events in the Chrome trace event
+ * format, which you can load into chrome://tracing or Perfetto to see how
+ * fibers and schedulers were interleaved.  Each thread is shown as a separate
+ * track. */
+
+enum cps_trace_event {
+    CPS_TRACE_FIBER_CREATE,
+    CPS_TRACE_FIBER_RESUME,
+    CPS_TRACE_FIBER_YIELD,
+    CPS_TRACE_FIBER_PARK,
+    CPS_TRACE_FIBER_FINISH,
+    CPS_TRACE_RR_LAP_START,
+    CPS_TRACE_RR_LAP_END,
+    CPS_TRACE_RR_DRAIN_START,
+    CPS_TRACE_RR_DRAIN_END
+};
+
+/* Whether copse was built with tracing enabled. */
+bool
+cps_trace_is_enabled(void);
+
+/* Write every thread's recorded events to `out`, as a Chrome trace JSON
+ * object.  Other threads should be idle while you do this; otherwise, some of
+ * their most recent events might be garbled.  Returns -1 and sets an error if
+ * we can't write to `out`. */
+int
+cps_trace_write_json(FILE *out);
+
+/* Discard every thread's recorded events.  As above, other threads should be
+ * idle. */
+void
+cps_trace_clear(void);
+
+
+#endif /* COPSE_TRACE_H */
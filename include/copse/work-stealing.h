@@ -0,0 +1,66 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef COPSE_WORK_STEALING_H
+#define COPSE_WORK_STEALING_H
+
+
+#include <copse/cps.h>
+
+
+/* A work-stealing scheduler spreads continuations across several worker
+ * threads.  Each worker has its own deque of continuations; when a worker runs
+ * out of work, it steals the oldest continuation from a randomly chosen
+ * worker's deque.  Its interface mirrors the round-robin scheduler's, so that
+ * code written against one can use the other.
+ *
+ * A continuation can be resumed on a different thread each time it's
+ * scheduled, so any state that it shares with other continuations must be
+ * protected accordingly.  Each worker yields to its own continuations in
+ * round-robin order. */
+
+struct cps_ws;
+
+/* Create a new work-stealing scheduler with thread_count worker threads.  If
+ * thread_count is 0, we create one worker for each online CPU. */
+struct cps_ws *
+cps_ws_new(unsigned int thread_count);
+
+void
+cps_ws_free(struct cps_ws *ws);
+
+unsigned int
+cps_ws_thread_count(const struct cps_ws *ws);
+
+/* Run the scheduler's continuations under a trampoline; see
+ * cps_rr_set_trampolined. */
+void
+cps_ws_set_trampolined(struct cps_ws *ws, bool trampolined);
+
+/* Add a continuation to the scheduler.  If you call this from a continuation
+ * that the scheduler is running, the new continuation is added to the current
+ * worker's deque.  Otherwise, new continuations are spread across the workers
+ * evenly.  While cps_ws_drain is running, this can only be called from the
+ * scheduler's own workers. */
+void
+cps_ws_add(struct cps_ws *ws, struct cps_cont *cont);
+
+struct cps_cont *
+cps_ws_get_yield(struct cps_ws *ws);
+
+/* Start the worker threads (the calling thread acts as one of them), and run
+ * continuations until every worker's deque is empty and none of them are
+ * running a continuation.  If any continuation fails, we stop all of the
+ * workers and return the error; the continuations that haven't run yet stay
+ * in the scheduler. */
+int
+cps_ws_drain(struct cps_ws *ws);
+
+
+#endif /* COPSE_WORK_STEALING_H */
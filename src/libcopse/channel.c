@@ -0,0 +1,583 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "copse/channel.h"
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/round-robin.h"
+#include "copse/timer.h"
+
+/* Defined in fiber.c */
+struct cps_rr *
+cps_fiber__get_rr(struct cps_fiber *fiber);
+
+bool
+cps_fiber__switch_to(struct cps_fiber *from, struct cps_fiber *to);
+
+
+#if !defined(CPS_DEBUG_CHAN)
+#define CPS_DEBUG_CHAN  0
+#endif
+
+#if CPS_DEBUG_CHAN
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+
+/* The number of messages in each segment of an unbounded channel. */
+#define SEGMENT_SIZE  64
+
+struct cps_chan_segment {
+    struct cps_chan_segment  *next;
+    void  *msgs[SEGMENT_SIZE];
+};
+
+struct cps_chan {
+    bool  unbounded;
+    bool  closed;
+    size_t  size;
+
+    /* For bounded channels, a ring buffer.  (This is NULL if the capacity is
+     * 0.) */
+    void  **ring;
+    size_t  capacity;
+    size_t  head;
+
+    /* For unbounded channels, a list of segments.  We receive from head_index
+     * in the head segment, and send to tail_index in the tail segment.  We
+     * keep one empty segment around, so that a channel whose size hovers
+     * around a segment boundary doesn't allocate and free a segment on every
+     * message. */
+    struct cps_chan_segment  *head_segment;
+    size_t  head_index;
+    struct cps_chan_segment  *tail_segment;
+    size_t  tail_index;
+    struct cps_chan_segment  *spare_segment;
+
+    struct cork_dllist  senders;
+    struct cork_dllist  receivers;
+};
+
+
+/*-----------------------------------------------------------------------
+ * Buffers
+ */
+
+static struct cps_chan_segment *
+cps_chan__new_segment(struct cps_chan *chan)
+{
+    struct cps_chan_segment  *segment = chan->spare_segment;
+    if (segment == NULL) {
+        segment = cork_new(struct cps_chan_segment);
+    } else {
+        chan->spare_segment = NULL;
+    }
+    segment->next = NULL;
+    return segment;
+}
+
+static void
+cps_chan__free_segment(struct cps_chan *chan, struct cps_chan_segment *segment)
+{
+    if (chan->spare_segment == NULL) {
+        chan->spare_segment = segment;
+    } else {
+        cork_delete(struct cps_chan_segment, segment);
+    }
+}
+
+#define cps_chan__is_full(chan) \
+    (!(chan)->unbounded && (chan)->size == (chan)->capacity)
+
+static void
+cps_chan__push(struct cps_chan *chan, void *msg)
+{
+    assert(!cps_chan__is_full(chan));
+    if (chan->unbounded) {
+        if (chan->tail_index == SEGMENT_SIZE) {
+            struct cps_chan_segment  *segment = cps_chan__new_segment(chan);
+            chan->tail_segment->next = segment;
+            chan->tail_segment = segment;
+            chan->tail_index = 0;
+        }
+        chan->tail_segment->msgs[chan->tail_index++] = msg;
+    } else {
+        size_t  tail = chan->head + chan->size;
+        if (tail >= chan->capacity) {
+            tail -= chan->capacity;
+        }
+        chan->ring[tail] = msg;
+    }
+    chan->size++;
+}
+
+static void *
+cps_chan__pop(struct cps_chan *chan)
+{
+    void  *msg;
+    assert(chan->size > 0);
+    if (chan->unbounded) {
+        if (chan->head_index == SEGMENT_SIZE) {
+            struct cps_chan_segment  *segment = chan->head_segment;
+            chan->head_segment = segment->next;
+            chan->head_index = 0;
+            cps_chan__free_segment(chan, segment);
+        }
+        msg = chan->head_segment->msgs[chan->head_index++];
+    } else {
+        msg = chan->ring[chan->head++];
+        if (chan->head == chan->capacity) {
+            chan->head = 0;
+        }
+    }
+    chan->size--;
+    return msg;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Waiters
+ */
+
+/* Waiters live on the waiting fiber's stack (or in a select case).  Whoever
+ * wakes the fiber up fills in msg (for receivers) and ok. */
+
+static void
+cps_select__finish(struct cps_select_state *state, size_t index);
+
+static void
+cps_chan_waiter__init(struct cps_chan_waiter *waiter, struct cps_fiber *fiber)
+{
+    waiter->fiber = fiber;
+    waiter->rr = cps_fiber__get_rr(fiber);
+    waiter->ok = false;
+    waiter->select = NULL;
+    assert(waiter->rr != NULL);
+}
+
+static struct cps_chan_waiter *
+cps_chan__pop_waiter(struct cork_dllist *waiters)
+{
+    struct cork_dllist_item  *item;
+    struct cps_chan_waiter  *waiter;
+    if (cork_dllist_is_empty(waiters)) {
+        return NULL;
+    }
+    item = cork_dllist_start(waiters);
+    cork_dllist_remove(item);
+    waiter = cork_container_of(item, struct cps_chan_waiter, item);
+    /* If the waiter belongs to a select, it's about to win, so the select's
+     * other cases have to go. */
+    if (waiter->select != NULL) {
+        cps_select__finish(waiter->select, waiter->index);
+    }
+    return waiter;
+}
+
+static void
+cps_chan__wake(struct cps_chan_waiter *waiter)
+{
+    DEBUG("[%p] Waking fiber %p\n", waiter->rr, waiter->fiber);
+    cps_rr_add(waiter->rr, cps_fiber_cont(waiter->fiber));
+}
+
+/* Park the fiber until someone passes a message to it (or takes its
+ * message). */
+static void
+cps_chan__wait(struct cps_chan_waiter *waiter, struct cork_dllist *waiters)
+{
+    cork_dllist_add_to_tail(waiters, &waiter->item);
+    cps_fiber_park(waiter->fiber);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Channels
+ */
+
+static struct cps_chan *
+cps_chan__new(void)
+{
+    struct cps_chan  *chan = cork_new(struct cps_chan);
+    chan->unbounded = false;
+    chan->closed = false;
+    chan->size = 0;
+    chan->ring = NULL;
+    chan->capacity = 0;
+    chan->head = 0;
+    chan->head_segment = NULL;
+    chan->head_index = 0;
+    chan->tail_segment = NULL;
+    chan->tail_index = 0;
+    chan->spare_segment = NULL;
+    cork_dllist_init(&chan->senders);
+    cork_dllist_init(&chan->receivers);
+    return chan;
+}
+
+struct cps_chan *
+cps_chan_new(size_t capacity)
+{
+    struct cps_chan  *chan = cps_chan__new();
+    DEBUG("[%p] Allocated new channel with capacity %zu\n", chan, capacity);
+    chan->capacity = capacity;
+    if (capacity > 0) {
+        chan->ring = cork_calloc(capacity, sizeof(void *));
+    }
+    return chan;
+}
+
+struct cps_chan *
+cps_chan_new_unbounded(void)
+{
+    struct cps_chan  *chan = cps_chan__new();
+    DEBUG("[%p] Allocated new unbounded channel\n", chan);
+    chan->unbounded = true;
+    chan->head_segment = chan->tail_segment = cps_chan__new_segment(chan);
+    return chan;
+}
+
+void
+cps_chan_free(struct cps_chan *chan)
+{
+    DEBUG("[%p] Freeing channel\n", chan);
+    assert(cork_dllist_is_empty(&chan->senders));
+    assert(cork_dllist_is_empty(&chan->receivers));
+    if (chan->ring != NULL) {
+        cork_cfree(chan->ring, chan->capacity, sizeof(void *));
+    }
+    while (chan->head_segment != NULL) {
+        struct cps_chan_segment  *next = chan->head_segment->next;
+        cork_delete(struct cps_chan_segment, chan->head_segment);
+        chan->head_segment = next;
+    }
+    if (chan->spare_segment != NULL) {
+        cork_delete(struct cps_chan_segment, chan->spare_segment);
+    }
+    cork_delete(struct cps_chan, chan);
+}
+
+size_t
+cps_chan_size(const struct cps_chan *chan)
+{
+    return chan->size;
+}
+
+bool
+cps_chan_is_closed(const struct cps_chan *chan)
+{
+    return chan->closed;
+}
+
+bool
+cps_chan_try_send(struct cps_chan *chan, void *msg)
+{
+    struct cps_chan_waiter  *receiver;
+    if (CORK_UNLIKELY(chan->closed)) {
+        return false;
+    }
+
+    /* A waiting receiver means that the buffer is empty, so we can hand the
+     * message over directly. */
+    receiver = cps_chan__pop_waiter(&chan->receivers);
+    if (receiver != NULL) {
+        DEBUG("[%p] Handing message to fiber %p\n", chan, receiver->fiber);
+        receiver->msg = msg;
+        receiver->ok = true;
+        cps_chan__wake(receiver);
+        return true;
+    }
+
+    if (cps_chan__is_full(chan)) {
+        return false;
+    }
+    cps_chan__push(chan, msg);
+    return true;
+}
+
+bool
+cps_chan_send(struct cps_chan *chan, struct cps_fiber *fiber, void *msg)
+{
+    struct cps_chan_waiter  *receiver;
+    struct cps_chan_waiter  waiter;
+    if (CORK_UNLIKELY(chan->closed)) {
+        return false;
+    }
+
+    receiver = cps_chan__pop_waiter(&chan->receivers);
+    if (receiver != NULL) {
+        DEBUG("[%p] Handing message to fiber %p\n", chan, receiver->fiber);
+        receiver->msg = msg;
+        receiver->ok = true;
+        if (chan->capacity > 0 || chan->unbounded ||
+            !cps_fiber__switch_to(fiber, receiver->fiber)) {
+            cps_chan__wake(receiver);
+        }
+        return true;
+    }
+
+    if (CORK_LIKELY(!cps_chan__is_full(chan))) {
+        cps_chan__push(chan, msg);
+        return true;
+    }
+
+    DEBUG("[%p] Fiber %p waiting to send\n", chan, fiber);
+    cps_chan_waiter__init(&waiter, fiber);
+    waiter.msg = msg;
+    cps_chan__wait(&waiter, &chan->senders);
+    return waiter.ok;
+}
+
+bool
+cps_chan_try_recv(struct cps_chan *chan, void **msg)
+{
+    struct cps_chan_waiter  *sender;
+
+    if (CORK_LIKELY(chan->size > 0)) {
+        *msg = cps_chan__pop(chan);
+        /* We just made room for a waiting sender's message. */
+        sender = cps_chan__pop_waiter(&chan->senders);
+        if (sender != NULL) {
+            cps_chan__push(chan, sender->msg);
+            sender->ok = true;
+            cps_chan__wake(sender);
+        }
+        return true;
+    }
+
+    /* A channel with no buffer can still have waiting senders. */
+    sender = cps_chan__pop_waiter(&chan->senders);
+    if (sender != NULL) {
+        DEBUG("[%p] Taking message from fiber %p\n", chan, sender->fiber);
+        *msg = sender->msg;
+        sender->ok = true;
+        cps_chan__wake(sender);
+        return true;
+    }
+    return false;
+}
+
+bool
+cps_chan_recv(struct cps_chan *chan, struct cps_fiber *fiber, void **msg)
+{
+    struct cps_chan_waiter  waiter;
+    if (CORK_LIKELY(cps_chan_try_recv(chan, msg))) {
+        return true;
+    }
+    if (chan->closed) {
+        return false;
+    }
+
+    DEBUG("[%p] Fiber %p waiting to receive\n", chan, fiber);
+    cps_chan_waiter__init(&waiter, fiber);
+    waiter.msg = NULL;
+    cps_chan__wait(&waiter, &chan->receivers);
+    *msg = waiter.msg;
+    return waiter.ok;
+}
+
+void
+cps_chan_close(struct cps_chan *chan)
+{
+    struct cps_chan_waiter  *waiter;
+    DEBUG("[%p] Closing channel\n", chan);
+    chan->closed = true;
+    /* Any waiting receivers know that the buffer is empty, and waiting
+     * senders' messages will never be received. */
+    while ((waiter = cps_chan__pop_waiter(&chan->receivers)) != NULL) {
+        cps_chan__wake(waiter);
+    }
+    while ((waiter = cps_chan__pop_waiter(&chan->senders)) != NULL) {
+        cps_chan__wake(waiter);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Select
+ */
+
+struct cps_select_state {
+    struct cps_select_case  *cases;
+    size_t  count;
+    struct cps_fiber  *fiber;
+    struct cps_rr  *rr;
+    struct cps_timer  timer;
+    size_t  deadline_index;
+    size_t  fired;
+};
+
+void
+cps_select_send(struct cps_select_case *scase, struct cps_chan *chan,
+                void *msg)
+{
+    scase->op = CPS_SELECT_SEND;
+    scase->chan = chan;
+    scase->msg = msg;
+    scase->ok = false;
+}
+
+void
+cps_select_recv(struct cps_select_case *scase, struct cps_chan *chan)
+{
+    scase->op = CPS_SELECT_RECV;
+    scase->chan = chan;
+    scase->msg = NULL;
+    scase->ok = false;
+}
+
+void
+cps_select_deadline(struct cps_select_case *scase, uint64_t deadline)
+{
+    scase->op = CPS_SELECT_DEADLINE;
+    scase->chan = NULL;
+    scase->deadline = deadline;
+}
+
+/* Called when one of a select's cases happens.  The case that happened has
+ * already been removed from its channel's wait list; we remove all of the
+ * others, so that nothing else can wake the fiber up. */
+static void
+cps_select__finish(struct cps_select_state *state, size_t index)
+{
+    size_t  i;
+    DEBUG("[%p] Select case %zu happened\n", state, index);
+    state->fired = index;
+    for (i = 0; i < state->count; i++) {
+        struct cps_select_case  *scase = &state->cases[i];
+        if (i != index && scase->op != CPS_SELECT_DEADLINE) {
+            cork_dllist_remove(&scase->waiter.item);
+        }
+    }
+    cps_rr_cancel_timer(state->rr, &state->timer);
+}
+
+static void
+cps_select__timer_fire(struct cps_timer *timer)
+{
+    struct cps_select_state  *state = timer->user_data;
+    cps_select__finish(state, state->deadline_index);
+    cps_rr_add(state->rr, cps_fiber_cont(state->fiber));
+}
+
+int
+cps_try_select(struct cps_select_case *cases, size_t count)
+{
+    uint64_t  now = 0;
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        struct cps_select_case  *scase = &cases[i];
+        switch (scase->op) {
+            case CPS_SELECT_SEND:
+                if (cps_chan_try_send(scase->chan, scase->msg)) {
+                    scase->ok = true;
+                    return i;
+                }
+                if (scase->chan->closed) {
+                    scase->ok = false;
+                    return i;
+                }
+                break;
+
+            case CPS_SELECT_RECV:
+                if (cps_chan_try_recv(scase->chan, &scase->msg)) {
+                    scase->ok = true;
+                    return i;
+                }
+                if (scase->chan->closed) {
+                    scase->msg = NULL;
+                    scase->ok = false;
+                    return i;
+                }
+                break;
+
+            case CPS_SELECT_DEADLINE:
+                if (now == 0) {
+                    now = cps_now();
+                }
+                if (scase->deadline <= now) {
+                    return i;
+                }
+                break;
+        }
+    }
+    return -1;
+}
+
+size_t
+cps_select(struct cps_fiber *fiber, struct cps_select_case *cases,
+           size_t count)
+{
+    struct cps_select_state  state;
+    struct cps_select_case  *scase;
+    uint64_t  deadline = UINT64_MAX;
+    int  ready;
+    size_t  i;
+
+    ready = cps_try_select(cases, count);
+    if (ready != -1) {
+        return ready;
+    }
+
+    /* Nothing's ready, so register with every channel, and with the
+     * scheduler's timer wheel if there's a deadline. */
+    state.cases = cases;
+    state.count = count;
+    state.fiber = fiber;
+    state.rr = cps_fiber__get_rr(fiber);
+    assert(state.rr != NULL);
+    cps_timer_init(&state.timer, 0, cps_select__timer_fire, &state);
+    for (i = 0; i < count; i++) {
+        scase = &cases[i];
+        if (scase->op == CPS_SELECT_DEADLINE) {
+            if (scase->deadline < deadline) {
+                deadline = scase->deadline;
+                state.deadline_index = i;
+            }
+        } else {
+            struct cps_chan_waiter  *waiter = &scase->waiter;
+            cps_chan_waiter__init(waiter, fiber);
+            waiter->select = &state;
+            waiter->index = i;
+            if (scase->op == CPS_SELECT_SEND) {
+                waiter->msg = scase->msg;
+                cork_dllist_add_to_tail(&scase->chan->senders, &waiter->item);
+            } else {
+                waiter->msg = NULL;
+                cork_dllist_add_to_tail
+                    (&scase->chan->receivers, &waiter->item);
+            }
+        }
+    }
+    if (deadline != UINT64_MAX) {
+        state.timer.deadline = deadline;
+        cps_rr_add_timer(state.rr, &state.timer);
+    }
+
+    DEBUG("[%p] Fiber %p waiting for %zu select cases\n", &state, fiber, count);
+    cps_fiber_park(fiber);
+
+    scase = &cases[state.fired];
+    if (scase->op != CPS_SELECT_DEADLINE) {
+        scase->ok = scase->waiter.ok;
+        if (scase->op == CPS_SELECT_RECV) {
+            scase->msg = scase->waiter.msg;
+        }
+    }
+    return state.fired;
+}
@@ -7,7 +7,10 @@
  * ----------------------------------------------------------------------
  */
 
+#include <assert.h>
+
 #include <libcork/core.h>
+#include <libcork/threads.h>
 
 #include "copse/cps.h"
 
@@ -16,21 +19,79 @@
  * Continuations
  */
 
-struct cps_cont *
-cps_cont_new(void)
+/* The maximum number of freed continuations that each thread will hold on to
+ * for later reuse. */
+#if !defined(CPS_CONT_CACHE_SIZE)
+#define CPS_CONT_CACHE_SIZE  1024
+#endif
+
+/* Each thread keeps a cache of freed continuations, so that most calls to
+ * cps_cont_new and cps_cont_free don't have to go through the allocator.  The
+ * cache is a singly-linked list, which we thread through the user_data field
+ * of each cached continuation.  Since the cache is thread-local, we don't need
+ * any locking. */
+struct cps_cont_cache {
+    struct cps_cont  *head;
+    size_t  count;
+};
+
+cork_tls(struct cps_cont_cache, cps_cont_cache);
+
+void
+cps_cont_init(struct cps_cont *cont)
 {
-    struct cps_cont  *cont = cork_new(struct cps_cont);
     cont->user_data = NULL;
     cont->resume = NULL;
     cont->free_user_data = NULL;
+}
+
+void
+cps_cont_done(struct cps_cont *cont)
+{
+    cork_free_user_data(cont);
+}
+
+struct cps_cont *
+cps_cont_new(void)
+{
+    struct cps_cont_cache  *cache = cps_cont_cache_get();
+    struct cps_cont  *cont;
+    if (CORK_LIKELY(cache->head != NULL)) {
+        cont = cache->head;
+        cache->head = cont->user_data;
+        cache->count--;
+    } else {
+        cont = cork_new(struct cps_cont);
+    }
+    cps_cont_init(cont);
     return cont;
 }
 
 void
 cps_cont_free(struct cps_cont *cont)
 {
-    cork_free_user_data(cont);
-    cork_delete(struct cps_cont, cont);
+    struct cps_cont_cache  *cache;
+    cps_cont_done(cont);
+    cache = cps_cont_cache_get();
+    if (CORK_LIKELY(cache->count < CPS_CONT_CACHE_SIZE)) {
+        cont->user_data = cache->head;
+        cache->head = cont;
+        cache->count++;
+    } else {
+        cork_delete(struct cps_cont, cont);
+    }
+}
+
+void
+cps_cont_free_cache(void)
+{
+    struct cps_cont_cache  *cache = cps_cont_cache_get();
+    while (cache->head != NULL) {
+        struct cps_cont  *cont = cache->head;
+        cache->head = cont->user_data;
+        cork_delete(struct cps_cont, cont);
+    }
+    cache->count = 0;
 }
 
 void
@@ -64,6 +125,15 @@ static struct cps_cont  cps_done = {
     NULL, NULL, cps_done__resume
 };
 
+/* Return whether cont is the placeholder continuation that cps_call and
+ * cps_run pass in as `next`.  Schedulers use this to avoid counting it as one
+ * of their own continuations. */
+bool
+cps__is_done(struct cps_cont *cont)
+{
+    return cont == &cps_done;
+}
+
 void
 cps_call(struct cps_cont *cont)
 {
@@ -77,3 +147,56 @@ cps_run(struct cps_cont *cont)
     cps_resume(cont, &cps_done);
     return CORK_UNLIKELY(cork_error_occurred())? -1: 0;
 }
+
+
+/*-----------------------------------------------------------------------
+ * Trampolines
+ */
+
+/* The state of the innermost trampoline that's running in the current thread.
+ * If `active` is false, there isn't one, and cps_jump falls back on calling
+ * the continuation directly. */
+struct cps_trampoline_state {
+    struct cps_cont  *cont;
+    struct cps_cont  *next;
+    bool  active;
+};
+
+cork_tls(struct cps_trampoline_state, cps_trampoline_state);
+
+void
+cps_jump(struct cps_cont *cont, struct cps_cont *next)
+{
+    struct cps_trampoline_state  *trampoline = cps_trampoline_state_get();
+    if (trampoline->active) {
+        /* Only one jump can be pending at a time. */
+        assert(trampoline->cont == NULL);
+        trampoline->cont = cont;
+        trampoline->next = next;
+    } else {
+        cps_resume(cont, next);
+    }
+}
+
+void
+cps_trampoline(struct cps_cont *cont, struct cps_cont *next)
+{
+    struct cps_trampoline_state  *trampoline = cps_trampoline_state_get();
+    struct cps_trampoline_state  outer = *trampoline;
+    trampoline->active = true;
+    while (cont != NULL) {
+        trampoline->cont = NULL;
+        cps_resume(cont, next);
+        cont = trampoline->cont;
+        next = trampoline->next;
+    }
+    *trampoline = outer;
+}
+
+int
+cps_run_trampolined(struct cps_cont *cont)
+{
+    cork_error_clear();
+    cps_trampoline(cont, &cps_done);
+    return CORK_UNLIKELY(cork_error_occurred())? -1: 0;
+}
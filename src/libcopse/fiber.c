@@ -8,19 +8,92 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <libcork/core.h>
 
 #include "copse/context.h"
 #include "copse/cps.h"
 #include "copse/fiber.h"
+#include "copse/future.h"
+#include "copse/round-robin.h"
+#include "copse/stack.h"
+#include "copse/timer.h"
+#include "copse/trace.h"
+
+/* Defined in round-robin.c */
+struct cps_rr *
+cps_rr__from_cont(struct cps_cont *next);
+
+struct cps_cont *
+cps_rr__peek(struct cps_cont *next);
+
+void
+cps_rr__rotate(struct cps_cont *next, struct cps_cont *yielder);
+
+/* Defined in stack.c */
+void
+cps_stack__repaint(void *stack, size_t size, size_t used);
+
+void
+cps_stack_pool__record_high_water(struct cps_stack_pool *pool, size_t used);
+
+void
+cps_stack_pool__release_region(struct cps_stack_pool *pool, void *stack,
+                               void *region, size_t region_size);
+
+/* Defined in trace.c */
+void
+cps_trace__record(enum cps_trace_event event, const void *object);
 
 
 /*-----------------------------------------------------------------------
  * Fiber continuations
  */
 
-#define CPS_DEFAULT_STACK_SIZE  (1 << 20)  /* 1 MB */
+/* Whether new fibers save and restore the floating-point control state on each
+ * context switch.  Individual fibers can override this default. */
+#if !defined(CPS_PRESERVE_FPU)
+#define CPS_PRESERVE_FPU  1
+#endif
+
+/* Whether fibers keep track of how often they run, and for how long (see
+ * cps_fiber_get_stats). */
+#if !defined(CPS_FIBER_STATS)
+#define CPS_FIBER_STATS  0
+#endif
+
+/* Whether fibers record trace events (see copse/trace.h). */
+#if !defined(CPS_TRACE)
+#define CPS_TRACE  0
+#endif
+
+/* Whether every live fiber is added to a registry (see cps_fiber_dump). */
+#if !defined(CPS_FIBER_REGISTRY)
+#define CPS_FIBER_REGISTRY  0
+#endif
+
+#if CPS_FIBER_REGISTRY
+#include <pthread.h>
+#endif
+
+/* We can only print a backtrace for a paused fiber on platforms where we know
+ * which of the saved registers are the frame pointer and stack pointer. */
+#if CPS_HAVE_X86_64_SYSV_ELF_GAS || CPS_HAVE_X86_64_SYSV_MACHO_GAS
+#define CPS_FIBER_BACKTRACE  1
+#else
+#define CPS_FIBER_BACKTRACE  0
+#endif
+
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#define CPS_HAVE_BACKTRACE_SYMBOLS  1
+#else
+#define CPS_HAVE_BACKTRACE_SYMBOLS  0
+#endif
 
 enum cps_fiber_state {
     CPS_FIBER_FINISHED,
@@ -34,12 +107,152 @@ struct cps_fiber {
     cps_fiber_f  func;
     struct cps_cont  *cont;
     struct cps_context  *context;
-    struct cps_context  ret;
+    /* The context that most recently resumed this fiber, and the continuation
+     * that it wants us to pass control to when we yield.  If fibers transfer
+     * control directly to each other, they pass these along, so that whichever
+     * fiber yields or finishes eventually returns to the same place. */
+    struct cps_context  *ret;
+    struct cps_cont  *next;
+    /* The value most recently passed into or out of the fiber by
+     * cps_fiber_yield_value or cps_fiber_resume_with. */
+    void  *value;
+    /* Set when the fiber's function returns, to the value passed to
+     * cps_fiber_set_result. */
+    struct cps_future  future;
+    void  *result;
     void  *stack;
     size_t  stack_size;
+    unsigned int  stack_flags;
+    /* The pool that the stack came from, or NULL if we allocated the stack
+     * ourselves. */
+    struct cps_stack_pool  *pool;
     enum cps_fiber_state  state;
+    bool  preserve_fpu;
+    /* Set when the fiber parks itself, so that whoever it jumps back to
+     * doesn't reschedule it. */
+    bool  parked;
+    /* The worker pool that owns this fiber, if any, and the next fiber in the
+     * pool's list of idle fibers. */
+    struct cps_worker_pool  *worker_pool;
+    struct cps_fiber  *next_idle;
+#if CPS_FIBER_STATS
+    struct cps_fiber_stats  stats;
+    /* When the fiber's current run started. */
+    uint64_t  run_start;
+#endif
+#if CPS_FIBER_REGISTRY
+    /* This fiber's neighbors in the registry of live fibers. */
+    struct cps_fiber  *prev_live;
+    struct cps_fiber  *next_live;
+#endif
 };
 
+/* We sample the clock on the resumer's side of the context switch, in
+ * cps_fiber__resume and cps_fiber_resume_with, so that accounting doesn't use
+ * any of the fiber's own stack.  The only other way into or out of a fiber is
+ * cps_fiber_transfer, which ends one fiber's run and starts another's. */
+#if CPS_FIBER_STATS
+static void
+cps_fiber__enter(struct cps_fiber *fiber, uint64_t now)
+{
+    fiber->stats.resumes++;
+    fiber->run_start = now;
+}
+
+static void
+cps_fiber__leave(struct cps_fiber *fiber, uint64_t now)
+{
+    uint64_t  elapsed = now - fiber->run_start;
+    fiber->stats.run_ns += elapsed;
+    if (elapsed > fiber->stats.max_run_ns) {
+        fiber->stats.max_run_ns = elapsed;
+    }
+}
+
+static void
+cps_fiber__switch_stats(struct cps_fiber *from, struct cps_fiber *to)
+{
+    uint64_t  now = cps_now();
+    cps_fiber__leave(from, now);
+    cps_fiber__enter(to, now);
+}
+
+static void
+cps_fiber__reset_stats(struct cps_fiber *fiber)
+{
+    memset(&fiber->stats, 0, sizeof(struct cps_fiber_stats));
+    fiber->stats.enabled = true;
+}
+#else
+#define cps_fiber__enter(fiber, now)  /* no stats */
+#define cps_fiber__leave(fiber, now)  /* no stats */
+#define cps_fiber__switch_stats(from, to)  /* no stats */
+#define cps_fiber__reset_stats(fiber)  /* no stats */
+#endif
+
+/* Trace events are recorded in the same places as the stats above. */
+#if CPS_TRACE
+#define cps_fiber__trace(event, fiber) \
+    cps_trace__record(CPS_TRACE_FIBER_##event, (fiber))
+
+static void
+cps_fiber__trace_leave(struct cps_fiber *fiber)
+{
+    if (fiber->state == CPS_FIBER_FINISHED) {
+        cps_fiber__trace(FINISH, fiber);
+    } else if (fiber->parked) {
+        cps_fiber__trace(PARK, fiber);
+    } else {
+        cps_fiber__trace(YIELD, fiber);
+    }
+}
+#else
+#define cps_fiber__trace(event, fiber)  /* no tracing */
+#define cps_fiber__trace_leave(fiber)  /* no tracing */
+#endif
+
+/* Fibers can be created and freed on any thread, so the registry is protected
+ * by a lock. */
+#if CPS_FIBER_REGISTRY
+static struct cps_fiber  *cps_fiber_registry = NULL;
+static pthread_mutex_t  cps_fiber_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+cps_fiber__register(struct cps_fiber *fiber)
+{
+    pthread_mutex_lock(&cps_fiber_registry_lock);
+    fiber->prev_live = NULL;
+    fiber->next_live = cps_fiber_registry;
+    if (cps_fiber_registry != NULL) {
+        cps_fiber_registry->prev_live = fiber;
+    }
+    cps_fiber_registry = fiber;
+    pthread_mutex_unlock(&cps_fiber_registry_lock);
+}
+
+static void
+cps_fiber__unregister(struct cps_fiber *fiber)
+{
+    pthread_mutex_lock(&cps_fiber_registry_lock);
+    if (fiber->prev_live == NULL) {
+        cps_fiber_registry = fiber->next_live;
+    } else {
+        fiber->prev_live->next_live = fiber->next_live;
+    }
+    if (fiber->next_live != NULL) {
+        fiber->next_live->prev_live = fiber->prev_live;
+    }
+    pthread_mutex_unlock(&cps_fiber_registry_lock);
+}
+#else
+#define cps_fiber__register(fiber)  /* no registry */
+#define cps_fiber__unregister(fiber)  /* no registry */
+#endif
+
+static void
+cps_worker_pool__finished(struct cps_worker_pool *pool,
+                          struct cps_fiber *fiber);
+
 static void
 cps_fiber__jump_into(void *user_data)
 {
@@ -47,28 +260,96 @@ cps_fiber__jump_into(void *user_data)
     fiber->state = CPS_FIBER_RUNNING;
     fiber->func(fiber->user_data, fiber);
     fiber->state = CPS_FIBER_FINISHED;
-    cps_context_jump(fiber->context, &fiber->ret, NULL, true);
+    fiber->value = NULL;
+    cps_future_set(&fiber->future, fiber->result);
+    if (fiber->worker_pool != NULL) {
+        cps_worker_pool__finished(fiber->worker_pool, fiber);
+    }
+    cps_context_jump(fiber->context, fiber->ret, fiber, fiber->preserve_fpu);
 }
 
 static void
 cps_fiber__resume(void *user_data, struct cps_cont *next)
 {
     struct cps_fiber  *fiber = user_data;
+    struct cps_context  ret;
 
     /* We can only resume a paused fiber. */
     assert(fiber->state == CPS_FIBER_PAUSED);
 
     /* Jump into the fiber's function (not necessarily for the first time). */
-    cps_context_jump(&fiber->ret, fiber->context, fiber, true);
+    fiber->ret = &ret;
+    fiber->next = next;
+    fiber->value = NULL;
+    cps_fiber__enter(fiber, cps_now());
+    cps_fiber__trace(RESUME, fiber);
+    fiber = cps_context_jump(&ret, fiber->context, fiber, fiber->preserve_fpu);
+    cps_fiber__leave(fiber, cps_now());
+    cps_fiber__trace_leave(fiber);
 
-    /* When we return, the fiber will either have yielded, or the fiber's
-     * function will have returned. */
+    /* When we return, a fiber will either have yielded, or the fiber's
+     * function will have returned.  (This isn't necessarily the fiber that we
+     * resumed, if it transferred control to some other fiber.) */
     if (fiber->state == CPS_FIBER_FINISHED) {
         /* If the fiber's function finished, then we don't need to return back
          * to this continuation later on. */
-        cps_call(next);
+        cps_call(fiber->next);
+    } else if (fiber->parked) {
+        /* Same if it parked itself; something else will resume it. */
+        fiber->parked = false;
+        cps_call(fiber->next);
+    } else {
+        cps_resume(fiber->next, fiber->cont);
+    }
+}
+
+/* The parts of a fiber that live at the top of its stack when it's created
+ * with CPS_STACK_EMBED_FIBER. */
+struct cps_fiber_block {
+    struct cps_fiber  fiber;
+    struct cps_cont  cont;
+};
+
+#define CPS_FIBER_BLOCK_ALIGNMENT  16
+#define CPS_FIBER_BLOCK_SIZE \
+    ((sizeof(struct cps_fiber_block) + CPS_FIBER_BLOCK_ALIGNMENT - 1) \
+     & ~(CPS_FIBER_BLOCK_ALIGNMENT - 1))
+
+/* Carve a fiber block out of the top of a stack, and fill in the portion of
+ * the stack that's left over for the fiber's context. */
+static struct cps_fiber_block *
+cps_fiber__embed(void *stack, size_t stack_size,
+                 void **context_stack, size_t *context_size)
+{
+    uintptr_t  start = (uintptr_t) stack;
+    uintptr_t  end = start + stack_size;
+    uintptr_t  block;
+#if CPS_STACK_GROWS_DOWN
+    block = (end & ~(CPS_FIBER_BLOCK_ALIGNMENT - 1)) - CPS_FIBER_BLOCK_SIZE;
+    *context_stack = stack;
+    *context_size = block - start;
+#else
+    block = (start + CPS_FIBER_BLOCK_ALIGNMENT - 1)
+          & ~(CPS_FIBER_BLOCK_ALIGNMENT - 1);
+    *context_stack = (void *) (block + CPS_FIBER_BLOCK_SIZE);
+    *context_size = end - (block + CPS_FIBER_BLOCK_SIZE);
+#endif
+    return (struct cps_fiber_block *) block;
+}
+
+/* The portion of a fiber's stack that its context runs on: all of it, unless
+ * the fiber is embedded in the stack.  This is the region that we measure
+ * (and repaint) when computing the stack's high-water mark. */
+static void
+cps_fiber__context_region(void *stack, size_t stack_size,
+                          unsigned int stack_flags,
+                          void **context_stack, size_t *context_size)
+{
+    if (stack_flags & CPS_STACK_EMBED_FIBER) {
+        cps_fiber__embed(stack, stack_size, context_stack, context_size);
     } else {
-        cps_resume(next, fiber->cont);
+        *context_stack = stack;
+        *context_size = stack_size;
     }
 }
 
@@ -76,36 +357,116 @@ static void
 cps_fiber__free(void *user_data)
 {
     struct cps_fiber  *fiber = user_data;
-    cork_free(fiber->stack, fiber->stack_size);
+    void  *stack = fiber->stack;
+    size_t  stack_size = fiber->stack_size;
+    unsigned int  stack_flags = fiber->stack_flags;
+    struct cps_stack_pool  *pool = fiber->pool;
+
+    cps_fiber__unregister(fiber);
+    cps_future_done(&fiber->future);
     cork_free_user_data(fiber);
-    cork_delete(struct cps_fiber, fiber);
+    if (!(stack_flags & CPS_STACK_EMBED_FIBER)) {
+        cork_delete(struct cps_fiber, fiber);
+    }
+
+    /* If the fiber is embedded in its stack, it's gone after this. */
+    if (pool == NULL) {
+        cps_stack_deallocate(stack, stack_size, stack_flags);
+    } else {
+        void  *context_stack;
+        size_t  context_size;
+        cps_fiber__context_region
+            (stack, stack_size, stack_flags, &context_stack, &context_size);
+        cps_stack_pool__release_region
+            (pool, stack, context_stack, context_size);
+    }
 }
 
-struct cps_fiber *
-cps_fiber_new(void *user_data, cork_free_f free_user_data, cps_fiber_f func,
-              size_t stack_size)
+static struct cps_fiber *
+cps_fiber__new(void *user_data, cork_free_f free_user_data, cps_fiber_f func,
+               void *stack, size_t stack_size, unsigned int stack_flags,
+               struct cps_stack_pool *pool)
 {
-    struct cps_fiber  *fiber = cork_new(struct cps_fiber);
+    struct cps_fiber  *fiber;
+    void  *context_stack = stack;
+    size_t  context_size = stack_size;
+
+    if (stack_flags & CPS_STACK_EMBED_FIBER) {
+        struct cps_fiber_block  *block =
+            cps_fiber__embed(stack, stack_size, &context_stack, &context_size);
+        fiber = &block->fiber;
+        fiber->cont = &block->cont;
+        cps_cont_init(fiber->cont);
+        cps_cont_set(fiber->cont, fiber, NULL, cps_fiber__resume);
+    } else {
+        fiber = cork_new(struct cps_fiber);
+        fiber->cont = cps_cont_new();
+        cps_cont_set(fiber->cont, fiber, cps_fiber__free, cps_fiber__resume);
+    }
+
     fiber->user_data = user_data;
     fiber->free_user_data = free_user_data;
     fiber->func = func;
-    if (stack_size == 0) {
-        stack_size = CPS_DEFAULT_STACK_SIZE;
-    }
     fiber->state = CPS_FIBER_PAUSED;
-    fiber->stack = cork_malloc(stack_size);
+    fiber->preserve_fpu = CPS_PRESERVE_FPU;
+    fiber->parked = false;
+    fiber->ret = NULL;
+    fiber->next = NULL;
+    fiber->value = NULL;
+    cps_future_init(&fiber->future);
+    fiber->result = NULL;
+    fiber->stack = stack;
     fiber->stack_size = stack_size;
+    fiber->stack_flags = stack_flags;
+    fiber->pool = pool;
+    fiber->worker_pool = NULL;
+    fiber->next_idle = NULL;
+    cps_fiber__reset_stats(fiber);
     fiber->context =
-        cps_context_new(fiber->stack, stack_size, cps_fiber__jump_into);
-    fiber->cont = cps_cont_new();
-    cps_cont_set(fiber->cont, fiber, cps_fiber__free, cps_fiber__resume);
+        cps_context_new(context_stack, context_size, cps_fiber__jump_into);
+    cps_fiber__register(fiber);
+    cps_fiber__trace(CREATE, fiber);
     return fiber;
 }
 
+struct cps_fiber *
+cps_fiber_new(void *user_data, cork_free_f free_user_data, cps_fiber_f func,
+              size_t stack_size)
+{
+    return cps_fiber_new_ex(user_data, free_user_data, func, stack_size, 0);
+}
+
+struct cps_fiber *
+cps_fiber_new_ex(void *user_data, cork_free_f free_user_data, cps_fiber_f func,
+                 size_t stack_size, unsigned int stack_flags)
+{
+    if (stack_size == 0) {
+        stack_size = CPS_DEFAULT_STACK_SIZE;
+    }
+    return cps_fiber__new
+        (user_data, free_user_data, func,
+         cps_stack_allocate(stack_size, stack_flags), stack_size, stack_flags,
+         NULL);
+}
+
+struct cps_fiber *
+cps_fiber_new_from_pool(void *user_data, cork_free_f free_user_data,
+                        cps_fiber_f func, struct cps_stack_pool *pool)
+{
+    return cps_fiber__new
+        (user_data, free_user_data, func,
+         cps_stack_pool_acquire(pool), cps_stack_pool_stack_size(pool),
+         cps_stack_pool_flags(pool), pool);
+}
+
 void
 cps_fiber_free(struct cps_fiber *fiber)
 {
-    cps_cont_free(fiber->cont);
+    if (fiber->stack_flags & CPS_STACK_EMBED_FIBER) {
+        cps_fiber__free(fiber);
+    } else {
+        cps_cont_free(fiber->cont);
+    }
 }
 
 struct cps_cont *
@@ -114,20 +475,503 @@ cps_fiber_cont(struct cps_fiber *fiber)
     return fiber->cont;
 }
 
+void
+cps_fiber_set_preserve_fpu(struct cps_fiber *fiber, bool preserve_fpu)
+{
+    fiber->preserve_fpu = preserve_fpu;
+}
+
+struct cps_fiber *
+cps_fiber_from_cont(struct cps_cont *cont)
+{
+    if (cont->resume == cps_fiber__resume) {
+        return cont->user_data;
+    } else {
+        return NULL;
+    }
+}
+
+void
+cps_fiber_transfer(struct cps_fiber *from, struct cps_fiber *to)
+{
+    /* Should be called from within `from` */
+    assert(from->state == CPS_FIBER_RUNNING);
+    assert(to->state == CPS_FIBER_PAUSED);
+    /* The context that we'll eventually return to only has valid FPU state if
+     * the fiber that it resumed preserved it. */
+    assert(from->preserve_fpu == to->preserve_fpu);
+
+    /* Hand our return context over to `to`, and jump straight into it.  If `to`
+     * hasn't started yet, the parameter that we pass in is what
+     * cps_fiber__jump_into expects. */
+    from->state = CPS_FIBER_PAUSED;
+    to->ret = from->ret;
+    to->next = from->next;
+    to->value = NULL;
+    cps_fiber__switch_stats(from, to);
+    cps_fiber__trace(YIELD, from);
+    cps_fiber__trace(RESUME, to);
+    cps_context_jump(from->context, to->context, to, to->preserve_fpu);
+
+    /* When we return, someone has resumed or transferred control back to
+     * `from`. */
+    from->state = CPS_FIBER_RUNNING;
+}
+
 void
 cps_fiber_yield(struct cps_fiber *fiber)
 {
+    struct cps_cont  *head;
+
     /* Should be called from within fiber */
     assert(fiber->state == CPS_FIBER_RUNNING);
 
+    /* If we're being run by a round-robin scheduler, and the next thing in its
+     * queue is also a fiber, we can switch to it directly, instead of jumping
+     * back to the scheduler first. */
+    head = cps_rr__peek(fiber->next);
+    if (head != NULL) {
+        struct cps_fiber  *to = cps_fiber_from_cont(head);
+        if (to != NULL && to->state == CPS_FIBER_PAUSED &&
+            to->preserve_fpu == fiber->preserve_fpu) {
+            cps_rr__rotate(fiber->next, fiber->cont);
+            cps_fiber_transfer(fiber, to);
+            return;
+        }
+    }
+
     /* Jump back to the context that yielded to us most recently.  This should
      * jump us back into the cps_fiber__resume method, returning from its
      * cps_context_jump call. */
     fiber->state = CPS_FIBER_PAUSED;
-    cps_context_jump(fiber->context, &fiber->ret, NULL, true);
+    cps_context_jump(fiber->context, fiber->ret, fiber, fiber->preserve_fpu);
 
     /* When we return, someone else will have resumed this fiber's continuation,
      * leading to a new call to cps_fiber__resume.  Its cps_context_jump call
      * will lead here; we return back to the fiber function. */
     fiber->state = CPS_FIBER_RUNNING;
 }
+
+bool
+cps_fiber_is_finished(struct cps_fiber *fiber)
+{
+    return fiber->state == CPS_FIBER_FINISHED;
+}
+
+void *
+cps_fiber_yield_value(struct cps_fiber *fiber, void *value)
+{
+    fiber->value = value;
+    cps_fiber_yield(fiber);
+    return fiber->value;
+}
+
+void *
+cps_fiber_resume_with(struct cps_fiber *fiber, void *value)
+{
+    struct cps_context  ret;
+
+    /* We can only resume a paused fiber. */
+    assert(fiber->state == CPS_FIBER_PAUSED);
+
+    /* This is just like cps_fiber__resume, except that there's no next
+     * continuation; control comes straight back here when the fiber yields or
+     * finishes. */
+    fiber->ret = &ret;
+    fiber->next = NULL;
+    fiber->value = value;
+    cps_fiber__enter(fiber, cps_now());
+    cps_fiber__trace(RESUME, fiber);
+    fiber = cps_context_jump(&ret, fiber->context, fiber, fiber->preserve_fpu);
+    cps_fiber__leave(fiber, cps_now());
+    cps_fiber__trace_leave(fiber);
+    fiber->parked = false;
+    return fiber->value;
+}
+
+void
+cps_fiber_reset(struct cps_fiber *fiber,
+                void *user_data, cork_free_f free_user_data, cps_fiber_f func)
+{
+    void  *context_stack;
+    size_t  context_size;
+
+    /* We can only reset a fiber that's finished. */
+    assert(fiber->state == CPS_FIBER_FINISHED);
+
+    cork_free_user_data(fiber);
+    fiber->user_data = user_data;
+    fiber->free_user_data = free_user_data;
+    fiber->func = func;
+    fiber->state = CPS_FIBER_PAUSED;
+    fiber->ret = NULL;
+    fiber->next = NULL;
+    fiber->value = NULL;
+    cps_future_reset(&fiber->future);
+    fiber->result = NULL;
+    cps_fiber__reset_stats(fiber);
+
+    /* Start over with a fresh context at the top of the existing stack. */
+    cps_fiber__context_region
+        (fiber->stack, fiber->stack_size, fiber->stack_flags,
+         &context_stack, &context_size);
+
+    /* Repaint whatever the previous function used, so that the high-water
+     * mark only covers the new one.  (We leave an embedded fiber's block
+     * alone.)  The stack's pool would otherwise only ever see the last
+     * function's usage, so we record the previous one's now. */
+    if (fiber->stack_flags & CPS_STACK_PAINT) {
+        size_t  used = cps_stack_high_water(context_stack, context_size);
+        if (fiber->pool != NULL) {
+            cps_stack_pool__record_high_water(fiber->pool, used);
+        }
+        cps_stack__repaint(context_stack, context_size, used);
+    }
+
+    fiber->context =
+        cps_context_new(context_stack, context_size, cps_fiber__jump_into);
+    cps_fiber__trace(CREATE, fiber);
+}
+
+void
+cps_fiber_park(struct cps_fiber *fiber)
+{
+    /* Should be called from within fiber */
+    assert(fiber->state == CPS_FIBER_RUNNING);
+    fiber->state = CPS_FIBER_PAUSED;
+    fiber->parked = true;
+    cps_context_jump(fiber->context, fiber->ret, fiber, fiber->preserve_fpu);
+    fiber->state = CPS_FIBER_RUNNING;
+}
+
+static void
+cps_fiber__wake(struct cps_timer *timer)
+{
+    struct cps_fiber  *fiber = timer->user_data;
+    cps_rr_add(cps_rr__from_cont(fiber->next), fiber->cont);
+}
+
+void
+cps_fiber_sleep_until(struct cps_fiber *fiber, uint64_t deadline)
+{
+    /* The timer lives on the fiber's own stack, since we won't return from
+     * cps_fiber_park until after it's fired. */
+    struct cps_timer  timer;
+    struct cps_rr  *rr = cps_rr__from_cont(fiber->next);
+    assert(rr != NULL);
+    cps_timer_init(&timer, deadline, cps_fiber__wake, fiber);
+    cps_rr_add_timer(rr, &timer);
+    cps_fiber_park(fiber);
+}
+
+/* Return the round-robin scheduler that resumed the fiber most recently, or
+ * NULL if it wasn't resumed by one.  The synchronization primitives use this
+ * to find the scheduler that should run a parked fiber once it's woken up. */
+struct cps_rr *
+cps_fiber__get_rr(struct cps_fiber *fiber)
+{
+    return cps_rr__from_cont(fiber->next);
+}
+
+/* If both fibers are being run by the same round-robin scheduler, add `from`
+ * to the end of the scheduler's work queue, and transfer control directly to
+ * `to`, which must be parked.  This is like cps_fiber_yield, except that we
+ * get to choose which fiber runs next.  Returns false, without doing
+ * anything, if we can't do that. */
+bool
+cps_fiber__switch_to(struct cps_fiber *from, struct cps_fiber *to)
+{
+    struct cps_rr  *rr = cps_rr__from_cont(from->next);
+    if (rr == NULL || cps_rr__from_cont(to->next) != rr ||
+        to->preserve_fpu != from->preserve_fpu) {
+        return false;
+    }
+    cps_rr_add(rr, from->cont);
+    cps_fiber_transfer(from, to);
+    return true;
+}
+
+struct cps_future *
+cps_fiber_future(struct cps_fiber *fiber)
+{
+    return &fiber->future;
+}
+
+void
+cps_fiber_set_result(struct cps_fiber *fiber, void *result)
+{
+    /* Should be called from within fiber */
+    assert(fiber->state == CPS_FIBER_RUNNING);
+    fiber->result = result;
+}
+
+void *
+cps_fiber_join(struct cps_fiber *fiber, struct cps_fiber *target)
+{
+    assert(fiber != target);
+    return cps_future_wait(&target->future, fiber);
+}
+
+void
+cps_fiber_get_stats(const struct cps_fiber *fiber,
+                    struct cps_fiber_stats *dest)
+{
+#if CPS_FIBER_STATS
+    *dest = fiber->stats;
+#else
+    memset(dest, 0, sizeof(struct cps_fiber_stats));
+#endif
+}
+
+size_t
+cps_fiber_stack_high_water(struct cps_fiber *fiber)
+{
+    if (fiber->stack_flags & CPS_STACK_PAINT) {
+        void  *context_stack;
+        size_t  context_size;
+        cps_fiber__context_region
+            (fiber->stack, fiber->stack_size, fiber->stack_flags,
+             &context_stack, &context_size);
+        return cps_stack_high_water(context_stack, context_size);
+    } else {
+        return 0;
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Worker pools
+ */
+
+struct cps_worker_pool {
+    size_t  stack_size;
+    unsigned int  stack_flags;
+    /* A singly-linked list of finished fibers, linked via next_idle. */
+    struct cps_fiber  *idle;
+    size_t  idle_count;
+    size_t  busy_count;
+};
+
+struct cps_worker_pool *
+cps_worker_pool_new(size_t stack_size, unsigned int stack_flags)
+{
+    struct cps_worker_pool  *pool = cork_new(struct cps_worker_pool);
+    pool->stack_size = stack_size;
+    pool->stack_flags = stack_flags;
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pool->busy_count = 0;
+    return pool;
+}
+
+void
+cps_worker_pool_free(struct cps_worker_pool *pool)
+{
+    assert(pool->busy_count == 0);
+    cps_worker_pool_trim(pool, 0);
+    cork_delete(struct cps_worker_pool, pool);
+}
+
+size_t
+cps_worker_pool_idle_count(const struct cps_worker_pool *pool)
+{
+    return pool->idle_count;
+}
+
+size_t
+cps_worker_pool_busy_count(const struct cps_worker_pool *pool)
+{
+    return pool->busy_count;
+}
+
+void
+cps_worker_pool_trim(struct cps_worker_pool *pool, size_t max_idle)
+{
+    while (pool->idle_count > max_idle) {
+        struct cps_fiber  *fiber = pool->idle;
+        pool->idle = fiber->next_idle;
+        pool->idle_count--;
+        cps_fiber_free(fiber);
+    }
+}
+
+struct cps_fiber *
+cps_worker_pool_spawn(struct cps_worker_pool *pool,
+                      void *user_data, cork_free_f free_user_data,
+                      cps_fiber_f func)
+{
+    struct cps_fiber  *fiber;
+    if (CORK_LIKELY(pool->idle != NULL)) {
+        fiber = pool->idle;
+        pool->idle = fiber->next_idle;
+        pool->idle_count--;
+        cps_fiber_reset(fiber, user_data, free_user_data, func);
+    } else {
+        fiber = cps_fiber_new_ex
+            (user_data, free_user_data, func,
+             pool->stack_size, pool->stack_flags);
+        fiber->worker_pool = pool;
+    }
+    pool->busy_count++;
+    return fiber;
+}
+
+/* Called from within the fiber, just after its function returns.  The fiber
+ * can't be reset or freed until it has switched off of its own stack, but
+ * nothing else can run before that happens, so it's safe to put it on the idle
+ * list now.  We don't hold on to the task's user_data while the fiber is
+ * idle. */
+static void
+cps_worker_pool__finished(struct cps_worker_pool *pool,
+                          struct cps_fiber *fiber)
+{
+    cork_free_user_data(fiber);
+    fiber->user_data = NULL;
+    fiber->free_user_data = NULL;
+    pool->busy_count--;
+    fiber->next_idle = pool->idle;
+    pool->idle = fiber;
+    pool->idle_count++;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Fiber registry
+ */
+
+bool
+cps_fiber_registry_is_enabled(void)
+{
+    return CPS_FIBER_REGISTRY;
+}
+
+#if CPS_FIBER_REGISTRY
+
+#define CPS_FIBER_MAX_FRAMES  32
+
+#if CPS_FIBER_BACKTRACE
+/* cps_context_jump saves RBP, RSP, and the return address into its caller in
+ * gen_reg[5], [6], and [7].  From there, each frame pointer points at the
+ * caller's saved frame pointer, followed by the return address into the
+ * caller.  If some of the code on the stack was compiled without frame
+ * pointers, RBP can hold anything, so we only follow frame pointers that stay
+ * within the part of the fiber's stack that's in use, and that move towards
+ * the top of the stack; anything else ends the backtrace. */
+static size_t
+cps_fiber__backtrace(struct cps_fiber *fiber, void **frames)
+{
+    const struct cps_context  *context = fiber->context;
+    uintptr_t  bottom = context->gen_reg[6];
+    uintptr_t  top = (uintptr_t) fiber->stack + fiber->stack_size;
+    uintptr_t  frame = context->gen_reg[5];
+    size_t  count = 0;
+
+    frames[count++] = (void *) (uintptr_t) context->gen_reg[7];
+    while (count < CPS_FIBER_MAX_FRAMES && frame >= bottom &&
+           frame + 2 * sizeof(uintptr_t) <= top &&
+           frame % sizeof(uintptr_t) == 0) {
+        const uintptr_t  *slots = (const uintptr_t *) frame;
+        if (slots[1] == 0) {
+            break;
+        }
+        frames[count++] = (void *) slots[1];
+        if (slots[0] <= frame) {
+            break;
+        }
+        frame = slots[0];
+    }
+    return count;
+}
+#endif
+
+static void
+cps_fiber__print_frames(FILE *out, void **frames, size_t count)
+{
+    size_t  i;
+#if CPS_HAVE_BACKTRACE_SYMBOLS
+    char  **symbols = backtrace_symbols(frames, count);
+    if (symbols != NULL) {
+        for (i = 0; i < count; i++) {
+            fprintf(out, "    #%zu %s\n", i, symbols[i]);
+        }
+        free(symbols);
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++) {
+        fprintf(out, "    #%zu %p\n", i, frames[i]);
+    }
+}
+
+static void
+cps_fiber__dump_one(FILE *out, struct cps_fiber *fiber)
+{
+    const char  *state;
+    switch (fiber->state) {
+        case CPS_FIBER_FINISHED:
+            state = "finished";
+            break;
+        case CPS_FIBER_RUNNING:
+            state = "running";
+            break;
+        case CPS_FIBER_PAUSED:
+            /* A fiber that has never been resumed doesn't have a return
+             * context yet. */
+            state = (fiber->ret == NULL)? "not started": "paused";
+            break;
+        default:
+            state = "unknown";
+            break;
+    }
+
+    fprintf(out, "fiber %p: %s, stack %zu bytes, function %p\n",
+            (void *) fiber, state, fiber->stack_size,
+            (void *) (uintptr_t) fiber->func);
+
+#if CPS_FIBER_BACKTRACE
+    if (fiber->state == CPS_FIBER_PAUSED && fiber->ret != NULL) {
+        void  *frames[CPS_FIBER_MAX_FRAMES];
+        size_t  count = cps_fiber__backtrace(fiber, frames);
+        cps_fiber__print_frames(out, frames, count);
+    }
+#endif
+}
+
+int
+cps_fiber_dump(FILE *out)
+{
+    struct cps_fiber  *fiber;
+    size_t  count = 0;
+
+    pthread_mutex_lock(&cps_fiber_registry_lock);
+    for (fiber = cps_fiber_registry; fiber != NULL; fiber = fiber->next_live) {
+        count++;
+    }
+    fprintf(out, "%zu live fibers\n", count);
+    for (fiber = cps_fiber_registry; fiber != NULL; fiber = fiber->next_live) {
+        cps_fiber__dump_one(out, fiber);
+    }
+    pthread_mutex_unlock(&cps_fiber_registry_lock);
+
+    if (CORK_UNLIKELY(fflush(out) != 0 || ferror(out))) {
+        cork_system_error_set();
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int
+cps_fiber_dump(FILE *out)
+{
+    fprintf(out, "Fiber registry is disabled; "
+            "rebuild with the FIBER_REGISTRY option\n");
+    if (CORK_UNLIKELY(fflush(out) != 0 || ferror(out))) {
+        cork_system_error_set();
+        return -1;
+    }
+    return 0;
+}
+
+#endif
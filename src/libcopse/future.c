@@ -0,0 +1,250 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/future.h"
+#include "copse/round-robin.h"
+
+/* Defined in fiber.c */
+struct cps_rr *
+cps_fiber__get_rr(struct cps_fiber *fiber);
+
+
+#if !defined(CPS_DEBUG_FUTURE)
+#define CPS_DEBUG_FUTURE  0
+#endif
+
+#if CPS_DEBUG_FUTURE
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Futures
+ */
+
+void
+cps_future_init(struct cps_future *future)
+{
+    future->ready = false;
+    future->value = NULL;
+    cork_dllist_init(&future->waiters);
+}
+
+void
+cps_future_done(struct cps_future *future)
+{
+    assert(cork_dllist_is_empty(&future->waiters));
+}
+
+void
+cps_future_reset(struct cps_future *future)
+{
+    assert(cork_dllist_is_empty(&future->waiters));
+    future->ready = false;
+    future->value = NULL;
+}
+
+void *
+cps_future_get(const struct cps_future *future)
+{
+    assert(future->ready);
+    return future->value;
+}
+
+void
+cps_future_set(struct cps_future *future, void *value)
+{
+    assert(!future->ready);
+    DEBUG("[%p] Setting future to %p\n", future, value);
+    future->ready = true;
+    future->value = value;
+    /* A callback might remove other waiters (see cps_future_when_any), so
+     * take each one off the list before calling it. */
+    while (!cork_dllist_is_empty(&future->waiters)) {
+        struct cork_dllist_item  *item = cork_dllist_start(&future->waiters);
+        struct cps_future_waiter  *waiter =
+            cork_container_of(item, struct cps_future_waiter, item);
+        cork_dllist_remove(item);
+        waiter->ready(waiter);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Waiters
+ */
+
+void
+cps_future_waiter_init(struct cps_future_waiter *waiter,
+                       cps_future_ready_f ready, void *user_data)
+{
+    waiter->ready = ready;
+    waiter->user_data = user_data;
+}
+
+void
+cps_future_add_waiter(struct cps_future *future,
+                      struct cps_future_waiter *waiter)
+{
+    if (future->ready) {
+        waiter->ready(waiter);
+    } else {
+        cork_dllist_add_to_tail(&future->waiters, &waiter->item);
+    }
+}
+
+void
+cps_future_remove_waiter(struct cps_future *future,
+                         struct cps_future_waiter *waiter)
+{
+    assert(!future->ready);
+    cork_dllist_remove(&waiter->item);
+}
+
+/* A fiber that's parked until a future is set.  These live on the waiting
+ * fiber's stack. */
+struct cps_future_fiber_waiter {
+    struct cps_future_waiter  parent;
+    struct cps_fiber  *fiber;
+    struct cps_rr  *rr;
+};
+
+static void
+cps_future__wake_fiber(struct cps_future_waiter *waiter)
+{
+    struct cps_future_fiber_waiter  *self =
+        cork_container_of(waiter, struct cps_future_fiber_waiter, parent);
+    DEBUG("[%p] Waking fiber %p\n", self->rr, self->fiber);
+    cps_rr_add(self->rr, cps_fiber_cont(self->fiber));
+}
+
+void *
+cps_future_wait(struct cps_future *future, struct cps_fiber *fiber)
+{
+    struct cps_future_fiber_waiter  waiter;
+    if (future->ready) {
+        return future->value;
+    }
+    DEBUG("[%p] Fiber %p waiting for future\n", future, fiber);
+    cps_future_waiter_init(&waiter.parent, cps_future__wake_fiber, NULL);
+    waiter.fiber = fiber;
+    waiter.rr = cps_fiber__get_rr(fiber);
+    assert(waiter.rr != NULL);
+    cork_dllist_add_to_tail(&future->waiters, &waiter.parent.item);
+    cps_fiber_park(fiber);
+    assert(future->ready);
+    return future->value;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Combinators
+ */
+
+void
+cps_future_when_all(struct cps_fiber *fiber,
+                    struct cps_future **futures, size_t count)
+{
+    /* We only need to be woken up once per future that isn't ready yet, and
+     * we can wait for them one at a time, since we can't continue until the
+     * last one is set anyway. */
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        cps_future_wait(futures[i], fiber);
+    }
+}
+
+/* when_any has to wait on every future at once.  We keep this many waiters on
+ * the stack, and allocate them if there are more futures than that. */
+#define WHEN_ANY_STACK_COUNT  8
+
+struct cps_future_any {
+    struct cps_future  **futures;
+    struct cps_future_waiter  *waiters;
+    size_t  count;
+    size_t  fired;
+    struct cps_fiber  *fiber;
+    struct cps_rr  *rr;
+};
+
+static void
+cps_future__any_ready(struct cps_future_waiter *waiter)
+{
+    struct cps_future_any  *any = waiter->user_data;
+    size_t  i;
+    any->fired = waiter - any->waiters;
+    DEBUG("[%p] Future %zu is ready\n", any, any->fired);
+    /* The winning waiter is already off of its future's list.  If the same
+     * future appears more than once in the array, its other waiters are still
+     * on that future's list; cps_future_set is in the middle of working
+     * through it, so cps_future_remove_waiter would complain that it's
+     * already set.  Take them off directly, so that they don't fire, too. */
+    for (i = 0; i < any->count; i++) {
+        if (i == any->fired) {
+            continue;
+        }
+        if (CORK_UNLIKELY(any->futures[i]->ready)) {
+            cork_dllist_remove(&any->waiters[i].item);
+        } else {
+            cps_future_remove_waiter(any->futures[i], &any->waiters[i]);
+        }
+    }
+    cps_rr_add(any->rr, cps_fiber_cont(any->fiber));
+}
+
+size_t
+cps_future_when_any(struct cps_fiber *fiber,
+                    struct cps_future **futures, size_t count)
+{
+    struct cps_future_waiter  stack_waiters[WHEN_ANY_STACK_COUNT];
+    struct cps_future_any  any;
+    size_t  i;
+
+    /* With nothing to wait for, we'd park forever. */
+    assert(count > 0);
+    for (i = 0; i < count; i++) {
+        if (futures[i]->ready) {
+            return i;
+        }
+    }
+
+    any.futures = futures;
+    any.count = count;
+    any.fiber = fiber;
+    any.rr = cps_fiber__get_rr(fiber);
+    assert(any.rr != NULL);
+    if (count <= WHEN_ANY_STACK_COUNT) {
+        any.waiters = stack_waiters;
+    } else {
+        any.waiters = cork_calloc(count, sizeof(struct cps_future_waiter));
+    }
+    for (i = 0; i < count; i++) {
+        cps_future_waiter_init(&any.waiters[i], cps_future__any_ready, &any);
+        cork_dllist_add_to_tail(&futures[i]->waiters, &any.waiters[i].item);
+    }
+
+    DEBUG("[%p] Fiber %p waiting for %zu futures\n", &any, fiber, count);
+    cps_fiber_park(fiber);
+
+    if (any.waiters != stack_waiters) {
+        cork_cfree(any.waiters, count, sizeof(struct cps_future_waiter));
+    }
+    return any.fired;
+}
@@ -0,0 +1,205 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+
+#include <libcork/core.h>
+
+#include "copse/cps.h"
+#include "copse/priority.h"
+#include "ring.h"
+
+
+#if !defined(CPS_DEBUG_PRIO)
+#define CPS_DEBUG_PRIO  0
+#endif
+
+/* Whether new schedulers run their continuations under a trampoline. */
+#if !defined(CPS_TRAMPOLINE)
+#define CPS_TRAMPOLINE  0
+#endif
+
+#if CPS_DEBUG_PRIO
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+
+#define INITIAL_QUEUE_SIZE  16
+
+/* Each level has its own work queue (see ring.h), just like the round-robin
+ * scheduler. */
+struct cps_prio_level {
+    struct cps_cont  yield;
+    struct cps_prio  *prio;
+    unsigned int  index;
+    unsigned int  quota;
+    unsigned int  credits;
+
+    struct cps_ring  queue;
+};
+
+struct cps_prio {
+    struct cps_prio_level  levels[CPS_PRIO_LEVEL_COUNT];
+    bool  trampolined;
+};
+
+
+
+static void
+cps_prio__yield(void *user_data, struct cps_cont *next);
+
+struct cps_prio *
+cps_prio_new(void)
+{
+    struct cps_prio  *self = cork_new(struct cps_prio);
+    unsigned int  i;
+    DEBUG("[%p] Allocated new priority scheduler\n", self);
+    for (i = 0; i < CPS_PRIO_LEVEL_COUNT; i++) {
+        struct cps_prio_level  *level = &self->levels[i];
+        cps_cont_init(&level->yield);
+        cps_cont_set(&level->yield, level, NULL, cps_prio__yield);
+        level->prio = self;
+        level->index = i;
+        level->quota = 1 << (2 * (CPS_PRIO_LEVEL_COUNT - 1 - i));
+        level->credits = level->quota;
+        cps_ring__init(&level->queue, INITIAL_QUEUE_SIZE);
+    }
+    self->trampolined = CPS_TRAMPOLINE;
+    return self;
+}
+
+void
+cps_prio_free(struct cps_prio *self)
+{
+    unsigned int  i;
+    DEBUG("[%p] Freeing priority scheduler\n", self);
+    for (i = 0; i < CPS_PRIO_LEVEL_COUNT; i++) {
+        struct cps_prio_level  *level = &self->levels[i];
+        cps_cont_done(&level->yield);
+        cps_ring__done(&level->queue);
+    }
+    cork_delete(struct cps_prio, self);
+}
+
+void
+cps_prio_set_quota(struct cps_prio *self, unsigned int level,
+                   unsigned int quota)
+{
+    assert(level < CPS_PRIO_LEVEL_COUNT);
+    assert(quota > 0);
+    self->levels[level].quota = quota;
+    if (self->levels[level].credits > quota) {
+        self->levels[level].credits = quota;
+    }
+}
+
+void
+cps_prio_set_trampolined(struct cps_prio *self, bool trampolined)
+{
+    self->trampolined = trampolined;
+}
+
+void
+cps_prio_add(struct cps_prio *self, unsigned int level,
+             struct cps_cont *cont)
+{
+    assert(level < CPS_PRIO_LEVEL_COUNT);
+    DEBUG("[%p] Adding continuation %p at level %u\n", self, cont, level);
+    cps_ring__push(&self->levels[level].queue, cont);
+}
+
+struct cps_cont *
+cps_prio_get_yield(struct cps_prio *self, unsigned int level)
+{
+    assert(level < CPS_PRIO_LEVEL_COUNT);
+    return &self->levels[level].yield;
+}
+
+/* Choose the level to run next, and use up one of its credits.  Returns NULL
+ * if every level is empty. */
+static struct cps_prio_level *
+cps_prio__select(struct cps_prio *self)
+{
+    struct cps_prio_level  *first_pending = NULL;
+    unsigned int  i;
+
+    for (i = 0; i < CPS_PRIO_LEVEL_COUNT; i++) {
+        struct cps_prio_level  *level = &self->levels[i];
+        if (!cps_ring__is_empty(&level->queue)) {
+            if (CORK_LIKELY(level->credits > 0)) {
+                level->credits--;
+                return level;
+            }
+            if (first_pending == NULL) {
+                first_pending = level;
+            }
+        }
+    }
+
+    if (first_pending == NULL) {
+        return NULL;
+    }
+
+    /* Every level with pending work has used up its quota, so start a new
+     * cycle. */
+    DEBUG("[%p] Starting new scheduling cycle\n", self);
+    for (i = 0; i < CPS_PRIO_LEVEL_COUNT; i++) {
+        self->levels[i].credits = self->levels[i].quota;
+    }
+    first_pending->credits--;
+    return first_pending;
+}
+
+static void
+cps_prio__yield(void *user_data, struct cps_cont *next)
+{
+    struct cps_prio_level  *level = user_data;
+    struct cps_prio  *self = level->prio;
+    struct cps_cont  *head_cont;
+
+    DEBUG("[%p] Adding continuation %p to end of level %u\n",
+          self, next, level->index);
+    cps_ring__push(&level->queue, next);
+
+    /* There must be something to pass control to, since we just added an
+     * element. */
+    level = cps_prio__select(self);
+    head_cont = cps_ring__pop(&level->queue);
+    DEBUG("[%p] Yielding to continuation %p at level %u\n",
+          self, head_cont, level->index);
+    if (self->trampolined) {
+        cps_jump(head_cont, &level->yield);
+    } else {
+        cps_resume(head_cont, &level->yield);
+    }
+}
+
+int
+cps_prio_drain(struct cps_prio *self)
+{
+    struct cps_prio_level  *level;
+    while ((level = cps_prio__select(self)) != NULL) {
+        struct cps_cont  *head_cont = cps_ring__pop(&level->queue);
+        DEBUG("[%p] Yielding to continuation %p at level %u\n",
+              self, head_cont, level->index);
+        if (self->trampolined) {
+            cps_trampoline(head_cont, &level->yield);
+        } else {
+            cps_resume(head_cont, &level->yield);
+        }
+        if (CORK_UNLIKELY(cork_error_occurred())) {
+            return -1;
+        }
+    }
+    DEBUG("[%p] All continuations finished\n", self);
+    return 0;
+}
@@ -0,0 +1,726 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+/* for accept4 */
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+
+#include "copse/cps.h"
+#include "copse/detect.h"
+#include "copse/fiber.h"
+#include "copse/reactor.h"
+#include "copse/round-robin.h"
+
+#if CPS_HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if CPS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* Defined in round-robin.c */
+struct cps_reactor *
+cps_rr__get_reactor(struct cps_rr *rr);
+
+
+#if !defined(CPS_DEBUG_REACTOR)
+#define CPS_DEBUG_REACTOR  0
+#endif
+
+#if CPS_DEBUG_REACTOR
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+
+/* The maximum number of events that we process per epoll_wait call. */
+#define EVENT_BATCH_SIZE  64
+
+/* The number of submission queue entries in each io_uring. */
+#define URING_ENTRIES  256
+
+struct cps_uring;
+
+struct cps_reactor {
+    struct cps_rr  *rr;
+    int  epoll_fd;
+    /* The number of continuations that are waiting for a descriptor or for an
+     * io_uring operation to complete. */
+    size_t  waiter_count;
+    /* The scheduler's wakeup descriptor, if we've registered it. */
+    int  wakeup_fd;
+    /* NULL if we're not using io_uring. */
+    struct cps_uring  *uring;
+};
+
+/* An io_uring operation that a fiber is waiting for.  These live on the
+ * fiber's stack. */
+struct cps_io_op {
+    struct cps_cont  *cont;
+    int  result;
+};
+
+
+/*-----------------------------------------------------------------------
+ * io_uring backend
+ */
+
+#if CPS_HAVE_IO_URING
+
+/* We talk to the kernel directly, rather than depending on liburing.  These
+ * are the parts of the shared ring buffers that we need. */
+struct cps_uring {
+    int  fd;
+    void  *ring;
+    size_t  ring_size;
+    struct io_uring_sqe  *sqes;
+    size_t  sqes_size;
+
+    unsigned int  *sq_head;
+    unsigned int  *sq_tail;
+    unsigned int  sq_mask;
+    unsigned int  sq_entries;
+    unsigned int  *sq_array;
+    /* The number of entries that we've added to the submission queue, but
+     * haven't passed to io_uring_enter yet. */
+    unsigned int  pending;
+
+    unsigned int  *cq_head;
+    unsigned int  *cq_tail;
+    unsigned int  cq_mask;
+    struct io_uring_cqe  *cqes;
+};
+
+/* These are the kernel features that we rely on: a single mapping for both
+ * rings (5.4), no dropped completions (5.5), and reads and writes at the
+ * current file position (5.6).  Older kernels fall back on epoll. */
+#define URING_REQUIRED_FEATURES \
+    (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS)
+
+#define ring_ptr(uring, offset) \
+    ((void *) ((char *) (uring)->ring + (offset)))
+
+/* Returns NULL if io_uring isn't available.  That's not an error, so we don't
+ * set one. */
+static struct cps_uring *
+cps_uring__new(void)
+{
+    struct cps_uring  *self;
+    struct io_uring_params  params;
+    size_t  sq_size;
+    size_t  cq_size;
+    int  fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd == -1) {
+        DEBUG("io_uring isn't available: %s\n", strerror(errno));
+        return NULL;
+    }
+    if ((params.features & URING_REQUIRED_FEATURES) !=
+        URING_REQUIRED_FEATURES) {
+        DEBUG("io_uring is missing features (have %x)\n", params.features);
+        close(fd);
+        return NULL;
+    }
+
+    self = cork_new(struct cps_uring);
+    self->fd = fd;
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    self->ring_size = (sq_size > cq_size)? sq_size: cq_size;
+    self->ring = mmap(NULL, self->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (self->ring == MAP_FAILED) {
+        goto error_ring;
+    }
+    self->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED) {
+        goto error_sqes;
+    }
+
+    self->sq_head = ring_ptr(self, params.sq_off.head);
+    self->sq_tail = ring_ptr(self, params.sq_off.tail);
+    self->sq_mask = *(unsigned int *) ring_ptr(self, params.sq_off.ring_mask);
+    self->sq_entries = params.sq_entries;
+    self->sq_array = ring_ptr(self, params.sq_off.array);
+    self->pending = 0;
+    self->cq_head = ring_ptr(self, params.cq_off.head);
+    self->cq_tail = ring_ptr(self, params.cq_off.tail);
+    self->cq_mask = *(unsigned int *) ring_ptr(self, params.cq_off.ring_mask);
+    self->cqes = ring_ptr(self, params.cq_off.cqes);
+    DEBUG("[%p] Created io_uring with %u entries\n", self, self->sq_entries);
+    return self;
+
+error_sqes:
+    munmap(self->ring, self->ring_size);
+error_ring:
+    DEBUG("Cannot map io_uring: %s\n", strerror(errno));
+    close(fd);
+    cork_delete(struct cps_uring, self);
+    return NULL;
+}
+
+static void
+cps_uring__free(struct cps_uring *self)
+{
+    munmap(self->sqes, self->sqes_size);
+    munmap(self->ring, self->ring_size);
+    close(self->fd);
+    cork_delete(struct cps_uring, self);
+}
+
+/* Pass every pending submission queue entry to the kernel. */
+static int
+cps_uring__submit(struct cps_uring *self)
+{
+    while (self->pending > 0) {
+        int  rc;
+        DEBUG("[%p] Submitting %u operations\n", self, self->pending);
+        rc = syscall(__NR_io_uring_enter, self->fd, self->pending, 0, 0,
+                     NULL, 0);
+        if (CORK_UNLIKELY(rc == -1)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EBUSY) {
+                /* The kernel is out of resources, or has completions that it
+                 * can't post until we reap some.  Try again later. */
+                return 0;
+            }
+            cork_system_error_set();
+            return -1;
+        }
+        self->pending -= rc;
+    }
+    return 0;
+}
+
+/* Move every available completion to the scheduler's work queue. */
+static void
+cps_uring__reap(struct cps_reactor *reactor)
+{
+    struct cps_uring  *self = reactor->uring;
+    unsigned int  head = *self->cq_head;
+    unsigned int  tail = __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe  *cqe = &self->cqes[head & self->cq_mask];
+        struct cps_io_op  *op =
+            (struct cps_io_op *) (uintptr_t) cqe->user_data;
+        DEBUG("[%p] Operation for continuation %p finished with %d\n",
+              reactor, op->cont, cqe->res);
+        op->result = cqe->res;
+        reactor->waiter_count--;
+        cps_rr_add(reactor->rr, op->cont);
+        head++;
+    }
+    __atomic_store_n(self->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Return an empty submission queue entry.  If the queue is full, we submit
+ * everything that's pending to make room.  Returns NULL and sets an error if
+ * we can't. */
+static struct io_uring_sqe *
+cps_uring__get_sqe(struct cps_reactor *reactor)
+{
+    struct cps_uring  *self = reactor->uring;
+    unsigned int  tail = *self->sq_tail;
+    unsigned int  index;
+    struct io_uring_sqe  *sqe;
+
+    while (tail - __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE) >=
+           self->sq_entries) {
+        unsigned int  old_pending = self->pending;
+        if (CORK_UNLIKELY(cps_uring__submit(self) != 0)) {
+            return NULL;
+        }
+        if (self->pending == old_pending) {
+            /* The kernel wouldn't take anything; making room in the
+             * completion queue might help. */
+            cps_uring__reap(reactor);
+        }
+    }
+
+    index = tail & self->sq_mask;
+    sqe = &self->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    self->sq_array[index] = index;
+    return sqe;
+}
+
+/* Add an entry that we got from cps_uring__get_sqe to the submission queue,
+ * and park the fiber until it completes.  Returns the result of the
+ * operation. */
+static int
+cps_uring__wait(struct cps_reactor *reactor, struct io_uring_sqe *sqe,
+                struct cps_fiber *fiber)
+{
+    struct cps_uring  *self = reactor->uring;
+    struct cps_io_op  op;
+    op.cont = cps_fiber_cont(fiber);
+    sqe->user_data = (uintptr_t) &op;
+    __atomic_store_n(self->sq_tail, *self->sq_tail + 1, __ATOMIC_RELEASE);
+    self->pending++;
+    reactor->waiter_count++;
+    /* We don't submit anything here.  The scheduler submits all of the
+     * operations that its continuations have queued up in one batch, at the
+     * end of each lap, or before it waits for events. */
+    cps_fiber_park(fiber);
+    return op.result;
+}
+
+#else /* !CPS_HAVE_IO_URING */
+
+struct cps_uring {
+    int  fd;
+};
+
+#endif /* CPS_HAVE_IO_URING */
+
+
+/*-----------------------------------------------------------------------
+ * Reactors
+ */
+
+#if CPS_HAVE_EPOLL
+
+struct cps_reactor *
+cps_reactor__new(struct cps_rr *rr, unsigned int flags)
+{
+    struct cps_reactor  *self;
+    int  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (CORK_UNLIKELY(epoll_fd == -1)) {
+        cork_system_error_set();
+        return NULL;
+    }
+
+    self = cork_new(struct cps_reactor);
+    DEBUG("[%p] Allocated new reactor\n", self);
+    self->rr = rr;
+    self->epoll_fd = epoll_fd;
+    self->waiter_count = 0;
+    self->wakeup_fd = -1;
+    self->uring = NULL;
+
+#if CPS_HAVE_IO_URING
+    if (!(flags & CPS_REACTOR_NO_URING)) {
+        self->uring = cps_uring__new();
+    }
+    if (self->uring != NULL) {
+        /* The io_uring descriptor is readable whenever there are completions
+         * to reap, so we can wait for them with epoll like everything else.
+         * It's level-triggered, since we reap every completion each time. */
+        struct epoll_event  event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (CORK_UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, self->uring->fd,
+                                    &event) == -1)) {
+            cork_system_error_set();
+            cps_uring__free(self->uring);
+            close(epoll_fd);
+            cork_delete(struct cps_reactor, self);
+            return NULL;
+        }
+    }
+#endif
+    return self;
+}
+
+void
+cps_reactor__free(struct cps_reactor *self)
+{
+    DEBUG("[%p] Freeing reactor\n", self);
+#if CPS_HAVE_IO_URING
+    if (self->uring != NULL) {
+        cps_uring__free(self->uring);
+    }
+#endif
+    close(self->epoll_fd);
+    cork_delete(struct cps_reactor, self);
+}
+
+int
+cps_io_init(struct cps_io *io, struct cps_rr *rr, int fd)
+{
+    struct epoll_event  event;
+    struct cps_reactor  *reactor = cps_rr__get_reactor(rr);
+    if (CORK_UNLIKELY(reactor == NULL)) {
+        return -1;
+    }
+
+    io->fd = fd;
+    io->reactor = reactor;
+    io->reader = NULL;
+    io->writer = NULL;
+    io->pollable = true;
+
+    /* We register for both directions up front, so that we never have to call
+     * epoll_ctl again while the descriptor is in use. */
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = io;
+    DEBUG("[%p] Registering fd %d\n", reactor, fd);
+    if (CORK_UNLIKELY(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event)
+                      == -1)) {
+        if (errno == EPERM) {
+            /* Regular files and directories don't support epoll, but they're
+             * always ready, so we don't need to wait for them. */
+            DEBUG("[%p] fd %d is always ready\n", reactor, fd);
+            io->pollable = false;
+            return 0;
+        }
+        cork_system_error_set();
+        return -1;
+    }
+    return 0;
+}
+
+void
+cps_io_done(struct cps_io *io)
+{
+    assert(io->reader == NULL && io->writer == NULL);
+    if (io->pollable) {
+        DEBUG("[%p] Unregistering fd %d\n", io->reactor, io->fd);
+        epoll_ctl(io->reactor->epoll_fd, EPOLL_CTL_DEL, io->fd, NULL);
+    }
+}
+
+/* Wake up whatever is waiting for one direction of a descriptor.  If the same
+ * continuation is waiting for both directions, this wakes it up for both. */
+static void
+cps_io__wake(struct cps_io *io, struct cps_cont **slot)
+{
+    struct cps_cont  *cont = *slot;
+    if (cont == NULL) {
+        return;
+    }
+    DEBUG("[%p] fd %d is ready for continuation %p\n",
+          io->reactor, io->fd, cont);
+    if (io->reader == cont) {
+        io->reader = NULL;
+    }
+    if (io->writer == cont) {
+        io->writer = NULL;
+    }
+    io->reactor->waiter_count--;
+    cps_rr_add(io->reactor->rr, cont);
+}
+
+/* Submit any pending io_uring operations, then wait up to timeout
+ * milliseconds (-1 for no limit) for any registered descriptors to become
+ * ready or any operations to complete, and add their waiting continuations to
+ * the scheduler.  If wakeup_fd isn't -1, we also return when it's readable.
+ * Returns -1 and sets an error if something fails. */
+int
+cps_reactor__poll(struct cps_reactor *self, int wakeup_fd, int timeout)
+{
+    struct epoll_event  events[EVENT_BATCH_SIZE];
+    int  count;
+    int  i;
+
+#if CPS_HAVE_IO_URING
+    if (self->uring != NULL) {
+        if (CORK_UNLIKELY(cps_uring__submit(self->uring) != 0)) {
+            return -1;
+        }
+        /* Some of the operations might have finished immediately, in which
+         * case there's no need to block. */
+        if (*self->uring->cq_head !=
+            __atomic_load_n(self->uring->cq_tail, __ATOMIC_ACQUIRE)) {
+            timeout = 0;
+        }
+    }
+#endif
+
+    /* The scheduler might have enabled wakeups since the last time we
+     * polled.  The wakeup descriptor is level-triggered, since the scheduler
+     * clears it itself. */
+    if (CORK_UNLIKELY(wakeup_fd != self->wakeup_fd)) {
+        struct epoll_event  event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (CORK_UNLIKELY(epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, wakeup_fd,
+                                    &event) == -1)) {
+            cork_system_error_set();
+            return -1;
+        }
+        self->wakeup_fd = wakeup_fd;
+    }
+
+    DEBUG("[%p] Polling with timeout %d\n", self, timeout);
+    count = epoll_wait(self->epoll_fd, events, EVENT_BATCH_SIZE, timeout);
+    if (CORK_UNLIKELY(count == -1)) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        cork_system_error_set();
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct cps_io  *io = events[i].data.ptr;
+        uint32_t  flags = events[i].events;
+        if (io == NULL) {
+            /* The wakeup or io_uring descriptor */
+            continue;
+        }
+        if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            cps_io__wake(io, &io->reader);
+        }
+        if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            cps_io__wake(io, &io->writer);
+        }
+    }
+
+#if CPS_HAVE_IO_URING
+    if (self->uring != NULL) {
+        cps_uring__reap(self);
+    }
+#endif
+    return 0;
+}
+
+#else /* !CPS_HAVE_EPOLL */
+
+struct cps_reactor *
+cps_reactor__new(struct cps_rr *rr, unsigned int flags)
+{
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR, "I/O reactors aren't supported on this platform");
+    return NULL;
+}
+
+void
+cps_reactor__free(struct cps_reactor *self)
+{
+}
+
+int
+cps_io_init(struct cps_io *io, struct cps_rr *rr, int fd)
+{
+    return cps_rr__get_reactor(rr) == NULL? -1: 0;
+}
+
+void
+cps_io_done(struct cps_io *io)
+{
+}
+
+int
+cps_reactor__poll(struct cps_reactor *self, int wakeup_fd, int timeout)
+{
+    return 0;
+}
+
+#endif /* CPS_HAVE_EPOLL */
+
+
+bool
+cps_reactor__has_waiters(struct cps_reactor *self)
+{
+    return self->waiter_count > 0;
+}
+
+/* Submit any io_uring operations that are pending, without waiting for
+ * anything. */
+int
+cps_reactor__submit(struct cps_reactor *self)
+{
+#if CPS_HAVE_IO_URING
+    if (self->uring != NULL) {
+        return cps_uring__submit(self->uring);
+    }
+#endif
+    return 0;
+}
+
+bool
+cps_reactor__has_uring(struct cps_reactor *self)
+{
+    return self->uring != NULL;
+}
+
+void
+cps_io_wait(struct cps_io *io, unsigned int events, struct cps_cont *cont)
+{
+    DEBUG("[%p] Continuation %p waiting for fd %d (%s%s)\n",
+          io->reactor, cont, io->fd,
+          (events & CPS_IO_READ)? "r": "", (events & CPS_IO_WRITE)? "w": "");
+    assert(events != 0);
+    if (CORK_UNLIKELY(!io->pollable)) {
+        cps_rr_add(io->reactor->rr, cont);
+        return;
+    }
+    if (events & CPS_IO_READ) {
+        assert(io->reader == NULL);
+        io->reader = cont;
+    }
+    if (events & CPS_IO_WRITE) {
+        assert(io->writer == NULL);
+        io->writer = cont;
+    }
+    io->reactor->waiter_count++;
+}
+
+void
+cps_fiber_wait_io(struct cps_fiber *fiber, struct cps_io *io,
+                  unsigned int events)
+{
+    /* The reactor can't add the fiber back to the work queue until the
+     * scheduler polls it, which can't happen until after we've parked. */
+    cps_io_wait(io, events, cps_fiber_cont(fiber));
+    cps_fiber_park(fiber);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Fiber I/O
+ */
+
+/* Each of these functions uses io_uring if the descriptor's reactor has one.
+ * Otherwise it makes the system call directly, and waits for the descriptor
+ * to become ready if the call fails with EAGAIN. */
+
+#define check_uring_result(result) \
+    do { \
+        if (CORK_UNLIKELY((result) < 0)) { \
+            errno = -(result); \
+            cork_system_error_set(); \
+            return -1; \
+        } \
+        return (result); \
+    } while (0)
+
+#define check_syscall_result(result) \
+    do { \
+        if (CORK_UNLIKELY((result) == -1)) { \
+            cork_system_error_set(); \
+            return -1; \
+        } \
+        return (result); \
+    } while (0)
+
+ssize_t
+cps_fiber_read(struct cps_fiber *fiber, struct cps_io *io,
+               void *buf, size_t size)
+{
+    ssize_t  rc;
+#if CPS_HAVE_IO_URING
+    if (io->reactor->uring != NULL) {
+        struct io_uring_sqe  *sqe = cps_uring__get_sqe(io->reactor);
+        if (CORK_UNLIKELY(sqe == NULL)) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = io->fd;
+        sqe->addr = (uintptr_t) buf;
+        sqe->len = size;
+        sqe->off = (uint64_t) -1;
+        rc = cps_uring__wait(io->reactor, sqe, fiber);
+        check_uring_result(rc);
+    }
+#endif
+    while ((rc = read(io->fd, buf, size)) == -1 && errno == EAGAIN) {
+        cps_fiber_wait_io(fiber, io, CPS_IO_READ);
+    }
+    check_syscall_result(rc);
+}
+
+ssize_t
+cps_fiber_write(struct cps_fiber *fiber, struct cps_io *io,
+                const void *buf, size_t size)
+{
+    ssize_t  rc;
+#if CPS_HAVE_IO_URING
+    if (io->reactor->uring != NULL) {
+        struct io_uring_sqe  *sqe = cps_uring__get_sqe(io->reactor);
+        if (CORK_UNLIKELY(sqe == NULL)) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = io->fd;
+        sqe->addr = (uintptr_t) buf;
+        sqe->len = size;
+        sqe->off = (uint64_t) -1;
+        rc = cps_uring__wait(io->reactor, sqe, fiber);
+        check_uring_result(rc);
+    }
+#endif
+    while ((rc = write(io->fd, buf, size)) == -1 && errno == EAGAIN) {
+        cps_fiber_wait_io(fiber, io, CPS_IO_WRITE);
+    }
+    check_syscall_result(rc);
+}
+
+int
+cps_fiber_accept(struct cps_fiber *fiber, struct cps_io *io,
+                 struct sockaddr *addr, socklen_t *addr_len)
+{
+    int  rc;
+#if CPS_HAVE_IO_URING
+    if (io->reactor->uring != NULL) {
+        struct io_uring_sqe  *sqe = cps_uring__get_sqe(io->reactor);
+        if (CORK_UNLIKELY(sqe == NULL)) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = io->fd;
+        sqe->addr = (uintptr_t) addr;
+        sqe->addr2 = (uintptr_t) addr_len;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        rc = cps_uring__wait(io->reactor, sqe, fiber);
+        check_uring_result(rc);
+    }
+#endif
+    while ((rc = accept4(io->fd, addr, addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1 &&
+           errno == EAGAIN) {
+        cps_fiber_wait_io(fiber, io, CPS_IO_READ);
+    }
+    check_syscall_result(rc);
+}
+
+int
+cps_fiber_fsync(struct cps_fiber *fiber, struct cps_io *io)
+{
+    int  rc;
+#if CPS_HAVE_IO_URING
+    if (io->reactor->uring != NULL) {
+        struct io_uring_sqe  *sqe = cps_uring__get_sqe(io->reactor);
+        if (CORK_UNLIKELY(sqe == NULL)) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = io->fd;
+        rc = cps_uring__wait(io->reactor, sqe, fiber);
+        check_uring_result(rc);
+    }
+#endif
+    /* epoll can't help with this one; it blocks the whole scheduler. */
+    rc = fsync(io->fd);
+    check_syscall_result(rc);
+}
@@ -0,0 +1,88 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <libcork/core.h>
+
+#include "copse/cps.h"
+#include "ring.h"
+
+
+#if !defined(CPS_DEBUG_RING)
+#define CPS_DEBUG_RING  0
+#endif
+
+#if CPS_DEBUG_RING
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Work queues
+ */
+
+void
+cps_ring__init(struct cps_ring *ring, size_t initial_size)
+{
+    /* The size must be a power of 2. */
+    assert(initial_size > 0 && (initial_size & (initial_size - 1)) == 0);
+    ring->items = cork_calloc(initial_size, sizeof(struct cps_cont *));
+    ring->size_mask = initial_size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+void
+cps_ring__done(struct cps_ring *ring)
+{
+    cork_cfree(ring->items, cps_ring__size(ring), sizeof(struct cps_cont *));
+}
+
+void
+cps_ring__grow(struct cps_ring *ring)
+{
+    size_t  old_used_size = cps_ring__used_size(ring);
+    size_t  old_size = ring->size_mask + 1;
+    size_t  new_size = old_size * 2;
+    size_t  pre_size;
+    struct cps_cont  **items =
+        cork_calloc(new_size, sizeof(struct cps_cont *));
+    DEBUG("[%p] Resizing work queue to %zu elements\n", ring, new_size);
+
+    /* Copy the existing continuations into the beginning of the new ring
+     * buffer.  (We can't reuse the old buffer directly because the wrap-around
+     * point might have changed.  This code path will be executed infrequently
+     * enough that we don't need to over-optimize it.) */
+
+    /* The number of elements in the old ring that appear before its
+     * wrap-around point. */
+    pre_size = old_size - ring->head;
+
+    DEBUG("[%p]   Moving %zu elements to beginning of new queue\n",
+          ring, pre_size);
+    memcpy(items, ring->items + ring->head,
+           pre_size * sizeof(struct cps_cont *));
+    if (ring->head > 0) {
+        DEBUG("[%p]   Moving %zu elements to end of new queue\n",
+              ring, ring->head);
+        memcpy(items + pre_size, ring->items,
+               ring->head * sizeof(struct cps_cont *));
+    }
+
+    cork_cfree(ring->items, old_size, sizeof(struct cps_cont *));
+    ring->items = items;
+    ring->head = 0;
+    ring->tail = old_used_size;
+    ring->size_mask = new_size - 1;
+}
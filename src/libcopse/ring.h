@@ -0,0 +1,83 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef LIBCOPSE_RING_H
+#define LIBCOPSE_RING_H
+
+/* This header is private to libcopse; it isn't installed. */
+
+#include <libcork/core.h>
+
+#include "copse/cps.h"
+
+
+/*-----------------------------------------------------------------------
+ * Work queues
+ */
+
+/* The work queue shared by the round-robin and priority schedulers.  This is a
+ * ring buffer of continuation pointers.  The size of the ring buffer will
+ * always be a power of 2, allowing us to modulo by the queue size with a &
+ * operation instead of a %.
+ *
+ * The head is the index into the work queue of the next continuation to pass
+ * control to.  The tail is the index of the next empty element of the work
+ * queue.
+ *
+ * We always leave at least one element of the queue empty.  This means that if
+ * head == tail, the queue is empty. */
+struct cps_ring {
+    struct cps_cont  **items;
+    size_t  size_mask;  /* == allocated_count - 1 */
+    size_t  head;
+    size_t  tail;
+};
+
+/* Defined in ring.c */
+void
+cps_ring__init(struct cps_ring *ring, size_t initial_size);
+
+void
+cps_ring__done(struct cps_ring *ring);
+
+void
+cps_ring__grow(struct cps_ring *ring);
+
+#define cps_ring__is_empty(ring)  ((ring)->head == (ring)->tail)
+#define cps_ring__used_size(ring) \
+    (((ring)->tail - (ring)->head) & (ring)->size_mask)
+#define cps_ring__size(ring)  ((ring)->size_mask + 1)
+#define cps_ring__peek(ring)  ((ring)->items[(ring)->head])
+
+/* Add a continuation to the end of the queue, growing it first if it's full.
+ * Returns whether we had to grow the queue. */
+static inline bool
+cps_ring__push(struct cps_ring *ring, struct cps_cont *cont)
+{
+    bool  grew = false;
+    if (CORK_UNLIKELY(cps_ring__used_size(ring) == ring->size_mask)) {
+        cps_ring__grow(ring);
+        grew = true;
+    }
+    ring->items[ring->tail] = cont;
+    ring->tail = (ring->tail + 1) & ring->size_mask;
+    return grew;
+}
+
+/* The queue must not be empty. */
+static inline struct cps_cont *
+cps_ring__pop(struct cps_ring *ring)
+{
+    struct cps_cont  *cont = ring->items[ring->head];
+    ring->head = (ring->head + 1) & ring->size_mask;
+    return cont;
+}
+
+
+#endif /* LIBCOPSE_RING_H */
@@ -7,17 +7,87 @@
  * ----------------------------------------------------------------------
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
 
 #include "copse/cps.h"
+#include "copse/detect.h"
 #include "copse/round-robin.h"
+#include "copse/timer.h"
+#include "copse/trace.h"
+#include "ring.h"
+
+#if CPS_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/* Defined in reactor.c */
+struct cps_reactor *
+cps_reactor__new(struct cps_rr *rr, unsigned int flags);
+
+void
+cps_reactor__free(struct cps_reactor *reactor);
+
+bool
+cps_reactor__has_waiters(struct cps_reactor *reactor);
+
+int
+cps_reactor__poll(struct cps_reactor *reactor, int wakeup_fd, int timeout);
+
+int
+cps_reactor__submit(struct cps_reactor *reactor);
+
+bool
+cps_reactor__has_uring(struct cps_reactor *reactor);
+
+
+/* Defined in cps.c */
+bool
+cps__is_done(struct cps_cont *cont);
+
+/* Defined in trace.c */
+void
+cps_trace__record(enum cps_trace_event event, const void *object);
 
 
 #if !defined(CPS_DEBUG_RR)
 #define CPS_DEBUG_RR  0
 #endif
 
+/* Whether new schedulers run their continuations under a trampoline. */
+#if !defined(CPS_TRAMPOLINE)
+#define CPS_TRAMPOLINE  0
+#endif
+
+/* Whether schedulers collect runtime statistics (see cps_rr_get_stats). */
+#if !defined(CPS_RR_STATS)
+#define CPS_RR_STATS  0
+#endif
+
+/* Whether schedulers record trace events (see copse/trace.h). */
+#if !defined(CPS_TRACE)
+#define CPS_TRACE  0
+#endif
+
+#if CPS_TRACE
+#define cps_rr__trace(event, self) \
+    cps_trace__record(CPS_TRACE_RR_##event, (self))
+#else
+#define cps_rr__trace(event, self)  /* no tracing */
+#endif
+
 #if CPS_DEBUG_RR
 #include <stdio.h>
 #define DEBUG(...) fprintf(stderr, __VA_ARGS__)
@@ -28,148 +98,731 @@
 
 #define INITIAL_QUEUE_SIZE  16
 
+/* How many continuations we run between checks for expired timers. */
+#define EVENT_CHECK_INTERVAL  64
+
+/* The inbox holds continuations that other threads have added to the
+ * scheduler.  It's a lock-free stack: producers push new nodes onto the front
+ * with a compare-and-swap, and the scheduler's own thread takes the entire
+ * stack at once and reverses it, so that the continuations are added to the
+ * work queue in the order that they arrived. */
+struct cps_rr_inbox_node {
+    struct cps_rr_inbox_node  *next;
+    struct cps_cont  *cont;
+};
+
 struct cps_rr {
-    struct cps_cont  *yield;
+    struct cps_cont  yield;
+    /* Starts each lap of cps_rr_run_one_lap (see cps_rr__start_lap). */
+    struct cps_cont  lap;
     struct cps_cont  *done;
+    bool  trampolined;
+
+    /* The work queue (see ring.h). */
+    struct cps_ring  queue;
+
+    struct cps_rr_inbox_node * volatile  inbox;
 
-    /* The work queue.  This is a ring buffer of continuation pointers.  The
-     * size of the ring buffer will always be a power of 2, allowing us to
-     * module by the queue size with a & operation instead of a %.
-     *
-     * The head is the index into the work queue of the next continuation to
-     * pass control to.  The tail is the index of the next empty element of the
-     * work queue.
-     *
-     * We always leave at least one element of the queue empty.  This means that
-     * if head == tail, the queue is empty. */
-    struct cps_cont  **queue;
-    size_t  size_mask;  /* == allocated_count - 1 */
-    size_t  head;
-    size_t  tail;
+    /* If wakeups are enabled, a producer writes to wakeup_write_fd whenever it
+     * adds to an empty inbox, making wakeup_read_fd readable.  (These are the
+     * same eventfd where that's available.)  Both are -1 otherwise. */
+    int  wakeup_read_fd;
+    int  wakeup_write_fd;
+
+    /* We don't create the timer wheel until someone adds a timer, or the
+     * reactor until someone registers a file descriptor. */
+    struct cps_timer_wheel  *timers;
+    struct cps_reactor  *reactor;
+    unsigned int  event_check_countdown;
+
+    /* The cps_rr_sleepers that cps_sleep_cont has created, and which haven't
+     * fired yet.  We own these, so we have to free any that are left over
+     * when the scheduler is freed. */
+    struct cork_dllist  sleepers;
+
+#if CPS_RR_STATS
+    struct cps_rr_stats  stats;
+#endif
 };
 
-#define queue_is_empty(self)  ((self)->head == (self)->tail)
-#define queue_used_size(self) \
-    (((self)->tail - (self)->head) & (self)->size_mask)
+#if CPS_RR_STATS
+#define cps_rr__stat_inc(self, field)  ((self)->stats.field++)
+/* When a continuation finishes by calling cps_call on the scheduler's yield
+ * continuation, cps_call's placeholder `next` ends up in the work queue.  We
+ * don't count it when it comes back out. */
+#define cps_rr__stat_resumed(self, cont) \
+    do { \
+        if (!cps__is_done(cont)) { \
+            (self)->stats.resumed++; \
+        } \
+    } while (0)
+#define cps_rr__stat_queue_length(self) \
+    do { \
+        size_t  __length = cps_ring__used_size(&(self)->queue); \
+        if (__length > (self)->stats.peak_queue_length) { \
+            (self)->stats.peak_queue_length = __length; \
+        } \
+    } while (0)
+#else
+#define cps_rr__stat_inc(self, field)  /* no stats */
+#define cps_rr__stat_resumed(self, cont)  /* no stats */
+#define cps_rr__stat_queue_length(self)  /* no stats */
+#endif
 
 
 static void
 cps_rr__yield(void *user_data, struct cps_cont *next);
 
+static void
+cps_rr__start_lap(void *user_data, struct cps_cont *next);
+
+static void
+cps_rr__free_sleepers(struct cps_rr *self);
+
 
 struct cps_rr *
 cps_rr_new(void)
 {
     struct cps_rr  *self = cork_new(struct cps_rr);
     DEBUG("[%p] Allocated new round-robin scheduler\n", self);
-    self->yield = cps_cont_new();
-    cps_cont_set(self->yield, self, NULL, cps_rr__yield);
-    self->queue = cork_calloc(INITIAL_QUEUE_SIZE, sizeof(struct cps_cont *));
-    self->size_mask = INITIAL_QUEUE_SIZE - 1;
-    self->head = 0;
-    self->tail = 0;
+    cps_cont_init(&self->yield);
+    cps_cont_set(&self->yield, self, NULL, cps_rr__yield);
+    cps_cont_init(&self->lap);
+    cps_cont_set(&self->lap, self, NULL, cps_rr__start_lap);
+    self->trampolined = CPS_TRAMPOLINE;
+    cps_ring__init(&self->queue, INITIAL_QUEUE_SIZE);
+    self->inbox = NULL;
+    self->wakeup_read_fd = -1;
+    self->wakeup_write_fd = -1;
+    self->timers = NULL;
+    self->reactor = NULL;
+    self->event_check_countdown = EVENT_CHECK_INTERVAL;
+    cork_dllist_init(&self->sleepers);
+    cps_rr_reset_stats(self);
     return self;
 }
 
 void
 cps_rr_free(struct cps_rr *self)
 {
-    size_t  queue_size = self->size_mask + 1;
     DEBUG("[%p] Freeing round-robin scheduler\n", self);
-    cps_cont_free(self->yield);
-    cork_cfree(self->queue, queue_size, sizeof(struct cps_cont *));
+    while (self->inbox != NULL) {
+        struct cps_rr_inbox_node  *node = self->inbox;
+        self->inbox = node->next;
+        cork_delete(struct cps_rr_inbox_node, node);
+    }
+    if (self->reactor != NULL) {
+        cps_reactor__free(self->reactor);
+    }
+    if (self->wakeup_read_fd != -1) {
+        close(self->wakeup_read_fd);
+        if (self->wakeup_write_fd != self->wakeup_read_fd) {
+            close(self->wakeup_write_fd);
+        }
+    }
+    if (self->timers != NULL) {
+        cps_rr__free_sleepers(self);
+        cps_timer_wheel_free(self->timers);
+    }
+    cps_cont_done(&self->yield);
+    cps_cont_done(&self->lap);
+    cps_ring__done(&self->queue);
     cork_delete(struct cps_rr, self);
 }
 
 void
 cps_rr_add(struct cps_rr *self, struct cps_cont *cont)
 {
-    size_t  old_used_size = queue_used_size(self);
-
     DEBUG("[%p] Adding continuation %p\n", self, cont);
-    if (old_used_size == self->size_mask) {
-        /* The queue is full.  Resize! */
-        size_t  old_size = self->size_mask + 1;
-        size_t  new_size = old_size * 2;
-        size_t  pre_size;
-        struct cps_cont  **queue =
-            cork_calloc(new_size, sizeof(struct cps_cont *));
-        DEBUG("[%p]   Resizing work queue to %zu elements\n", self, new_size);
-
-        /* Copy the existing continuations into the beginning of the work queue.
-         * (We can't reuse the old queue directly because the wrap-around point
-         * might have changed.  This code path will be executed infrequently
-         * enough that we don't need to over-optimize it.) */
-
-        /* The number of elements in the old queue that appear before the
-         * wrap-around point of the ring buffer. */
-        pre_size = old_size - self->head;
-
-        DEBUG("[%p]   Moving %zu elements to beginning of new queue\n",
-              self, pre_size);
-        memcpy(queue, self->queue + self->head,
-               pre_size * sizeof(struct cps_cont *));
-        if (self->head > 0) {
-            DEBUG("[%p]   Moving %zu elements to end of new queue\n",
-                  self, self->head);
-            memcpy(queue + pre_size, self->queue,
-                   self->head * sizeof(struct cps_cont *));
+    if (cps_ring__push(&self->queue, cont)) {
+        cps_rr__stat_inc(self, queue_resizes);
+    }
+    cps_rr__stat_queue_length(self);
+}
+
+static void
+cps_rr__signal_wakeup(struct cps_rr *self)
+{
+    uint64_t  value = 1;
+    ssize_t  rc;
+    /* If the fd is already full, the scheduler already has a wakeup pending,
+     * so we can ignore EAGAIN. */
+    do {
+        rc = write(self->wakeup_write_fd, &value, sizeof(value));
+    } while (rc == -1 && errno == EINTR);
+}
+
+static void
+cps_rr__clear_wakeup(struct cps_rr *self)
+{
+    uint64_t  buf[16];
+    ssize_t  rc;
+    do {
+        rc = read(self->wakeup_read_fd, buf, sizeof(buf));
+    } while (rc > 0 || (rc == -1 && errno == EINTR));
+}
+
+void
+cps_rr_add_remote(struct cps_rr *self, struct cps_cont *cont)
+{
+    struct cps_rr_inbox_node  *node = cork_new(struct cps_rr_inbox_node);
+    struct cps_rr_inbox_node  *head;
+    DEBUG("[%p] Adding continuation %p to inbox\n", self, cont);
+    node->cont = cont;
+    do {
+        head = self->inbox;
+        node->next = head;
+    } while (cork_ptr_cas(&self->inbox, head, node) != head);
+
+    if (head == NULL && self->wakeup_write_fd != -1) {
+        cps_rr__signal_wakeup(self);
+    }
+}
+
+/* Move everything in the inbox into the work queue. */
+static void
+cps_rr__splice_inbox(struct cps_rr *self)
+{
+    struct cps_rr_inbox_node  *node;
+    struct cps_rr_inbox_node  *reversed = NULL;
+
+    /* Clear the wakeup fd *before* emptying the inbox, so that we can't miss a
+     * wakeup for anything added after we empty it. */
+    if (self->wakeup_read_fd != -1) {
+        cps_rr__clear_wakeup(self);
+    }
+
+    do {
+        node = self->inbox;
+    } while (cork_ptr_cas(&self->inbox, node, NULL) != node);
+
+    while (node != NULL) {
+        struct cps_rr_inbox_node  *next = node->next;
+        node->next = reversed;
+        reversed = node;
+        node = next;
+    }
+
+    while (reversed != NULL) {
+        struct cps_rr_inbox_node  *next = reversed->next;
+        DEBUG("[%p] Moving continuation %p from inbox\n",
+              self, reversed->cont);
+        cps_rr_add(self, reversed->cont);
+        cps_rr__stat_inc(self, remote_adds);
+        cork_delete(struct cps_rr_inbox_node, reversed);
+        reversed = next;
+    }
+}
+
+#define cps_rr__check_inbox(self) \
+    do { \
+        if (CORK_UNLIKELY((self)->inbox != NULL)) { \
+            cps_rr__splice_inbox(self); \
+        } \
+    } while (0)
+
+int
+cps_rr_enable_wakeup(struct cps_rr *self)
+{
+    if (self->wakeup_read_fd != -1) {
+        return 0;
+    }
+
+#if CPS_HAVE_EVENTFD
+    self->wakeup_read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (CORK_UNLIKELY(self->wakeup_read_fd == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    self->wakeup_write_fd = self->wakeup_read_fd;
+#else
+    {
+        int  fds[2];
+        int  i;
+        if (CORK_UNLIKELY(pipe(fds) == -1)) {
+            cork_system_error_set();
+            return -1;
+        }
+        for (i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        self->wakeup_read_fd = fds[0];
+        self->wakeup_write_fd = fds[1];
+    }
+#endif
+
+    /* A producer might have filled the inbox before we had a wakeup fd. */
+    if (self->inbox != NULL) {
+        cps_rr__signal_wakeup(self);
+    }
+    return 0;
+}
+
+int
+cps_rr_get_wakeup_fd(struct cps_rr *self)
+{
+    return self->wakeup_read_fd;
+}
+
+int
+cps_rr_wait(struct cps_rr *self)
+{
+    assert(self->wakeup_read_fd != -1);
+    while (self->inbox == NULL) {
+        struct pollfd  pfd;
+        int  rc;
+        pfd.fd = self->wakeup_read_fd;
+        pfd.events = POLLIN;
+        rc = poll(&pfd, 1, -1);
+        if (CORK_UNLIKELY(rc == -1)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cork_system_error_set();
+            return -1;
+        }
+        /* The wakeup might be left over from an inbox that we've already
+         * spliced, so clear it and check again. */
+        cps_rr__clear_wakeup(self);
+    }
+    return 0;
+}
+
+void
+cps_rr_add_timer(struct cps_rr *self, struct cps_timer *timer)
+{
+    if (CORK_UNLIKELY(self->timers == NULL)) {
+        self->timers = cps_timer_wheel_new();
+    }
+    DEBUG("[%p] Adding timer %p\n", self, timer);
+    cps_timer_wheel_add(self->timers, timer);
+}
+
+void
+cps_rr_cancel_timer(struct cps_rr *self, struct cps_timer *timer)
+{
+    if (self->timers != NULL) {
+        DEBUG("[%p] Cancelling timer %p\n", self, timer);
+        cps_timer_wheel_cancel(self->timers, timer);
+    }
+}
+
+struct cps_rr_sleeper {
+    struct cps_timer  timer;
+    struct cork_dllist_item  item;
+    struct cps_rr  *rr;
+    struct cps_cont  *cont;
+};
+
+static void
+cps_rr_sleeper__fire(struct cps_timer *timer)
+{
+    struct cps_rr_sleeper  *sleeper =
+        cork_container_of(timer, struct cps_rr_sleeper, timer);
+    cork_dllist_remove(&sleeper->item);
+    cps_rr_add(sleeper->rr, sleeper->cont);
+    cork_delete(struct cps_rr_sleeper, sleeper);
+}
+
+/* Free any sleepers that haven't fired yet.  The timer wheel is about to be
+ * freed, so we don't bother cancelling their timers.  We don't own the
+ * sleeping continuations themselves. */
+static void
+cps_rr__free_sleepers(struct cps_rr *self)
+{
+    while (!cork_dllist_is_empty(&self->sleepers)) {
+        struct cork_dllist_item  *curr = cork_dllist_start(&self->sleepers);
+        struct cps_rr_sleeper  *sleeper =
+            cork_container_of(curr, struct cps_rr_sleeper, item);
+        DEBUG("[%p] Freeing sleeper for continuation %p\n",
+              self, sleeper->cont);
+        cork_dllist_remove(curr);
+        cork_delete(struct cps_rr_sleeper, sleeper);
+    }
+}
+
+void
+cps_sleep_cont(struct cps_rr *self, uint64_t deadline, struct cps_cont *cont)
+{
+    struct cps_rr_sleeper  *sleeper = cork_new(struct cps_rr_sleeper);
+    cps_timer_init(&sleeper->timer, deadline, cps_rr_sleeper__fire, NULL);
+    sleeper->rr = self;
+    sleeper->cont = cont;
+    cork_dllist_add_to_tail(&self->sleepers, &sleeper->item);
+    cps_rr_add_timer(self, &sleeper->timer);
+}
+
+int
+cps_rr_enable_reactor(struct cps_rr *self, unsigned int flags)
+{
+    if (self->reactor != NULL) {
+        return 0;
+    }
+    self->reactor = cps_reactor__new(self, flags);
+    return (self->reactor == NULL)? -1: 0;
+}
+
+bool
+cps_rr_reactor_has_uring(struct cps_rr *self)
+{
+    return self->reactor != NULL && cps_reactor__has_uring(self->reactor);
+}
+
+struct cps_reactor *
+cps_rr__get_reactor(struct cps_rr *self)
+{
+    if (CORK_UNLIKELY(self->reactor == NULL)) {
+        self->reactor = cps_reactor__new(self, 0);
+    }
+    return self->reactor;
+}
+
+#define cps_rr__has_timers(self) \
+    ((self)->timers != NULL && cps_timer_wheel_count((self)->timers) > 0)
+
+#define cps_rr__has_io_waiters(self) \
+    ((self)->reactor != NULL && cps_reactor__has_waiters((self)->reactor))
+
+/* Pick up anything that other threads have added to the inbox, fire any
+ * expired timers, and wake up any continuations whose file descriptors are
+ * ready, without blocking.  A chain of continuations (or fibers) that keep
+ * yielding to each other never returns to cps_rr_drain, so this is the only
+ * place where they'll notice any of these. */
+static void
+cps_rr__check_events(struct cps_rr *self)
+{
+    self->event_check_countdown = EVENT_CHECK_INTERVAL;
+    cps_rr__check_inbox(self);
+    if (cps_rr__has_io_waiters(self)) {
+        /* We don't block, so this shouldn't fail.  If it does, the error
+         * stays set, and cps_rr_drain reports it once the current
+         * continuation returns. */
+        cps_reactor__poll(self->reactor, self->wakeup_read_fd, 0);
+    }
+    if (cps_rr__has_timers(self)) {
+        cps_timer_wheel_advance(self->timers, cps_now());
+    }
+}
+
+/* Checking the clock and the reactor isn't free, so we only do it every so
+ * often. */
+#define cps_rr__maybe_check_events(self) \
+    do { \
+        if (CORK_UNLIKELY(--(self)->event_check_countdown == 0)) { \
+            cps_rr__check_events(self); \
+        } \
+    } while (0)
+
+/* Sleep until the next timer deadline, until a file descriptor that someone is
+ * waiting for becomes ready, or until another thread adds something to the
+ * inbox (if wakeups are enabled).  Then process any events that occurred. */
+static int
+cps_rr__wait_for_events(struct cps_rr *self)
+{
+    uint64_t  deadline = cps_rr__has_timers(self)?
+        cps_timer_wheel_next_deadline(self->timers): UINT64_MAX;
+    uint64_t  now = cps_now();
+    uint64_t  delay = (deadline > now)? deadline - now: 0;
+    int  timeout;
+
+    cps_rr__stat_inc(self, waits);
+
+    if (deadline == UINT64_MAX) {
+        timeout = -1;
+    } else {
+        uint64_t  ms = (delay + CPS_NSEC_PER_MSEC - 1) / CPS_NSEC_PER_MSEC;
+        timeout = (ms > INT_MAX)? INT_MAX: (int) ms;
+    }
+
+    if (self->reactor != NULL) {
+        DEBUG("[%p] Polling reactor for %dms\n", self, timeout);
+        if (CORK_UNLIKELY(cps_reactor__poll
+                          (self->reactor, self->wakeup_read_fd, timeout)
+                          == -1)) {
+            return -1;
+        }
+    } else if (delay > 0) {
+        DEBUG("[%p] Sleeping for %" PRIu64 "ns\n", self, delay);
+        if (self->wakeup_read_fd != -1) {
+            struct pollfd  pfd;
+            pfd.fd = self->wakeup_read_fd;
+            pfd.events = POLLIN;
+            if (CORK_UNLIKELY(poll(&pfd, 1, timeout) == -1 &&
+                              errno != EINTR)) {
+                cork_system_error_set();
+                return -1;
+            }
+        } else {
+            struct timespec  ts;
+            ts.tv_sec = delay / CPS_NSEC_PER_SEC;
+            ts.tv_nsec = delay % CPS_NSEC_PER_SEC;
+            /* If we're interrupted, we'll just check the timers early. */
+            nanosleep(&ts, NULL);
         }
+    }
 
-        cork_cfree(self->queue, old_size, sizeof(struct cps_cont *));
-        self->queue = queue;
-        self->head = 0;
-        self->tail = old_used_size;
-        self->size_mask = new_size - 1;
+    /* The wakeup fd is level-triggered, so if we left it readable, every later
+     * poll would return right away, and we'd spin until the next timer or I/O
+     * event.  It can be readable even though the inbox is empty (if a remote
+     * add's write lands after we've already spliced its continuation), so
+     * always clear it here, and then pick up anything that's in the inbox. */
+    if (self->wakeup_read_fd != -1) {
+        cps_rr__splice_inbox(self);
     }
 
-    self->queue[self->tail] = cont;
-    self->tail = (self->tail + 1) & self->size_mask;
+    self->event_check_countdown = EVENT_CHECK_INTERVAL;
+#if CPS_RR_STATS
+    {
+        uint64_t  after = cps_now();
+        self->stats.wait_ns += after - now;
+        now = after;
+    }
+#else
+    now = cps_now();
+#endif
+    if (cps_rr__has_timers(self)) {
+        cps_timer_wheel_advance(self->timers, now);
+    }
+    return 0;
+}
+
+void
+cps_rr_set_trampolined(struct cps_rr *self, bool trampolined)
+{
+    self->trampolined = trampolined;
 }
 
 struct cps_cont *
 cps_rr_get_yield(struct cps_rr *rr)
 {
-    return rr->yield;
+    return &rr->yield;
 }
 
+/* Pass control to the continuation at the head of the work queue. */
 static void
-cps_rr__yield(void *user_data, struct cps_cont *next)
+cps_rr__resume_head(struct cps_rr *self)
 {
-    struct cps_rr  *self = user_data;
     struct cps_cont  *head_cont;
 
-    /* Add `next` to the work queue. */
-    DEBUG("[%p] Adding continuation %p to end of queue\n", self, next);
-    self->queue[self->tail] = next;
-    self->tail = (self->tail + 1) & self->size_mask;
+    /* A chain of continuations that keep yielding to each other never returns
+     * to cps_rr_drain, so we have to check the inbox, expired timers, and
+     * ready file descriptors here, too.  (Any of them might add to the work
+     * queue.) */
+    cps_rr__maybe_check_events(self);
 
-    /* There must be something in the work queue to pass control to, since we
-     * just added an element. */
-    head_cont = self->queue[self->head];
-    self->head = (self->head + 1) & self->size_mask;
+    /* The queue can only be empty if the continuation that just ran finished,
+     * and there's nothing else to do.  Returning hands control back to
+     * cps_rr_drain. */
+    if (CORK_UNLIKELY(cps_ring__is_empty(&self->queue))) {
+        return;
+    }
+
+    head_cont = cps_ring__pop(&self->queue);
+    cps_rr__stat_resumed(self, head_cont);
     DEBUG("[%p] Yielding to continuation %p\n", self, head_cont);
-    cps_resume(head_cont, self->yield);
+    if (self->trampolined) {
+        cps_jump(head_cont, &self->yield);
+    } else {
+        cps_resume(head_cont, &self->yield);
+    }
+}
+
+static void
+cps_rr__push_next(struct cps_rr *self, struct cps_cont *next)
+{
+    DEBUG("[%p] Adding continuation %p to end of queue\n", self, next);
+    if (cps_ring__push(&self->queue, next)) {
+        cps_rr__stat_inc(self, queue_resizes);
+    }
+    cps_rr__stat_queue_length(self);
+}
+
+static void
+cps_rr__yield(void *user_data, struct cps_cont *next)
+{
+    struct cps_rr  *self = user_data;
+
+    /* A continuation that finishes (or a fiber that parks) passes control to
+     * us with cps_call, whose `next` is a placeholder that just returns.
+     * There's nothing to come back to, so we don't add it to the work queue;
+     * if we did, it would end the current lap early.  Otherwise, `next` goes
+     * to the end of the queue.  This can grow the queue, since the
+     * continuation that just ran might have filled it up. */
+    if (CORK_LIKELY(!cps__is_done(next))) {
+        cps_rr__push_next(self, next);
+    }
+    cps_rr__resume_head(self);
+}
+
+/* cps_rr_run_one_lap runs this with cps_run's placeholder as `next`.  Unlike
+ * cps_rr__yield, we do add the placeholder to the end of the work queue; the
+ * lap ends when it reaches the front, since resuming it just returns. */
+static void
+cps_rr__start_lap(void *user_data, struct cps_cont *next)
+{
+    struct cps_rr  *self = user_data;
+    cps_rr__push_next(self, next);
+    cps_rr__resume_head(self);
+}
+
+/* If `next` is a round-robin scheduler's yield continuation, return the
+ * scheduler; otherwise return NULL.  A fiber uses this to find the scheduler
+ * that will resume it after it sleeps. */
+struct cps_rr *
+cps_rr__from_cont(struct cps_cont *next)
+{
+    if (next == NULL || next->resume != cps_rr__yield) {
+        return NULL;
+    }
+    return next->user_data;
+}
+
+/* These two functions let a fiber that's about to yield to `next` switch
+ * directly to the next fiber in a round-robin scheduler's work queue, instead
+ * of jumping back to the scheduler first.  If `next` is a scheduler's yield
+ * continuation, cps_rr__peek returns the head of its work queue (or NULL if
+ * the queue is empty).  cps_rr__rotate then does the same queue manipulation
+ * that cps_rr__yield would, except that it doesn't resume the old head. */
+
+struct cps_cont *
+cps_rr__peek(struct cps_cont *next)
+{
+    struct cps_rr  *self;
+    if (next == NULL || next->resume != cps_rr__yield) {
+        return NULL;
+    }
+    self = next->user_data;
+    return cps_ring__is_empty(&self->queue)?
+        NULL: cps_ring__peek(&self->queue);
+}
+
+void
+cps_rr__rotate(struct cps_cont *next, struct cps_cont *yielder)
+{
+    struct cps_rr  *self = next->user_data;
+    DEBUG("[%p] Transferring directly to continuation %p\n",
+          self, cps_ring__peek(&self->queue));
+    cps_ring__pop(&self->queue);
+    cps_ring__push(&self->queue, yielder);
+    cps_rr__stat_inc(self, resumed);
+    cps_rr__maybe_check_events(self);
 }
 
 int
 cps_rr_run_one_lap(struct cps_rr *self)
 {
-    return cps_run(self->yield);
+    int  rc;
+#if CPS_RR_STATS
+    uint64_t  start_resumed = self->stats.resumed;
+#endif
+    cps_rr__trace(LAP_START, self);
+    cps_rr__check_events(self);
+    if (self->trampolined) {
+        rc = cps_run_trampolined(&self->lap);
+    } else {
+        rc = cps_run(&self->lap);
+    }
+    cps_rr__trace(LAP_END, self);
+#if CPS_RR_STATS
+    self->stats.laps++;
+    self->stats.last_lap_resumed = self->stats.resumed - start_resumed;
+    if (self->stats.last_lap_resumed > self->stats.max_lap_resumed) {
+        self->stats.max_lap_resumed = self->stats.last_lap_resumed;
+    }
+#endif
+    /* Submit all of the I/O that the lap's continuations queued up in a
+     * single system call. */
+    if (rc == 0 && self->reactor != NULL) {
+        rc = cps_reactor__submit(self->reactor);
+    }
+    return rc;
+}
+
+#if CPS_RR_STATS
+static void
+cps_rr__finish_drain(struct cps_rr *self, uint64_t start)
+{
+    uint64_t  elapsed = cps_now() - start;
+    self->stats.drains++;
+    self->stats.last_drain_ns = elapsed;
+    self->stats.total_drain_ns += elapsed;
+    if (elapsed > self->stats.max_drain_ns) {
+        self->stats.max_drain_ns = elapsed;
+    }
 }
+#else
+#define cps_rr__finish_drain(self, start)  /* no stats */
+#endif
 
-int
-cps_rr_drain(struct cps_rr *self)
+static int
+cps_rr__drain(struct cps_rr *self)
 {
-    while (!queue_is_empty(self)) {
-        struct cps_cont  *head_cont = self->queue[self->head];
-        self->head = (self->head + 1) & self->size_mask;
-        DEBUG("[%p] Yielding to continuation %p\n", self, head_cont);
-        cps_resume(head_cont, self->yield);
-        if (CORK_UNLIKELY(cork_error_occurred())) {
+    cps_rr__check_events(self);
+    while (true) {
+        while (!cps_ring__is_empty(&self->queue)) {
+            struct cps_cont  *head_cont = cps_ring__pop(&self->queue);
+            cps_rr__stat_resumed(self, head_cont);
+            DEBUG("[%p] Yielding to continuation %p\n", self, head_cont);
+            if (self->trampolined) {
+                cps_trampoline(head_cont, &self->yield);
+            } else {
+                cps_resume(head_cont, &self->yield);
+            }
+            if (CORK_UNLIKELY(cork_error_occurred())) {
+                return -1;
+            }
+            cps_rr__check_inbox(self);
+            cps_rr__maybe_check_events(self);
+        }
+
+        /* The work queue is empty, but if there are any pending timers, or
+         * any continuations waiting for I/O, wait for them instead of
+         * returning. */
+        if (!cps_rr__has_timers(self) && !cps_rr__has_io_waiters(self)) {
+            break;
+        }
+        if (CORK_UNLIKELY(cps_rr__wait_for_events(self) != 0)) {
             return -1;
         }
+        cps_rr__check_inbox(self);
     }
     DEBUG("[%p] All continuations finished\n", self);
     return 0;
 }
+
+int
+cps_rr_drain(struct cps_rr *self)
+{
+#if CPS_RR_STATS
+    uint64_t  start = cps_now();
+#endif
+    int  rc;
+    cps_rr__trace(DRAIN_START, self);
+    rc = cps_rr__drain(self);
+    cps_rr__trace(DRAIN_END, self);
+    cps_rr__finish_drain(self, start);
+    return rc;
+}
+
+void
+cps_rr_get_stats(const struct cps_rr *self, struct cps_rr_stats *dest)
+{
+#if CPS_RR_STATS
+    *dest = self->stats;
+    dest->queue_length = cps_ring__used_size(&self->queue);
+    dest->queue_size = cps_ring__size(&self->queue);
+#else
+    memset(dest, 0, sizeof(struct cps_rr_stats));
+#endif
+}
+
+void
+cps_rr_reset_stats(struct cps_rr *self)
+{
+#if CPS_RR_STATS
+    memset(&self->stats, 0, sizeof(struct cps_rr_stats));
+    self->stats.enabled = true;
+    self->stats.peak_queue_length = cps_ring__used_size(&self->queue);
+#endif
+}
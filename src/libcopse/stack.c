@@ -0,0 +1,379 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+
+#include "copse/detect.h"
+#include "copse/stack.h"
+
+
+/*-----------------------------------------------------------------------
+ * Stacks
+ */
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS  MAP_ANON
+#endif
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE  0
+#endif
+
+#if !defined(MAP_STACK)
+#define MAP_STACK  0
+#endif
+
+#define CPS_STACK_PAINT_BYTE  0xa5
+#define CPS_STACK_PAINT_WORD  ((~(uintptr_t) 0 / 0xff) * CPS_STACK_PAINT_BYTE)
+
+static size_t
+cps_stack__page_size(void)
+{
+    static size_t  page_size = 0;
+    if (CORK_UNLIKELY(page_size == 0)) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    return page_size;
+}
+
+static size_t
+cps_stack__round_size(size_t size)
+{
+    size_t  page_size = cps_stack__page_size();
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+static void *
+cps_stack__mmap(size_t size)
+{
+    size_t  page_size = cps_stack__page_size();
+    size_t  mapped_size = cps_stack__round_size(size) + page_size;
+    char  *mapping;
+    char  *guard;
+    char  *stack;
+
+    /* We only reserve address space here; the kernel won't commit any of the
+     * stack's pages until they're touched. */
+    mapping = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                   -1, 0);
+    if (CORK_UNLIKELY(mapping == MAP_FAILED)) {
+        /* Just like cork_malloc, we abort if we can't allocate memory. */
+        abort();
+    }
+
+#if CPS_STACK_GROWS_DOWN
+    /* The stack will overflow off of its lowest address, so that's where the
+     * guard page goes. */
+    guard = mapping;
+    stack = mapping + page_size;
+#else
+    stack = mapping;
+    guard = mapping + mapped_size - page_size;
+#endif
+
+    if (CORK_UNLIKELY(mprotect(guard, page_size, PROT_NONE) == -1)) {
+        abort();
+    }
+    return stack;
+}
+
+static void
+cps_stack__munmap(void *stack, size_t size)
+{
+    size_t  page_size = cps_stack__page_size();
+    size_t  mapped_size = cps_stack__round_size(size) + page_size;
+#if CPS_STACK_GROWS_DOWN
+    munmap((char *) stack - page_size, mapped_size);
+#else
+    munmap(stack, mapped_size);
+#endif
+}
+
+void *
+cps_stack_allocate(size_t size, unsigned int flags)
+{
+    void  *stack;
+    if (flags & CPS_STACK_MMAP) {
+        stack = cps_stack__mmap(size);
+    } else {
+        stack = cork_malloc(size);
+    }
+    if (flags & CPS_STACK_PAINT) {
+        memset(stack, CPS_STACK_PAINT_BYTE, size);
+    }
+    return stack;
+}
+
+void
+cps_stack_deallocate(void *stack, size_t size, unsigned int flags)
+{
+    if (flags & CPS_STACK_MMAP) {
+        cps_stack__munmap(stack, size);
+    } else {
+        cork_free(stack, size);
+    }
+}
+
+#define is_word_aligned(ptr)  (((uintptr_t) (ptr) % sizeof(uintptr_t)) == 0)
+
+size_t
+cps_stack_high_water(const void *stack, size_t size)
+{
+    /* Find the untouched end of the stack, and count how many bytes still
+     * contain the paint pattern.  We check a word at a time where we can. */
+#if CPS_STACK_GROWS_DOWN
+    const unsigned char  *start = stack;
+    const unsigned char  *end = start + size;
+    const unsigned char  *curr = start;
+    while (curr < end && !is_word_aligned(curr)
+           && *curr == CPS_STACK_PAINT_BYTE) {
+        curr++;
+    }
+    if (is_word_aligned(curr)) {
+        while (curr + sizeof(uintptr_t) <= end
+               && *(const uintptr_t *) curr == CPS_STACK_PAINT_WORD) {
+            curr += sizeof(uintptr_t);
+        }
+    }
+    while (curr < end && *curr == CPS_STACK_PAINT_BYTE) {
+        curr++;
+    }
+    return end - curr;
+#else
+    const unsigned char  *start = stack;
+    const unsigned char  *curr = start + size;
+    while (curr > start && !is_word_aligned(curr)
+           && *(curr - 1) == CPS_STACK_PAINT_BYTE) {
+        curr--;
+    }
+    if (is_word_aligned(curr)) {
+        while (curr >= start + sizeof(uintptr_t)
+               && *(const uintptr_t *) (curr - sizeof(uintptr_t))
+                  == CPS_STACK_PAINT_WORD) {
+            curr -= sizeof(uintptr_t);
+        }
+    }
+    while (curr > start && *(curr - 1) == CPS_STACK_PAINT_BYTE) {
+        curr--;
+    }
+    return curr - start;
+#endif
+}
+
+/* Repaint the used portion of a painted stack.  Also used by
+ * cps_fiber_reset. */
+void
+cps_stack__repaint(void *stack, size_t size, size_t used)
+{
+#if CPS_STACK_GROWS_DOWN
+    memset((char *) stack + size - used, CPS_STACK_PAINT_BYTE, used);
+#else
+    memset(stack, CPS_STACK_PAINT_BYTE, used);
+#endif
+}
+
+
+/*-----------------------------------------------------------------------
+ * Stack pools
+ */
+
+struct cps_stack_pool {
+    size_t  stack_size;
+    unsigned int  flags;
+    size_t  low_watermark;
+    size_t  high_watermark;
+
+    /* A singly-linked list of the stacks that are ready to be reused.  We
+     * don't need any separate list nodes; the pointer to the next idle stack
+     * is stored in the first word that a fiber would push onto each idle
+     * stack.  (That page is always touched once the stack is used, so this
+     * doesn't commit any extra memory for mmap-backed stacks.) */
+    void  *idle;
+    size_t  idle_count;
+    size_t  used_count;
+
+    struct cps_stack_histogram  histogram;
+};
+
+#if CPS_STACK_GROWS_DOWN
+#define next_idle(pool, stack) \
+    (*(void **) ((char *) (stack) + (pool)->stack_size - sizeof(void *)))
+#else
+#define next_idle(pool, stack)  (*(void **) (stack))
+#endif
+
+static void *
+cps_stack_pool__allocate(struct cps_stack_pool *pool)
+{
+    return cps_stack_allocate(pool->stack_size, pool->flags);
+}
+
+static void
+cps_stack_pool__deallocate(struct cps_stack_pool *pool, void *stack)
+{
+    cps_stack_deallocate(stack, pool->stack_size, pool->flags);
+}
+
+static void
+cps_stack_pool__push_idle(struct cps_stack_pool *pool, void *stack)
+{
+    next_idle(pool, stack) = pool->idle;
+    pool->idle = stack;
+    pool->idle_count++;
+}
+
+static void *
+cps_stack_pool__pop_idle(struct cps_stack_pool *pool)
+{
+    void  *stack = pool->idle;
+    pool->idle = next_idle(pool, stack);
+    pool->idle_count--;
+    return stack;
+}
+
+struct cps_stack_pool *
+cps_stack_pool_new(size_t stack_size, unsigned int flags,
+                   size_t low_watermark, size_t high_watermark)
+{
+    struct cps_stack_pool  *pool;
+    assert(low_watermark <= high_watermark);
+
+    pool = cork_new(struct cps_stack_pool);
+    if (stack_size == 0) {
+        stack_size = CPS_DEFAULT_STACK_SIZE;
+    }
+    pool->stack_size = cps_stack__round_size(stack_size);
+    pool->flags = flags;
+    pool->low_watermark = low_watermark;
+    pool->high_watermark = high_watermark;
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pool->used_count = 0;
+    memset(&pool->histogram, 0, sizeof(struct cps_stack_histogram));
+
+    while (pool->idle_count < low_watermark) {
+        cps_stack_pool__push_idle(pool, cps_stack_pool__allocate(pool));
+    }
+    return pool;
+}
+
+void
+cps_stack_pool_free(struct cps_stack_pool *pool)
+{
+    assert(pool->used_count == 0);
+    while (pool->idle != NULL) {
+        cps_stack_pool__deallocate(pool, cps_stack_pool__pop_idle(pool));
+    }
+    cork_delete(struct cps_stack_pool, pool);
+}
+
+size_t
+cps_stack_pool_stack_size(const struct cps_stack_pool *pool)
+{
+    return pool->stack_size;
+}
+
+unsigned int
+cps_stack_pool_flags(const struct cps_stack_pool *pool)
+{
+    return pool->flags;
+}
+
+size_t
+cps_stack_pool_idle_count(const struct cps_stack_pool *pool)
+{
+    return pool->idle_count;
+}
+
+size_t
+cps_stack_pool_used_count(const struct cps_stack_pool *pool)
+{
+    return pool->used_count;
+}
+
+void
+cps_stack_pool_trim(struct cps_stack_pool *pool)
+{
+    while (pool->idle_count > pool->low_watermark) {
+        cps_stack_pool__deallocate(pool, cps_stack_pool__pop_idle(pool));
+    }
+}
+
+void *
+cps_stack_pool_acquire(struct cps_stack_pool *pool)
+{
+    pool->used_count++;
+    if (CORK_LIKELY(pool->idle != NULL)) {
+        void  *stack = cps_stack_pool__pop_idle(pool);
+        if (pool->flags & CPS_STACK_PAINT) {
+            /* Cover up the idle list pointer that we stored in the stack. */
+            memset(&next_idle(pool, stack), CPS_STACK_PAINT_BYTE,
+                   sizeof(void *));
+        }
+        return stack;
+    } else {
+        return cps_stack_pool__allocate(pool);
+    }
+}
+
+void
+cps_stack_pool__record_high_water(struct cps_stack_pool *pool, size_t used)
+{
+    unsigned int  bucket = 0;
+    while (bucket < CPS_STACK_HISTOGRAM_SIZE - 1 && (used >> (bucket + 1))) {
+        bucket++;
+    }
+    pool->histogram.counts[bucket]++;
+    if (used > pool->histogram.max) {
+        pool->histogram.max = used;
+    }
+}
+
+/* Release a stack, measuring and repainting only the given region of it.
+ * Fibers that are embedded in their stacks use this to leave out the fiber
+ * block, so that the pool's histogram matches cps_fiber_stack_high_water. */
+void
+cps_stack_pool__release_region(struct cps_stack_pool *pool, void *stack,
+                               void *region, size_t region_size)
+{
+    assert(pool->used_count > 0);
+    pool->used_count--;
+    if (pool->flags & CPS_STACK_PAINT) {
+        size_t  used = cps_stack_high_water(region, region_size);
+        cps_stack_pool__record_high_water(pool, used);
+        if (pool->idle_count < pool->high_watermark) {
+            cps_stack__repaint(region, region_size, used);
+        }
+    }
+    if (CORK_LIKELY(pool->idle_count < pool->high_watermark)) {
+        cps_stack_pool__push_idle(pool, stack);
+    } else {
+        cps_stack_pool__deallocate(pool, stack);
+    }
+}
+
+void
+cps_stack_pool_release(struct cps_stack_pool *pool, void *stack)
+{
+    cps_stack_pool__release_region(pool, stack, stack, pool->stack_size);
+}
+
+void
+cps_stack_pool_get_histogram(const struct cps_stack_pool *pool,
+                             struct cps_stack_histogram *dest)
+{
+    *dest = pool->histogram;
+}
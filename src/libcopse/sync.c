@@ -0,0 +1,264 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/round-robin.h"
+#include "copse/sync.h"
+
+/* Defined in fiber.c */
+struct cps_rr *
+cps_fiber__get_rr(struct cps_fiber *fiber);
+
+
+#if !defined(CPS_DEBUG_SYNC)
+#define CPS_DEBUG_SYNC  0
+#endif
+
+#if CPS_DEBUG_SYNC
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Wait lists
+ */
+
+/* A fiber that's waiting for one of our primitives.  These live on the
+ * waiting fiber's stack. */
+struct cps_waiter {
+    struct cork_dllist_item  item;
+    struct cps_fiber  *fiber;
+    struct cps_rr  *rr;
+    /* For condition variables, the mutex that we have to reacquire. */
+    struct cps_mutex  *mutex;
+};
+
+static void
+cps_waiter__init(struct cps_waiter *waiter, struct cps_fiber *fiber)
+{
+    waiter->fiber = fiber;
+    waiter->rr = cps_fiber__get_rr(fiber);
+    waiter->mutex = NULL;
+    assert(waiter->rr != NULL);
+}
+
+/* Add the fiber to the end of a wait list, and park it until someone calls
+ * cps_waiter__wake. */
+static void
+cps_waiter__wait(struct cps_waiter *waiter, struct cork_dllist *waiters)
+{
+    cork_dllist_add_to_tail(waiters, &waiter->item);
+    cps_fiber_park(waiter->fiber);
+}
+
+static struct cps_waiter *
+cps_waiter__pop(struct cork_dllist *waiters)
+{
+    struct cork_dllist_item  *item;
+    if (cork_dllist_is_empty(waiters)) {
+        return NULL;
+    }
+    item = cork_dllist_start(waiters);
+    cork_dllist_remove(item);
+    return cork_container_of(item, struct cps_waiter, item);
+}
+
+static void
+cps_waiter__wake(struct cps_waiter *waiter)
+{
+    DEBUG("[%p] Waking fiber %p\n", waiter->rr, waiter->fiber);
+    cps_rr_add(waiter->rr, cps_fiber_cont(waiter->fiber));
+}
+
+
+/*-----------------------------------------------------------------------
+ * Mutexes
+ */
+
+void
+cps_mutex_init(struct cps_mutex *mutex)
+{
+    mutex->locked = false;
+    cork_dllist_init(&mutex->waiters);
+}
+
+void
+cps_mutex_done(struct cps_mutex *mutex)
+{
+    assert(!mutex->locked);
+    assert(cork_dllist_is_empty(&mutex->waiters));
+}
+
+void
+cps_mutex_lock(struct cps_mutex *mutex, struct cps_fiber *fiber)
+{
+    struct cps_waiter  waiter;
+    if (CORK_LIKELY(!mutex->locked)) {
+        mutex->locked = true;
+        return;
+    }
+    DEBUG("[%p] Fiber %p waiting for mutex\n", mutex, fiber);
+    cps_waiter__init(&waiter, fiber);
+    cps_waiter__wait(&waiter, &mutex->waiters);
+    /* Whoever woke us up handed the mutex over to us. */
+    assert(mutex->locked);
+}
+
+bool
+cps_mutex_try_lock(struct cps_mutex *mutex)
+{
+    if (mutex->locked) {
+        return false;
+    }
+    mutex->locked = true;
+    return true;
+}
+
+void
+cps_mutex_unlock(struct cps_mutex *mutex)
+{
+    struct cps_waiter  *waiter;
+    assert(mutex->locked);
+    waiter = cps_waiter__pop(&mutex->waiters);
+    if (waiter == NULL) {
+        mutex->locked = false;
+    } else {
+        /* Leave the mutex locked on the waiter's behalf. */
+        DEBUG("[%p] Handing mutex to fiber %p\n", mutex, waiter->fiber);
+        cps_waiter__wake(waiter);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Condition variables
+ */
+
+void
+cps_cond_init(struct cps_cond *cond)
+{
+    cork_dllist_init(&cond->waiters);
+}
+
+void
+cps_cond_done(struct cps_cond *cond)
+{
+    assert(cork_dllist_is_empty(&cond->waiters));
+}
+
+void
+cps_cond_wait(struct cps_cond *cond, struct cps_mutex *mutex,
+              struct cps_fiber *fiber)
+{
+    struct cps_waiter  waiter;
+    DEBUG("[%p] Fiber %p waiting for condition\n", cond, fiber);
+    cps_waiter__init(&waiter, fiber);
+    waiter.mutex = mutex;
+    cps_mutex_unlock(mutex);
+    cps_waiter__wait(&waiter, &cond->waiters);
+    /* cps_cond__wake made sure that we own the mutex again. */
+    assert(mutex->locked);
+}
+
+static void
+cps_cond__wake(struct cps_waiter *waiter)
+{
+    struct cps_mutex  *mutex = waiter->mutex;
+    if (mutex->locked) {
+        /* The waiter can't run until the mutex is unlocked, so move it
+         * straight to the mutex's wait list. */
+        DEBUG("[%p] Moving fiber %p to mutex %p\n",
+              waiter->rr, waiter->fiber, mutex);
+        cork_dllist_add_to_tail(&mutex->waiters, &waiter->item);
+    } else {
+        mutex->locked = true;
+        cps_waiter__wake(waiter);
+    }
+}
+
+void
+cps_cond_signal(struct cps_cond *cond)
+{
+    struct cps_waiter  *waiter = cps_waiter__pop(&cond->waiters);
+    if (waiter != NULL) {
+        cps_cond__wake(waiter);
+    }
+}
+
+void
+cps_cond_broadcast(struct cps_cond *cond)
+{
+    struct cps_waiter  *waiter;
+    while ((waiter = cps_waiter__pop(&cond->waiters)) != NULL) {
+        cps_cond__wake(waiter);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Semaphores
+ */
+
+void
+cps_sem_init(struct cps_sem *sem, size_t value)
+{
+    sem->value = value;
+    cork_dllist_init(&sem->waiters);
+}
+
+void
+cps_sem_done(struct cps_sem *sem)
+{
+    assert(cork_dllist_is_empty(&sem->waiters));
+}
+
+void
+cps_sem_wait(struct cps_sem *sem, struct cps_fiber *fiber)
+{
+    struct cps_waiter  waiter;
+    if (CORK_LIKELY(sem->value > 0)) {
+        sem->value--;
+        return;
+    }
+    DEBUG("[%p] Fiber %p waiting for semaphore\n", sem, fiber);
+    cps_waiter__init(&waiter, fiber);
+    cps_waiter__wait(&waiter, &sem->waiters);
+}
+
+bool
+cps_sem_try_wait(struct cps_sem *sem)
+{
+    if (sem->value == 0) {
+        return false;
+    }
+    sem->value--;
+    return true;
+}
+
+void
+cps_sem_post(struct cps_sem *sem)
+{
+    struct cps_waiter  *waiter = cps_waiter__pop(&sem->waiters);
+    if (waiter == NULL) {
+        sem->value++;
+    } else {
+        /* The waiter takes the increment that we would have made. */
+        cps_waiter__wake(waiter);
+    }
+}
@@ -0,0 +1,288 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "copse/timer.h"
+
+
+/*-----------------------------------------------------------------------
+ * Time
+ */
+
+uint64_t
+cps_now(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * CPS_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Timers
+ */
+
+void
+cps_timer_init(struct cps_timer *timer, uint64_t deadline,
+               cps_timer_f fire, void *user_data)
+{
+    timer->deadline = deadline;
+    timer->fire = fire;
+    timer->user_data = user_data;
+    timer->active = false;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Timer wheels
+ */
+
+/* The resolution of the wheel, in nanoseconds. */
+#if !defined(CPS_TIMER_TICK)
+#define CPS_TIMER_TICK  CPS_NSEC_PER_MSEC
+#endif
+
+/* Each level of the wheel has 64 slots.  A slot at level 0 covers a single
+ * tick; a slot at level n covers 64^n ticks.  Timers that are more than 64^4
+ * ticks away (about 4.6 hours, with the default tick) go into an overflow
+ * list, which we recheck each time that the top level wraps around. */
+#define LEVEL_BITS  6
+#define LEVEL_SIZE  (1 << LEVEL_BITS)
+#define LEVEL_MASK  (LEVEL_SIZE - 1)
+#define LEVEL_COUNT  4
+
+#define level_shift(level)  ((level) * LEVEL_BITS)
+#define level_span(level)   ((uint64_t) 1 << level_shift((level) + 1))
+#define level_index(level, tick) \
+    (((tick) >> level_shift(level)) & LEVEL_MASK)
+
+struct cps_timer_wheel {
+    /* Every tick up to and including this one has been processed. */
+    uint64_t  current_tick;
+    size_t  count;
+    struct cork_dllist  slots[LEVEL_COUNT][LEVEL_SIZE];
+    /* Timers whose deadlines had already passed when they were added. */
+    struct cork_dllist  due;
+    struct cork_dllist  overflow;
+};
+
+/* Round deadlines up so that timers never fire early. */
+#define deadline_tick(deadline) \
+    (((deadline) + CPS_TIMER_TICK - 1) / CPS_TIMER_TICK)
+
+struct cps_timer_wheel *
+cps_timer_wheel_new(void)
+{
+    struct cps_timer_wheel  *wheel = cork_new(struct cps_timer_wheel);
+    size_t  level;
+    size_t  i;
+    wheel->current_tick = cps_now() / CPS_TIMER_TICK;
+    wheel->count = 0;
+    for (level = 0; level < LEVEL_COUNT; level++) {
+        for (i = 0; i < LEVEL_SIZE; i++) {
+            cork_dllist_init(&wheel->slots[level][i]);
+        }
+    }
+    cork_dllist_init(&wheel->due);
+    cork_dllist_init(&wheel->overflow);
+    return wheel;
+}
+
+void
+cps_timer_wheel_free(struct cps_timer_wheel *wheel)
+{
+    cork_delete(struct cps_timer_wheel, wheel);
+}
+
+size_t
+cps_timer_wheel_count(const struct cps_timer_wheel *wheel)
+{
+    return wheel->count;
+}
+
+static void
+cps_timer_wheel__insert(struct cps_timer_wheel *wheel,
+                        struct cps_timer *timer)
+{
+    uint64_t  tick = deadline_tick(timer->deadline);
+    uint64_t  delta;
+    size_t  level;
+
+    if (tick <= wheel->current_tick) {
+        cork_dllist_add_to_tail(&wheel->due, &timer->item);
+        return;
+    }
+
+    delta = tick - wheel->current_tick;
+    for (level = 0; level < LEVEL_COUNT; level++) {
+        if (delta < level_span(level)) {
+            struct cork_dllist  *slot =
+                &wheel->slots[level][level_index(level, tick)];
+            cork_dllist_add_to_tail(slot, &timer->item);
+            return;
+        }
+    }
+    cork_dllist_add_to_tail(&wheel->overflow, &timer->item);
+}
+
+void
+cps_timer_wheel_add(struct cps_timer_wheel *wheel, struct cps_timer *timer)
+{
+    assert(!timer->active);
+    timer->active = true;
+    wheel->count++;
+    cps_timer_wheel__insert(wheel, timer);
+}
+
+void
+cps_timer_wheel_cancel(struct cps_timer_wheel *wheel, struct cps_timer *timer)
+{
+    if (timer->active) {
+        cork_dllist_remove(&timer->item);
+        timer->active = false;
+        wheel->count--;
+    }
+}
+
+/* Move every timer in src to the end of dest. */
+static void
+cps_timer_wheel__move(struct cork_dllist *dest, struct cork_dllist *src)
+{
+    struct cork_dllist_item  *curr;
+    struct cork_dllist_item  *next;
+    cork_dllist_foreach_void(src, curr, next) {
+        cork_dllist_add_to_tail(dest, curr);
+    }
+    cork_dllist_init(src);
+}
+
+/* Reinsert every timer in a list; each one will land in a lower level than
+ * before (or in the expired list), now that the wheel has moved forward. */
+static void
+cps_timer_wheel__cascade(struct cps_timer_wheel *wheel,
+                         struct cork_dllist *list)
+{
+    struct cork_dllist  pending;
+    struct cork_dllist_item  *curr;
+    struct cork_dllist_item  *next;
+    cork_dllist_init(&pending);
+    cps_timer_wheel__move(&pending, list);
+    cork_dllist_foreach_void(&pending, curr, next) {
+        struct cps_timer  *timer =
+            cork_container_of(curr, struct cps_timer, item);
+        cps_timer_wheel__insert(wheel, timer);
+    }
+}
+
+/* Process the next tick, moving any timers that expire into expired. */
+static void
+cps_timer_wheel__tick(struct cps_timer_wheel *wheel,
+                      struct cork_dllist *expired)
+{
+    uint64_t  tick = ++wheel->current_tick;
+    size_t  level;
+
+    /* Whenever a level wraps around, pull the next slot down from the level
+     * above it. */
+    for (level = 1; level < LEVEL_COUNT; level++) {
+        if (level_index(level - 1, tick) != 0) {
+            break;
+        }
+        cps_timer_wheel__cascade
+            (wheel, &wheel->slots[level][level_index(level, tick)]);
+    }
+    if (level == LEVEL_COUNT && level_index(LEVEL_COUNT - 1, tick) == 0) {
+        cps_timer_wheel__cascade(wheel, &wheel->overflow);
+    }
+
+    /* Cascading might have added timers to the due list. */
+    cps_timer_wheel__move(expired, &wheel->due);
+    cps_timer_wheel__move(expired, &wheel->slots[0][level_index(0, tick)]);
+}
+
+uint64_t
+cps_timer_wheel_next_deadline(const struct cps_timer_wheel *wheel)
+{
+    uint64_t  result = UINT64_MAX;
+    size_t  level;
+
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+    if (!cork_dllist_is_empty(&wheel->due)) {
+        return wheel->current_tick * CPS_TIMER_TICK;
+    }
+
+    /* For each level, find the first nonempty slot after the current one.  At
+     * level 0, that's exactly when the timers in the slot expire; at the higher
+     * levels, it's when we'll cascade the slot, which is no later than any of
+     * its timers' deadlines. */
+    for (level = 0; level < LEVEL_COUNT; level++) {
+        uint64_t  base = wheel->current_tick >> level_shift(level);
+        uint64_t  i;
+        for (i = 1; i <= LEVEL_SIZE; i++) {
+            const struct cork_dllist  *slot =
+                &wheel->slots[level][(base + i) & LEVEL_MASK];
+            if (!cork_dllist_is_empty(slot)) {
+                uint64_t  tick = (base + i) << level_shift(level);
+                if (tick * CPS_TIMER_TICK < result) {
+                    result = tick * CPS_TIMER_TICK;
+                }
+                break;
+            }
+        }
+    }
+
+    if (!cork_dllist_is_empty(&wheel->overflow)) {
+        uint64_t  top_shift = level_shift(LEVEL_COUNT);
+        uint64_t  tick =
+            ((wheel->current_tick >> top_shift) + 1) << top_shift;
+        if (tick * CPS_TIMER_TICK < result) {
+            result = tick * CPS_TIMER_TICK;
+        }
+    }
+    return result;
+}
+
+void
+cps_timer_wheel_advance(struct cps_timer_wheel *wheel, uint64_t now)
+{
+    uint64_t  target_tick = now / CPS_TIMER_TICK;
+    struct cork_dllist  expired;
+    cork_dllist_init(&expired);
+
+    cps_timer_wheel__move(&expired, &wheel->due);
+    while (wheel->current_tick < target_tick) {
+        if (wheel->count == 0) {
+            /* Nothing to cascade or expire, so skip straight to the end. */
+            wheel->current_tick = target_tick;
+            break;
+        }
+        cps_timer_wheel__tick(wheel, &expired);
+    }
+
+    /* Fire the expired timers only once we're done with the wheel itself,
+     * since the fire functions might add or cancel timers. */
+    while (!cork_dllist_is_empty(&expired)) {
+        struct cork_dllist_item  *curr = cork_dllist_start(&expired);
+        struct cps_timer  *timer =
+            cork_container_of(curr, struct cps_timer, item);
+        cork_dllist_remove(curr);
+        timer->active = false;
+        wheel->count--;
+        timer->fire(timer);
+    }
+}
@@ -0,0 +1,208 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "copse/timer.h"
+#include "copse/trace.h"
+
+
+/* Whether fibers and schedulers record trace events. */
+#if !defined(CPS_TRACE)
+#define CPS_TRACE  0
+#endif
+
+/* The number of events that each thread's ring buffer can hold.  Must be a
+ * power of 2. */
+#if !defined(CPS_TRACE_BUFFER_SIZE)
+#define CPS_TRACE_BUFFER_SIZE  65536
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Trace buffers
+ */
+
+struct cps_trace_record {
+    uint64_t  timestamp;
+    const void  *object;
+    enum cps_trace_event  event;
+};
+
+/* Only the owning thread writes to a buffer, so recording an event doesn't
+ * need any locking.  `count` is the total number of events ever recorded; the
+ * most recent CPS_TRACE_BUFFER_SIZE of them are still in the ring.  Buffers
+ * are never freed, so that we can still write out the events from threads
+ * that have exited. */
+struct cps_trace_buffer {
+    struct cps_trace_buffer  *next;
+    unsigned int  thread_index;
+    volatile size_t  count;
+    struct cps_trace_record  records[CPS_TRACE_BUFFER_SIZE];
+};
+
+/* A lock-free stack of every thread's buffer. */
+static struct cps_trace_buffer * volatile  cps_trace_buffers = NULL;
+static volatile unsigned int  cps_trace_thread_count = 0;
+
+struct cps_trace_state {
+    struct cps_trace_buffer  *buffer;
+};
+
+cork_tls(struct cps_trace_state, cps_trace_state);
+
+static struct cps_trace_buffer *
+cps_trace__new_buffer(void)
+{
+    struct cps_trace_buffer  *buffer = cork_new(struct cps_trace_buffer);
+    struct cps_trace_buffer  *head;
+    buffer->thread_index =
+        cork_uint_atomic_add(&cps_trace_thread_count, 1);
+    buffer->count = 0;
+    do {
+        head = cps_trace_buffers;
+        buffer->next = head;
+    } while (cork_ptr_cas(&cps_trace_buffers, head, buffer) != head);
+    return buffer;
+}
+
+/* Called by the hooks in fiber.c and round-robin.c. */
+void
+cps_trace__record(enum cps_trace_event event, const void *object)
+{
+    struct cps_trace_state  *state = cps_trace_state_get();
+    struct cps_trace_buffer  *buffer = state->buffer;
+    struct cps_trace_record  *record;
+    if (CORK_UNLIKELY(buffer == NULL)) {
+        buffer = state->buffer = cps_trace__new_buffer();
+    }
+    record =
+        &buffer->records[buffer->count & (CPS_TRACE_BUFFER_SIZE - 1)];
+    record->timestamp = cps_now();
+    record->object = object;
+    record->event = event;
+    buffer->count++;
+}
+
+bool
+cps_trace_is_enabled(void)
+{
+    return CPS_TRACE;
+}
+
+void
+cps_trace_clear(void)
+{
+    struct cps_trace_buffer  *buffer;
+    for (buffer = cps_trace_buffers; buffer != NULL; buffer = buffer->next) {
+        buffer->count = 0;
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Chrome trace output
+ */
+
+/* Each of our events becomes a single Chrome trace event.  Resuming a fiber
+ * starts a duration event, and yielding, parking, or finishing ends it; the
+ * scheduler's laps and drains are duration events, too, which the fibers that
+ * they run are nested inside of. */
+
+static void
+cps_trace__write_record(FILE *out, pid_t pid, unsigned int tid,
+                        const struct cps_trace_record *record)
+{
+    const char  *category;
+    const char  *name;
+    const char  *phase;
+    const char  *args = "";
+
+    switch (record->event) {
+        case CPS_TRACE_FIBER_CREATE:
+            category = "fiber"; name = "create fiber"; phase = "i";
+            break;
+        case CPS_TRACE_FIBER_RESUME:
+            category = "fiber"; name = "fiber"; phase = "B";
+            break;
+        case CPS_TRACE_FIBER_YIELD:
+            category = "fiber"; name = "fiber"; phase = "E";
+            args = ",\"args\":{\"end\":\"yield\"}";
+            break;
+        case CPS_TRACE_FIBER_PARK:
+            category = "fiber"; name = "fiber"; phase = "E";
+            args = ",\"args\":{\"end\":\"park\"}";
+            break;
+        case CPS_TRACE_FIBER_FINISH:
+            category = "fiber"; name = "fiber"; phase = "E";
+            args = ",\"args\":{\"end\":\"finish\"}";
+            break;
+        case CPS_TRACE_RR_LAP_START:
+            category = "rr"; name = "lap"; phase = "B";
+            break;
+        case CPS_TRACE_RR_LAP_END:
+            category = "rr"; name = "lap"; phase = "E";
+            break;
+        case CPS_TRACE_RR_DRAIN_START:
+            category = "rr"; name = "drain"; phase = "B";
+            break;
+        case CPS_TRACE_RR_DRAIN_END:
+            category = "rr"; name = "drain"; phase = "E";
+            break;
+        default:
+            return;
+    }
+
+    /* Chrome wants timestamps in microseconds. */
+    fprintf(out,
+            ",\n{\"name\":\"%s %p\",\"cat\":\"%s\",\"ph\":\"%s\","
+            "\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%u%s%s}",
+            name, record->object, category, phase,
+            record->timestamp / 1000,
+            (unsigned int) (record->timestamp % 1000),
+            (int) pid, tid,
+            (phase[0] == 'i')? ",\"s\":\"t\"": "", args);
+}
+
+int
+cps_trace_write_json(FILE *out)
+{
+    struct cps_trace_buffer  *buffer;
+    pid_t  pid = getpid();
+
+    /* Start with a metadata event, so that every real event can be preceded
+     * by a comma. */
+    fprintf(out,
+            "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"copse\"}}", (int) pid);
+    for (buffer = cps_trace_buffers; buffer != NULL; buffer = buffer->next) {
+        size_t  count = buffer->count;
+        size_t  i = (count > CPS_TRACE_BUFFER_SIZE)?
+            count - CPS_TRACE_BUFFER_SIZE: 0;
+        for (; i < count; i++) {
+            cps_trace__write_record
+                (out, pid, buffer->thread_index,
+                 &buffer->records[i & (CPS_TRACE_BUFFER_SIZE - 1)]);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if (CORK_UNLIKELY(fflush(out) != 0 || ferror(out))) {
+        cork_system_error_set();
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,527 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "copse/cps.h"
+#include "copse/work-stealing.h"
+
+
+#if !defined(CPS_DEBUG_WS)
+#define CPS_DEBUG_WS  0
+#endif
+
+/* Whether new schedulers run their continuations under a trampoline. */
+#if !defined(CPS_TRAMPOLINE)
+#define CPS_TRAMPOLINE  0
+#endif
+
+#if CPS_DEBUG_WS
+#include <stdio.h>
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) /* no debug messages */
+#endif
+
+#define cps_ws__fence()  __sync_synchronize()
+
+/* Fields that different threads write to go on separate cache lines. */
+#define CPS_WS_CACHE_LINE_SIZE  64
+#define cps_ws__cache_aligned \
+    __attribute__((aligned(CPS_WS_CACHE_LINE_SIZE)))
+
+
+/*-----------------------------------------------------------------------
+ * Deques
+ */
+
+/* Each worker's deque is a Chase-Lev work-stealing deque.  The worker that
+ * owns the deque pushes and takes continuations at the bottom; any worker
+ * (including the owner) can steal continuations from the top.  Indices only
+ * ever increase; the items live in a power-of-2 ring buffer, which the owner
+ * replaces with a larger copy when it fills up.  A thief might still be
+ * reading from an old buffer, so we don't free those until the drain is
+ * finished. */
+
+#define INITIAL_DEQUE_SIZE  64
+
+struct cps_ws_array {
+    struct cps_ws_array  *retired_next;
+    size_t  size_mask;
+    struct cps_cont  *items[];
+};
+
+#define cps_ws_array_alloc_size(size) \
+    (sizeof(struct cps_ws_array) + (size) * sizeof(struct cps_cont *))
+
+/* Thieves CAS `top`, and the owner writes `bottom` on every push and take, so
+ * each index gets a cache line of its own; otherwise every push would
+ * invalidate the line that thieves are spinning on, and vice versa.  The rest
+ * of the fields are only written by the owner, and share the first line.
+ * Since the whole struct is cache-aligned, neighboring workers don't share
+ * any lines either. */
+struct cps_ws_worker {
+    struct cps_ws  *ws;
+    struct cork_thread  *thread;
+    uint32_t  rng;
+    struct cps_ws_array * volatile  array;
+    struct cps_ws_array  *retired;
+
+    volatile size_t  top  cps_ws__cache_aligned;
+    volatile size_t  bottom  cps_ws__cache_aligned;
+};
+
+static struct cps_ws_array *
+cps_ws_array_new(size_t size)
+{
+    struct cps_ws_array  *array = cork_malloc(cps_ws_array_alloc_size(size));
+    array->retired_next = NULL;
+    array->size_mask = size - 1;
+    return array;
+}
+
+static void
+cps_ws_array_free(struct cps_ws_array *array)
+{
+    cork_free(array, cps_ws_array_alloc_size(array->size_mask + 1));
+}
+
+static void
+cps_ws_worker_init(struct cps_ws_worker *worker, struct cps_ws *ws,
+                   unsigned int index)
+{
+    worker->ws = ws;
+    worker->thread = NULL;
+    worker->rng = index * 2654435761u + 1;
+    /* Start the indices at 1 so that the owner's take can compute bottom - 1
+     * without wrapping around. */
+    worker->top = 1;
+    worker->bottom = 1;
+    worker->array = cps_ws_array_new(INITIAL_DEQUE_SIZE);
+    worker->retired = NULL;
+}
+
+static void
+cps_ws_worker__free_retired(struct cps_ws_worker *worker)
+{
+    while (worker->retired != NULL) {
+        struct cps_ws_array  *array = worker->retired;
+        worker->retired = array->retired_next;
+        cps_ws_array_free(array);
+    }
+}
+
+static void
+cps_ws_worker_done(struct cps_ws_worker *worker)
+{
+    cps_ws_worker__free_retired(worker);
+    cps_ws_array_free(worker->array);
+}
+
+#define cps_ws_worker_is_empty(w)  ((w)->top >= (w)->bottom)
+
+static struct cps_ws_array *
+cps_ws_worker__grow(struct cps_ws_worker *worker, size_t top, size_t bottom)
+{
+    struct cps_ws_array  *old_array = worker->array;
+    struct cps_ws_array  *array;
+    size_t  i;
+    array = cps_ws_array_new(2 * (old_array->size_mask + 1));
+    DEBUG("[%p] Resizing deque to %zu elements\n",
+          worker, array->size_mask + 1);
+    for (i = top; i < bottom; i++) {
+        array->items[i & array->size_mask] =
+            old_array->items[i & old_array->size_mask];
+    }
+    old_array->retired_next = worker->retired;
+    worker->retired = old_array;
+    /* Make sure that the new buffer's contents are visible before any thief
+     * can see the new buffer. */
+    cps_ws__fence();
+    worker->array = array;
+    return array;
+}
+
+/* Only the worker that owns a deque can push onto it. */
+static void
+cps_ws_worker_push(struct cps_ws_worker *worker, struct cps_cont *cont)
+{
+    size_t  bottom = worker->bottom;
+    size_t  top = worker->top;
+    struct cps_ws_array  *array = worker->array;
+    if (CORK_UNLIKELY(bottom - top >= array->size_mask)) {
+        array = cps_ws_worker__grow(worker, top, bottom);
+    }
+    array->items[bottom & array->size_mask] = cont;
+    cps_ws__fence();
+    worker->bottom = bottom + 1;
+}
+
+/* Only the worker that owns a deque can take from it.  This returns the newest
+ * continuation in the deque, or NULL if it's empty. */
+static struct cps_cont *
+cps_ws_worker_take(struct cps_ws_worker *worker)
+{
+    size_t  bottom = worker->bottom - 1;
+    struct cps_ws_array  *array = worker->array;
+    struct cps_cont  *cont;
+    size_t  top;
+
+    worker->bottom = bottom;
+    cps_ws__fence();
+    top = worker->top;
+
+    if (CORK_UNLIKELY(top > bottom)) {
+        /* The deque is empty. */
+        worker->bottom = bottom + 1;
+        return NULL;
+    }
+
+    cont = array->items[bottom & array->size_mask];
+    if (top == bottom) {
+        /* This is the last continuation in the deque, so we have to race any
+         * thieves for it. */
+        if (cork_size_cas(&worker->top, top, top + 1) != top) {
+            cont = NULL;
+        }
+        worker->bottom = bottom + 1;
+    }
+    return cont;
+}
+
+/* Any worker can steal from a deque.  This returns the oldest continuation in
+ * the deque, or NULL if it's empty. */
+static struct cps_cont *
+cps_ws_worker_steal(struct cps_ws_worker *worker)
+{
+    while (true) {
+        size_t  top = worker->top;
+        size_t  bottom;
+        cps_ws__fence();
+        bottom = worker->bottom;
+        if (top >= bottom) {
+            return NULL;
+        } else {
+            struct cps_ws_array  *array = worker->array;
+            struct cps_cont  *cont = array->items[top & array->size_mask];
+            if (cork_size_cas(&worker->top, top, top + 1) == top) {
+                return cont;
+            }
+            /* Someone else got there first; try again. */
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Work-stealing scheduler
+ */
+
+struct cps_ws {
+    struct cps_cont  yield;
+    bool  trampolined;
+    unsigned int  worker_count;
+    unsigned int  next_worker;
+    /* The workers array is cache-aligned within workers_block. */
+    struct cps_ws_worker  *workers;
+    void  *workers_block;
+
+    /* A worker only goes idle once its own deque is empty, and an idle worker
+     * never adds anything to its deque.  So once every worker is idle, there's
+     * nothing left to do. */
+    volatile size_t  idle_count;
+    volatile bool  failed;
+};
+
+/* The worker that's running in the current thread, if any. */
+cork_tls(struct cps_ws_worker *, cps_ws_current);
+
+static void
+cps_ws__yield(void *user_data, struct cps_cont *next);
+
+#define cps_ws__workers_block_size(count) \
+    ((count) * sizeof(struct cps_ws_worker) + CPS_WS_CACHE_LINE_SIZE)
+
+struct cps_ws *
+cps_ws_new(unsigned int thread_count)
+{
+    struct cps_ws  *self = cork_new(struct cps_ws);
+    unsigned int  i;
+    if (thread_count == 0) {
+        long  cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpu_count > 0)? cpu_count: 1;
+    }
+    DEBUG("[%p] Allocated new work-stealing scheduler with %u workers\n",
+          self, thread_count);
+    cps_cont_init(&self->yield);
+    cps_cont_set(&self->yield, self, NULL, cps_ws__yield);
+    self->trampolined = CPS_TRAMPOLINE;
+    self->worker_count = thread_count;
+    self->next_worker = 0;
+    /* cork_calloc only guarantees malloc's alignment, so we over-allocate by
+     * a cache line and align the workers ourselves. */
+    self->workers_block =
+        cork_calloc(1, cps_ws__workers_block_size(thread_count));
+    self->workers = (struct cps_ws_worker *)
+        (((uintptr_t) self->workers_block + CPS_WS_CACHE_LINE_SIZE - 1)
+         & ~(uintptr_t) (CPS_WS_CACHE_LINE_SIZE - 1));
+    for (i = 0; i < thread_count; i++) {
+        cps_ws_worker_init(&self->workers[i], self, i);
+    }
+    self->idle_count = 0;
+    self->failed = false;
+    return self;
+}
+
+void
+cps_ws_free(struct cps_ws *self)
+{
+    unsigned int  i;
+    DEBUG("[%p] Freeing work-stealing scheduler\n", self);
+    for (i = 0; i < self->worker_count; i++) {
+        cps_ws_worker_done(&self->workers[i]);
+    }
+    cork_cfree(self->workers_block, 1,
+               cps_ws__workers_block_size(self->worker_count));
+    cps_cont_done(&self->yield);
+    cork_delete(struct cps_ws, self);
+}
+
+unsigned int
+cps_ws_thread_count(const struct cps_ws *self)
+{
+    return self->worker_count;
+}
+
+void
+cps_ws_set_trampolined(struct cps_ws *self, bool trampolined)
+{
+    self->trampolined = trampolined;
+}
+
+void
+cps_ws_add(struct cps_ws *self, struct cps_cont *cont)
+{
+    struct cps_ws_worker  *worker = *cps_ws_current_get();
+    if (worker == NULL || worker->ws != self) {
+        /* We're not being called from one of our workers, so the workers
+         * aren't running. */
+        worker = &self->workers[self->next_worker];
+        self->next_worker = (self->next_worker + 1) % self->worker_count;
+    }
+    DEBUG("[%p] Adding continuation %p\n", worker, cont);
+    cps_ws_worker_push(worker, cont);
+}
+
+struct cps_cont *
+cps_ws_get_yield(struct cps_ws *self)
+{
+    return &self->yield;
+}
+
+static void
+cps_ws__yield(void *user_data, struct cps_cont *next)
+{
+    struct cps_ws  *self = user_data;
+    struct cps_ws_worker  *worker = *cps_ws_current_get();
+    struct cps_cont  *head_cont;
+    assert(worker != NULL && worker->ws == self);
+
+    /* Add `next` to our deque, and then take the *oldest* continuation from
+     * it, so that the continuations that yield on this worker are scheduled
+     * round-robin. */
+    DEBUG("[%p] Adding continuation %p to deque\n", worker, next);
+    cps_ws_worker_push(worker, next);
+    head_cont = cps_ws_worker_steal(worker);
+    if (CORK_UNLIKELY(head_cont == NULL)) {
+        /* Other workers stole everything, including `next`.  Return to the
+         * worker's main loop, which will go looking for more work. */
+        return;
+    }
+
+    DEBUG("[%p] Yielding to continuation %p\n", worker, head_cont);
+    if (self->trampolined) {
+        cps_jump(head_cont, &self->yield);
+    } else {
+        cps_resume(head_cont, &self->yield);
+    }
+}
+
+static struct cps_cont *
+cps_ws__steal_any(struct cps_ws_worker *worker)
+{
+    struct cps_ws  *ws = worker->ws;
+    unsigned int  start;
+    unsigned int  i;
+
+    /* Start at a random victim, using xorshift to pick it. */
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 17;
+    worker->rng ^= worker->rng << 5;
+    start = worker->rng % ws->worker_count;
+
+    for (i = 0; i < ws->worker_count; i++) {
+        struct cps_ws_worker  *victim =
+            &ws->workers[(start + i) % ws->worker_count];
+        if (victim != worker) {
+            struct cps_cont  *cont = cps_ws_worker_steal(victim);
+            if (cont != NULL) {
+                DEBUG("[%p] Stole continuation %p from %p\n",
+                      worker, cont, victim);
+                return cont;
+            }
+        }
+    }
+    return NULL;
+}
+
+static bool
+cps_ws__any_work(struct cps_ws *ws)
+{
+    unsigned int  i;
+    for (i = 0; i < ws->worker_count; i++) {
+        if (!cps_ws_worker_is_empty(&ws->workers[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Look for a continuation to steal.  Returns NULL once every worker is out of
+ * work, or if some other worker has failed. */
+static struct cps_cont *
+cps_ws__find_work(struct cps_ws_worker *worker)
+{
+    struct cps_ws  *ws = worker->ws;
+    struct cps_cont  *cont;
+    unsigned int  spins = 0;
+
+    cont = cps_ws__steal_any(worker);
+    if (cont != NULL) {
+        return cont;
+    }
+
+    DEBUG("[%p] Going idle\n", worker);
+    cork_size_atomic_add(&ws->idle_count, 1);
+    while (!ws->failed && ws->idle_count < ws->worker_count) {
+        if (cps_ws__any_work(ws)) {
+            /* Stop being idle *before* stealing anything, so that no one else
+             * thinks we're finished while we're running it. */
+            cork_size_atomic_sub(&ws->idle_count, 1);
+            cont = cps_ws__steal_any(worker);
+            if (cont != NULL) {
+                return cont;
+            }
+            cork_size_atomic_add(&ws->idle_count, 1);
+        }
+
+        if (++spins < 64) {
+            cork_pause();
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static int
+cps_ws__run_worker(void *user_data)
+{
+    struct cps_ws_worker  *worker = user_data;
+    struct cps_ws  *ws = worker->ws;
+    struct cps_ws_worker  **current = cps_ws_current_get();
+    struct cps_ws_worker  *outer = *current;
+    int  rc = 0;
+
+    *current = worker;
+    while (CORK_LIKELY(!ws->failed)) {
+        struct cps_cont  *cont = cps_ws_worker_take(worker);
+        if (cont == NULL) {
+            cont = cps_ws__find_work(worker);
+            if (cont == NULL) {
+                break;
+            }
+        }
+
+        DEBUG("[%p] Yielding to continuation %p\n", worker, cont);
+        if (ws->trampolined) {
+            cps_trampoline(cont, &ws->yield);
+        } else {
+            cps_resume(cont, &ws->yield);
+        }
+        if (CORK_UNLIKELY(cork_error_occurred())) {
+            ws->failed = true;
+            rc = -1;
+        }
+    }
+    *current = outer;
+    return rc;
+}
+
+/* The other workers each get a thread of their own, which exits at the end of
+ * the drain.  Any continuations that it freed are sitting in its thread-local
+ * cache, which would leak if we didn't release it. */
+static int
+cps_ws__run_thread(void *user_data)
+{
+    int  rc = cps_ws__run_worker(user_data);
+    cps_cont_free_cache();
+    return rc;
+}
+
+int
+cps_ws_drain(struct cps_ws *self)
+{
+    unsigned int  started;
+    unsigned int  i;
+    int  rc = 0;
+
+    self->idle_count = 0;
+    self->failed = false;
+
+    /* The calling thread acts as the first worker. */
+    for (started = 1; started < self->worker_count; started++) {
+        struct cps_ws_worker  *worker = &self->workers[started];
+        worker->thread = cork_thread_new
+            ("copse-ws", worker, NULL, cps_ws__run_thread);
+        if (CORK_UNLIKELY(cork_thread_start(worker->thread) != 0)) {
+            cork_thread_free(worker->thread);
+            worker->thread = NULL;
+            self->failed = true;
+            rc = -1;
+            break;
+        }
+    }
+
+    if (CORK_LIKELY(rc == 0)) {
+        rc = cps_ws__run_worker(&self->workers[0]);
+    }
+
+    /* cork_thread_join passes along any error from the worker thread. */
+    for (i = 1; i < started; i++) {
+        struct cps_ws_worker  *worker = &self->workers[i];
+        if (cork_thread_join(worker->thread) != 0) {
+            rc = -1;
+        }
+        worker->thread = NULL;
+    }
+
+    for (i = 0; i < self->worker_count; i++) {
+        cps_ws_worker__free_retired(&self->workers[i]);
+    }
+    DEBUG("[%p] All continuations finished\n", self);
+    return rc;
+}
@@ -35,6 +35,17 @@ setup_allocator(void)
  * Error reporting
  */
 
+#if !defined(PRINT_EXPECTED_FAILURES)
+#define PRINT_EXPECTED_FAILURES  1
+#endif
+
+#if PRINT_EXPECTED_FAILURES
+#define print_expected_failure() \
+    printf("[expected: %s]\n", cork_error_message());
+#else
+#define print_expected_failure()  /* do nothing */
+#endif
+
 #define fail_if_error(call) \
     do { \
         call; \
@@ -0,0 +1,428 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "copse/channel.h"
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/round-robin.h"
+#include "copse/timer.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Pipelines
+ */
+
+#define MSG_COUNT  1000
+
+struct pipeline {
+    struct cps_chan  *chan;
+    size_t  received;
+    unsigned int  out_of_order;
+};
+
+static void
+producer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct pipeline  *self = user_data;
+    uintptr_t  i;
+    for (i = 0; i < MSG_COUNT; i++) {
+        fail_unless(cps_chan_send(self->chan, fiber, (void *) i),
+                    "Cannot send message");
+    }
+    cps_chan_close(self->chan);
+}
+
+static void
+consumer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct pipeline  *self = user_data;
+    void  *msg;
+    while (cps_chan_recv(self->chan, fiber, &msg)) {
+        if ((uintptr_t) msg != self->received) {
+            self->out_of_order++;
+        }
+        self->received++;
+    }
+}
+
+/* Start the consumer first if consumer_first is true, so that the consumer
+ * has to wait for the producer, and vice versa. */
+static void
+test_pipeline(struct cps_chan *chan, bool consumer_first)
+{
+    struct pipeline  pipeline;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *producer;
+    struct cps_fiber  *consumer;
+
+    pipeline.chan = chan;
+    pipeline.received = 0;
+    pipeline.out_of_order = 0;
+    producer = cps_fiber_new(&pipeline, NULL, producer__run, 0);
+    consumer = cps_fiber_new(&pipeline, NULL, consumer__run, 0);
+    if (consumer_first) {
+        cps_rr_add(rr, cps_fiber_cont(consumer));
+        cps_rr_add(rr, cps_fiber_cont(producer));
+    } else {
+        cps_rr_add(rr, cps_fiber_cont(producer));
+        cps_rr_add(rr, cps_fiber_cont(consumer));
+    }
+    fail_if_error(cps_rr_drain(rr));
+
+    fail_unless(cps_fiber_is_finished(producer), "Producer should be finished");
+    fail_unless(cps_fiber_is_finished(consumer), "Consumer should be finished");
+    fail_unless_equal("Messages received", "%zu",
+                      (size_t) MSG_COUNT, pipeline.received);
+    fail_unless_equal("Out of order messages", "%u", 0, pipeline.out_of_order);
+    cps_fiber_free(producer);
+    cps_fiber_free(consumer);
+    cps_rr_free(rr);
+    cps_chan_free(chan);
+}
+
+START_TEST(test_chan_bounded_01)
+{
+    DESCRIBE_TEST;
+    test_pipeline(cps_chan_new(4), true);
+    test_pipeline(cps_chan_new(4), false);
+}
+END_TEST
+
+START_TEST(test_chan_unbuffered_01)
+{
+    DESCRIBE_TEST;
+    test_pipeline(cps_chan_new(0), true);
+    test_pipeline(cps_chan_new(0), false);
+}
+END_TEST
+
+START_TEST(test_chan_unbounded_01)
+{
+    DESCRIBE_TEST;
+    struct cps_chan  *chan = cps_chan_new_unbounded();
+    uintptr_t  i;
+    void  *msg;
+
+    /* Sending to an unbounded channel never has to wait. */
+    for (i = 0; i < MSG_COUNT; i++) {
+        fail_unless(cps_chan_try_send(chan, (void *) i),
+                    "Cannot send message");
+    }
+    fail_unless_equal("Channel size", "%zu",
+                      (size_t) MSG_COUNT, cps_chan_size(chan));
+    for (i = 0; i < MSG_COUNT; i++) {
+        fail_unless(cps_chan_try_recv(chan, &msg), "Cannot receive message");
+        fail_unless_equal("Message", "%zu", (size_t) i, (size_t) msg);
+    }
+    fail_if(cps_chan_try_recv(chan, &msg), "Channel should be empty");
+    cps_chan_free(chan);
+
+    test_pipeline(cps_chan_new_unbounded(), true);
+    test_pipeline(cps_chan_new_unbounded(), false);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Closing channels
+ */
+
+struct close_test {
+    struct cps_chan  *chan;
+    unsigned int  failed_count;
+};
+
+static void
+waiting_receiver__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct close_test  *self = user_data;
+    void  *msg;
+    if (!cps_chan_recv(self->chan, fiber, &msg)) {
+        self->failed_count++;
+    }
+}
+
+static void
+closer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct close_test  *self = user_data;
+    cps_chan_close(self->chan);
+}
+
+START_TEST(test_chan_close_01)
+{
+    DESCRIBE_TEST;
+    struct close_test  test;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *receivers[2];
+    struct cps_fiber  *closer;
+    size_t  i;
+
+    test.chan = cps_chan_new(1);
+    test.failed_count = 0;
+    for (i = 0; i < 2; i++) {
+        receivers[i] = cps_fiber_new(&test, NULL, waiting_receiver__run, 0);
+        cps_rr_add(rr, cps_fiber_cont(receivers[i]));
+    }
+    closer = cps_fiber_new(&test, NULL, closer__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(closer));
+    fail_if_error(cps_rr_drain(rr));
+
+    fail_unless_equal("Failed receives", "%u", 2, test.failed_count);
+    fail_unless(cps_chan_is_closed(test.chan), "Channel should be closed");
+    fail_if(cps_chan_try_send(test.chan, NULL),
+            "Shouldn't be able to send to a closed channel");
+    for (i = 0; i < 2; i++) {
+        cps_fiber_free(receivers[i]);
+    }
+    cps_fiber_free(closer);
+    cps_rr_free(rr);
+    cps_chan_free(test.chan);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Select
+ */
+
+#define SELECT_COUNT  10
+
+struct select_test {
+    struct cps_chan  *chans[2];
+    size_t  received[2];
+    unsigned int  timeouts;
+    bool  sent_to_loser;
+};
+
+static void
+select_sender__run(struct select_test *self, size_t index,
+                   struct cps_fiber *fiber)
+{
+    uintptr_t  i;
+    for (i = 0; i < SELECT_COUNT; i++) {
+        fail_unless(cps_chan_send(self->chans[index], fiber, (void *) i),
+                    "Cannot send message");
+    }
+    cps_chan_close(self->chans[index]);
+}
+
+static void
+select_sender_0__run(void *user_data, struct cps_fiber *fiber)
+{
+    select_sender__run(user_data, 0, fiber);
+}
+
+static void
+select_sender_1__run(void *user_data, struct cps_fiber *fiber)
+{
+    select_sender__run(user_data, 1, fiber);
+}
+
+/* Receive from both channels until they're both closed. */
+static void
+select_receiver__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct select_test  *self = user_data;
+    struct cps_select_case  cases[2];
+    size_t  chan_indices[2];
+    size_t  count;
+    size_t  i;
+    bool  open[2] = { true, true };
+
+    while (open[0] || open[1]) {
+        count = 0;
+        for (i = 0; i < 2; i++) {
+            if (open[i]) {
+                cps_select_recv(&cases[count], self->chans[i]);
+                chan_indices[count++] = i;
+            }
+        }
+        i = cps_select(fiber, cases, count);
+        if (cases[i].ok) {
+            self->received[chan_indices[i]]++;
+        } else {
+            open[chan_indices[i]] = false;
+        }
+    }
+}
+
+static void
+select_test__init(struct select_test *test)
+{
+    test->chans[0] = cps_chan_new(0);
+    test->chans[1] = cps_chan_new(0);
+    test->received[0] = 0;
+    test->received[1] = 0;
+    test->timeouts = 0;
+    test->sent_to_loser = false;
+}
+
+static void
+select_test__done(struct select_test *test)
+{
+    cps_chan_free(test->chans[0]);
+    cps_chan_free(test->chans[1]);
+}
+
+static void
+run_fibers(void *user_data, cps_fiber_f *funcs, size_t count)
+{
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *fibers[3];
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        fibers[i] = cps_fiber_new(user_data, NULL, funcs[i], 0);
+        cps_rr_add(rr, cps_fiber_cont(fibers[i]));
+    }
+    fail_if_error(cps_rr_drain(rr));
+    for (i = 0; i < count; i++) {
+        fail_unless(cps_fiber_is_finished(fibers[i]),
+                    "Fiber %zu should be finished", i);
+        cps_fiber_free(fibers[i]);
+    }
+    cps_rr_free(rr);
+}
+
+START_TEST(test_select_01)
+{
+    DESCRIBE_TEST;
+    struct select_test  test;
+    cps_fiber_f  funcs[3] = {
+        select_receiver__run, select_sender_0__run, select_sender_1__run
+    };
+    select_test__init(&test);
+    run_fibers(&test, funcs, 3);
+    fail_unless_equal("Messages from channel 0", "%zu",
+                      (size_t) SELECT_COUNT, test.received[0]);
+    fail_unless_equal("Messages from channel 1", "%zu",
+                      (size_t) SELECT_COUNT, test.received[1]);
+    select_test__done(&test);
+}
+END_TEST
+
+/* Wait on an empty channel with a deadline, which should win. */
+static void
+select_timeout__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct select_test  *self = user_data;
+    struct cps_select_case  cases[2];
+    uint64_t  deadline = cps_now() + CPS_NSEC_PER_MSEC;
+    cps_select_recv(&cases[0], self->chans[0]);
+    fail_unless_equal("Ready case", "%d", -1, cps_try_select(cases, 1));
+    cps_select_deadline(&cases[1], deadline);
+    if (cps_select(fiber, cases, 2) == 1) {
+        self->timeouts++;
+    }
+    fail_unless(cps_now() >= deadline, "Select returned too early");
+}
+
+START_TEST(test_select_02)
+{
+    DESCRIBE_TEST;
+    struct select_test  test;
+    cps_fiber_f  funcs[1] = { select_timeout__run };
+    select_test__init(&test);
+    run_fibers(&test, funcs, 1);
+    fail_unless_equal("Timeouts", "%u", 1, test.timeouts);
+    /* cps_chan_free verifies that the select's receiver was cancelled. */
+    select_test__done(&test);
+}
+END_TEST
+
+/* Once one channel wins, the select must not also take a message from the
+ * other. */
+static void
+select_once__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct select_test  *self = user_data;
+    struct cps_select_case  cases[2];
+    size_t  i;
+    cps_select_recv(&cases[0], self->chans[0]);
+    cps_select_recv(&cases[1], self->chans[1]);
+    i = cps_select(fiber, cases, 2);
+    fail_unless(cases[i].ok, "Select should receive a message");
+    self->received[i]++;
+}
+
+static void
+select_both__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct select_test  *self = user_data;
+    fail_unless(cps_chan_try_send(self->chans[0], NULL),
+                "Select should be waiting for a message");
+    self->sent_to_loser = cps_chan_try_send(self->chans[1], NULL);
+}
+
+START_TEST(test_select_03)
+{
+    DESCRIBE_TEST;
+    struct select_test  test;
+    cps_fiber_f  funcs[2] = { select_once__run, select_both__run };
+    select_test__init(&test);
+    run_fibers(&test, funcs, 2);
+    fail_unless_equal("Messages from channel 0", "%zu",
+                      (size_t) 1, test.received[0]);
+    fail_unless_equal("Messages from channel 1", "%zu",
+                      (size_t) 0, test.received[1]);
+    fail_if(test.sent_to_loser, "Losing case should have been cancelled");
+    select_test__done(&test);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("channel");
+
+    TCase  *tc_chan = tcase_create("channel");
+    tcase_add_test(tc_chan, test_chan_bounded_01);
+    tcase_add_test(tc_chan, test_chan_unbuffered_01);
+    tcase_add_test(tc_chan, test_chan_unbounded_01);
+    tcase_add_test(tc_chan, test_chan_close_01);
+    suite_add_tcase(s, tc_chan);
+
+    TCase  *tc_select = tcase_create("select");
+    tcase_add_test(tc_select, test_select_01);
+    tcase_add_test(tc_select, test_select_02);
+    tcase_add_test(tc_select, test_select_03);
+    suite_add_tcase(s, tc_select);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
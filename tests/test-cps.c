@@ -8,15 +8,25 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <check.h>
+#include <libcork/threads.h>
 
 #include "copse/cps.h"
+#include "copse/detect.h"
+#include "copse/fiber.h"
+#include "copse/priority.h"
 #include "copse/round-robin.h"
+#include "copse/timer.h"
+#include "copse/work-stealing.h"
 
 #include "helpers.h"
 
@@ -286,6 +296,620 @@ START_TEST(test_cps_06)
 }
 END_TEST
 
+START_TEST(test_cps_07)
+{
+    DESCRIBE_TEST;
+    /* Continuations that finish during a lap mustn't cut short any later
+     * laps. */
+    unsigned int  result1a = 0;
+    unsigned int  result1b = 0;
+    unsigned int  result2a = 0;
+    unsigned int  result2b = 0;
+    unsigned int  result3 = 0;
+    unsigned int  result4 = 0;
+    struct save_int2  i1;
+    struct save_int2  i2;
+    struct save_int  i3;
+    struct save_int  i4;
+    struct cps_rr  *rr = cps_rr_new();
+    save_int2_init(&i1, &result1a, 10, &result1b, 15);
+    save_int2_init(&i2, &result2a, 20, &result2b, 25);
+    save_int_init(&i3, &result3, 30);
+    save_int_init(&i4, &result4, 40);
+    cps_rr_add(rr, i1.step1);
+    cps_rr_add(rr, i2.step1);
+    fail_if_error(cps_rr_run_one_lap(rr));
+    fail_if_error(cps_rr_run_one_lap(rr));
+    save_int2_verify2(&i1);
+    save_int2_verify2(&i2);
+    cps_rr_add(rr, i3.cont);
+    cps_rr_add(rr, i4.cont);
+    fail_if_error(cps_rr_run_one_lap(rr));
+    save_int_verify(&i3);
+    save_int_verify(&i4);
+    cps_rr_free(rr);
+    save_int2_done(&i1);
+    save_int2_done(&i2);
+    save_int_done(&i3);
+    save_int_done(&i4);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Continuation allocation
+ */
+
+START_TEST(test_cps_cache_01)
+{
+    DESCRIBE_TEST;
+    struct cps_cont  *cont1;
+    struct cps_cont  *cont2;
+    cps_cont_free_cache();
+    cont1 = cps_cont_new();
+    cps_cont_free(cont1);
+    /* Continuations are recycled, and come back cleared. */
+    cont2 = cps_cont_new();
+    fail_unless(cont1 == cont2, "Continuation wasn't reused");
+    fail_unless(cont2->user_data == NULL, "Reused continuation isn't clear");
+    cps_cont_free(cont2);
+    cps_cont_free_cache();
+}
+END_TEST
+
+struct embedded_save_int {
+    struct cps_cont  cont;
+    unsigned int  *dest;
+    unsigned int  value;
+};
+
+static void
+embedded_save_int__resume(void *user_data, struct cps_cont *next)
+{
+    struct embedded_save_int  *self = user_data;
+    *self->dest = self->value;
+    cps_call(next);
+}
+
+static void
+embedded_save_int__free(void *user_data)
+{
+    struct embedded_save_int  *self = user_data;
+    self->value = 0;
+}
+
+START_TEST(test_cps_embedded_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  result = 0;
+    struct embedded_save_int  i;
+    cps_cont_init(&i.cont);
+    cps_cont_set(&i.cont, &i, embedded_save_int__free,
+                 embedded_save_int__resume);
+    i.dest = &result;
+    i.value = 10;
+    fail_if_error(cps_run(&i.cont));
+    fail_unless_equal("Continuation result", "%u", 10, result);
+    cps_cont_done(&i.cont);
+    fail_unless_equal("Freed value", "%u", 0, i.value);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Trampolines
+ */
+
+/* A continuation that runs itself count times, keeping track of how far apart
+ * the stack frames of its invocations are.  If direct is true, it jumps
+ * directly back to itself; otherwise it passes itself to next (which should be
+ * a scheduler) to be rescheduled. */
+struct countdown {
+    struct cps_cont  cont;
+    unsigned int  count;
+    bool  direct;
+    uintptr_t  min_sp;
+    uintptr_t  max_sp;
+};
+
+static void
+countdown__resume(void *user_data, struct cps_cont *next)
+{
+    struct countdown  *self = user_data;
+    uintptr_t  sp = (uintptr_t) &self;
+    if (sp < self->min_sp) {
+        self->min_sp = sp;
+    }
+    if (sp > self->max_sp) {
+        self->max_sp = sp;
+    }
+    if (self->count-- == 0) {
+        cps_call(next);
+    } else if (self->direct) {
+        cps_jump(&self->cont, next);
+    } else {
+        cps_resume(next, &self->cont);
+    }
+}
+
+static void
+countdown_init(struct countdown *self, unsigned int count, bool direct)
+{
+    cps_cont_init(&self->cont);
+    cps_cont_set(&self->cont, self, NULL, countdown__resume);
+    self->count = count;
+    self->direct = direct;
+    self->min_sp = UINTPTR_MAX;
+    self->max_sp = 0;
+}
+
+#define fail_unless_constant_stack(self) \
+    fail_unless((self)->max_sp - (self)->min_sp < 1024, \
+                "Stack grew by %zu bytes", \
+                (size_t) ((self)->max_sp - (self)->min_sp))
+
+START_TEST(test_cps_trampoline_01)
+{
+    DESCRIBE_TEST;
+    struct countdown  c;
+    countdown_init(&c, 100000, true);
+    fail_if_error(cps_run_trampolined(&c.cont));
+    fail_unless_equal("Countdown", "%u", UINT_MAX, c.count);
+    fail_unless_constant_stack(&c);
+    cps_cont_done(&c.cont);
+}
+END_TEST
+
+START_TEST(test_cps_trampoline_02)
+{
+    DESCRIBE_TEST;
+    struct countdown  c1;
+    struct countdown  c2;
+    struct cps_rr  *rr = cps_rr_new();
+    cps_rr_set_trampolined(rr, true);
+    countdown_init(&c1, 100000, false);
+    countdown_init(&c2, 50000, false);
+    cps_rr_add(rr, &c1.cont);
+    cps_rr_add(rr, &c2.cont);
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless_equal("Countdown #1", "%u", UINT_MAX, c1.count);
+    fail_unless_equal("Countdown #2", "%u", UINT_MAX, c2.count);
+    fail_unless_constant_stack(&c1);
+    fail_unless_constant_stack(&c2);
+    cps_rr_free(rr);
+    cps_cont_done(&c1.cont);
+    cps_cont_done(&c2.cont);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Priority scheduler
+ */
+
+/* A continuation that records when it runs: it appends its id to a log, and
+ * takes a snapshot of a countdown's current count. */
+struct record {
+    struct cps_cont  cont;
+    unsigned int  id;
+    unsigned int  *log;
+    size_t  *log_length;
+    struct countdown  *watch;
+    unsigned int  seen;
+};
+
+static void
+record__resume(void *user_data, struct cps_cont *next)
+{
+    struct record  *self = user_data;
+    if (self->log != NULL) {
+        self->log[(*self->log_length)++] = self->id;
+    }
+    if (self->watch != NULL) {
+        self->seen = self->watch->count;
+    }
+    cps_call(next);
+}
+
+static void
+record_init(struct record *self, unsigned int id,
+            unsigned int *log, size_t *log_length, struct countdown *watch)
+{
+    cps_cont_init(&self->cont);
+    cps_cont_set(&self->cont, self, NULL, record__resume);
+    self->id = id;
+    self->log = log;
+    self->log_length = log_length;
+    self->watch = watch;
+    self->seen = 0;
+}
+
+START_TEST(test_cps_prio_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  log[CPS_PRIO_LEVEL_COUNT];
+    size_t  log_length = 0;
+    struct record  r[CPS_PRIO_LEVEL_COUNT];
+    struct cps_prio  *prio = cps_prio_new();
+    unsigned int  i;
+    /* Add the continuations from lowest to highest priority; they should run
+     * in the opposite order. */
+    for (i = CPS_PRIO_LEVEL_COUNT; i-- > 0; ) {
+        record_init(&r[i], i, log, &log_length, NULL);
+        cps_prio_add(prio, i, &r[i].cont);
+    }
+    fail_if_error(cps_prio_drain(prio));
+    fail_unless_equal("Log length", "%zu",
+                      (size_t) CPS_PRIO_LEVEL_COUNT, log_length);
+    for (i = 0; i < CPS_PRIO_LEVEL_COUNT; i++) {
+        fail_unless_equal("Log entry", "%u", i, log[i]);
+        cps_cont_done(&r[i].cont);
+    }
+    cps_prio_free(prio);
+}
+END_TEST
+
+START_TEST(test_cps_prio_02)
+{
+    DESCRIBE_TEST;
+    struct countdown  busy;
+    struct record  low;
+    struct cps_prio  *prio = cps_prio_new();
+    unsigned int  lowest = CPS_PRIO_LEVEL_COUNT - 1;
+    /* A busy high-priority continuation can only hold off a low-priority one
+     * for the length of its quota. */
+    cps_prio_set_quota(prio, 0, 10);
+    countdown_init(&busy, 1000, false);
+    record_init(&low, 0, NULL, NULL, &busy);
+    cps_prio_add(prio, 0, &busy.cont);
+    cps_prio_add(prio, lowest, &low.cont);
+    fail_if_error(cps_prio_drain(prio));
+    fail_unless_equal("Countdown", "%u", UINT_MAX, busy.count);
+    fail_unless_equal("Count when low-priority ran", "%u", 990, low.seen);
+    cps_cont_done(&busy.cont);
+    cps_cont_done(&low.cont);
+    cps_prio_free(prio);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Cross-thread inbox
+ */
+
+#define REMOTE_PRODUCER_COUNT  4
+#define REMOTE_ADD_COUNT  1000
+
+struct remote_producer {
+    struct cps_rr  *rr;
+    struct cps_cont  conts[REMOTE_ADD_COUNT];
+    unsigned int  run_count;
+};
+
+static void
+remote_cont__resume(void *user_data, struct cps_cont *next)
+{
+    struct remote_producer  *self = user_data;
+    self->run_count++;
+    cps_call(next);
+}
+
+static int
+remote_producer__run(void *user_data)
+{
+    struct remote_producer  *self = user_data;
+    size_t  i;
+    for (i = 0; i < REMOTE_ADD_COUNT; i++) {
+        cps_rr_add_remote(self->rr, &self->conts[i]);
+    }
+    return 0;
+}
+
+START_TEST(test_cps_remote_01)
+{
+    DESCRIBE_TEST;
+    struct remote_producer  producers[REMOTE_PRODUCER_COUNT];
+    struct cork_thread  *threads[REMOTE_PRODUCER_COUNT];
+    struct cps_rr  *rr = cps_rr_new();
+    unsigned int  total = 0;
+    size_t  i;
+    size_t  j;
+
+    fail_if_error(cps_rr_enable_wakeup(rr));
+    fail_unless(cps_rr_get_wakeup_fd(rr) != -1, "No wakeup fd");
+    for (i = 0; i < REMOTE_PRODUCER_COUNT; i++) {
+        producers[i].rr = rr;
+        producers[i].run_count = 0;
+        for (j = 0; j < REMOTE_ADD_COUNT; j++) {
+            cps_cont_init(&producers[i].conts[j]);
+            cps_cont_set(&producers[i].conts[j], &producers[i], NULL,
+                         remote_cont__resume);
+        }
+        threads[i] = cork_thread_new
+            ("producer", &producers[i], NULL, remote_producer__run);
+        fail_if_error(cork_thread_start(threads[i]));
+    }
+
+    while (total < REMOTE_PRODUCER_COUNT * REMOTE_ADD_COUNT) {
+        fail_if_error(cps_rr_wait(rr));
+        fail_if_error(cps_rr_drain(rr));
+        total = 0;
+        for (i = 0; i < REMOTE_PRODUCER_COUNT; i++) {
+            total += producers[i].run_count;
+        }
+    }
+
+    for (i = 0; i < REMOTE_PRODUCER_COUNT; i++) {
+        fail_if_error(cork_thread_join(threads[i]));
+        fail_unless_equal("Run count", "%u",
+                          REMOTE_ADD_COUNT, producers[i].run_count);
+        for (j = 0; j < REMOTE_ADD_COUNT; j++) {
+            cps_cont_done(&producers[i].conts[j]);
+        }
+    }
+    cps_rr_free(rr);
+}
+END_TEST
+
+/* A wakeup can arrive after the scheduler has already spliced the
+ * continuation that it was for, leaving the wakeup fd readable with an empty
+ * inbox.  That mustn't make cps_rr_drain spin while it waits for a timer.  We
+ * can only fake a stray wakeup when the wakeup fd is an eventfd, since
+ * otherwise it's the read end of a pipe. */
+START_TEST(test_cps_remote_02)
+{
+#if CPS_HAVE_EVENTFD
+    DESCRIBE_TEST;
+    struct remote_producer  producer;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_rr_stats  stats;
+    uint64_t  one = 1;
+
+    fail_if_error(cps_rr_enable_wakeup(rr));
+    producer.run_count = 0;
+    cps_cont_init(&producer.conts[0]);
+    cps_cont_set(&producer.conts[0], &producer, NULL, remote_cont__resume);
+    cps_sleep_cont(rr, cps_now() + 20 * CPS_NSEC_PER_MSEC, &producer.conts[0]);
+    fail_unless(write(cps_rr_get_wakeup_fd(rr), &one, sizeof(one))
+                == sizeof(one), "Couldn't write to wakeup fd");
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless_equal("Run count", "%u", 1, producer.run_count);
+
+    cps_rr_get_stats(rr, &stats);
+    if (stats.enabled) {
+        /* One wait that the stray wakeup cuts short, and one for the timer.
+         * (The timer wheel's resolution might add a few more.) */
+        fail_unless(stats.waits <= 10,
+                    "Drain waited %" PRIu64 " times", stats.waits);
+    }
+    cps_rr_free(rr);
+    cps_cont_done(&producer.conts[0]);
+#endif
+}
+END_TEST
+
+/* A fiber that keeps yielding never returns control to cps_rr_drain, but it
+ * should still see continuations that arrive in the inbox.  (The fiber adds
+ * the continuation itself, so that we know it's already yielding when the
+ * continuation arrives.) */
+
+#define REMOTE_SPIN_MAX_YIELDS  10000
+
+struct remote_spin {
+    struct cps_rr  *rr;
+    struct cps_cont  cont;
+    bool  flag;
+    unsigned int  yields;
+};
+
+static void
+remote_spin_cont__resume(void *user_data, struct cps_cont *next)
+{
+    struct remote_spin  *self = user_data;
+    self->flag = true;
+    cps_call(next);
+}
+
+static void
+remote_spin__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct remote_spin  *self = user_data;
+    cps_rr_add_remote(self->rr, &self->cont);
+    while (!self->flag && self->yields < REMOTE_SPIN_MAX_YIELDS) {
+        self->yields++;
+        cps_fiber_yield(fiber);
+    }
+}
+
+static void
+test_remote_spin(bool trampolined)
+{
+    struct remote_spin  spin;
+    struct cps_fiber  *fiber;
+
+    spin.rr = cps_rr_new();
+    cps_rr_set_trampolined(spin.rr, trampolined);
+    cps_cont_init(&spin.cont);
+    cps_cont_set(&spin.cont, &spin, NULL, remote_spin_cont__resume);
+    spin.flag = false;
+    spin.yields = 0;
+    fiber = cps_fiber_new(&spin, NULL, remote_spin__run, 0);
+    cps_rr_add(spin.rr, cps_fiber_cont(fiber));
+    fail_if_error(cps_rr_drain(spin.rr));
+    fail_unless(spin.flag, "Remote continuation never ran");
+    fail_unless(spin.yields < REMOTE_SPIN_MAX_YIELDS,
+                "Fiber yielded %u times", spin.yields);
+    cps_fiber_free(fiber);
+    cps_rr_free(spin.rr);
+    cps_cont_done(&spin.cont);
+}
+
+START_TEST(test_cps_remote_03)
+{
+    DESCRIBE_TEST;
+    test_remote_spin(false);
+    test_remote_spin(true);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Work-stealing scheduler
+ */
+
+/* A node in a binary tree of continuations.  Each node adds its children to
+ * the scheduler, and then frees itself. */
+struct tree_node {
+    struct cps_cont  cont;
+    struct cps_ws  *ws;
+    unsigned int  depth;
+    size_t  *count;
+};
+
+static void
+tree_node__resume(void *user_data, struct cps_cont *next);
+
+static void
+tree_node_new(struct cps_ws *ws, unsigned int depth, size_t *count)
+{
+    struct tree_node  *self = cork_new(struct tree_node);
+    cps_cont_init(&self->cont);
+    cps_cont_set(&self->cont, self, NULL, tree_node__resume);
+    self->ws = ws;
+    self->depth = depth;
+    self->count = count;
+    cps_ws_add(ws, &self->cont);
+}
+
+static void
+tree_node__resume(void *user_data, struct cps_cont *next)
+{
+    struct tree_node  *self = user_data;
+    cork_size_atomic_add(self->count, 1);
+    if (self->depth > 0) {
+        tree_node_new(self->ws, self->depth - 1, self->count);
+        tree_node_new(self->ws, self->depth - 1, self->count);
+    }
+    cps_cont_done(&self->cont);
+    cork_delete(struct tree_node, self);
+    cps_call(next);
+}
+
+START_TEST(test_cps_ws_01)
+{
+    DESCRIBE_TEST;
+    size_t  count = 0;
+    struct cps_ws  *ws = cps_ws_new(4);
+    tree_node_new(ws, 14, &count);
+    fail_if_error(cps_ws_drain(ws));
+    fail_unless_equal("Node count", "%zu", (size_t) (1 << 15) - 1, count);
+    cps_ws_free(ws);
+}
+END_TEST
+
+START_TEST(test_cps_ws_02)
+{
+    DESCRIBE_TEST;
+    struct countdown  c[8];
+    struct cps_ws  *ws = cps_ws_new(4);
+    size_t  i;
+    for (i = 0; i < 8; i++) {
+        countdown_init(&c[i], 1000, false);
+        cps_ws_add(ws, &c[i].cont);
+    }
+    fail_if_error(cps_ws_drain(ws));
+    for (i = 0; i < 8; i++) {
+        fail_unless_equal("Countdown", "%u", UINT_MAX, c[i].count);
+        cps_cont_done(&c[i].cont);
+    }
+    cps_ws_free(ws);
+}
+END_TEST
+
+static void
+fail_cont__resume(void *user_data, struct cps_cont *next)
+{
+    cork_error_set_printf(CORK_UNKNOWN_ERROR, "Continuation failed");
+}
+
+START_TEST(test_cps_ws_03)
+{
+    DESCRIBE_TEST;
+    struct cps_cont  cont;
+    struct cps_ws  *ws = cps_ws_new(2);
+    cps_cont_init(&cont);
+    cps_cont_set(&cont, NULL, NULL, fail_cont__resume);
+    cps_ws_add(ws, &cont);
+    fail_unless_error(cps_ws_drain(ws), "Drain should fail");
+    cps_cont_done(&cont);
+    cps_ws_free(ws);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Scheduler statistics
+ */
+
+#define STATS_CONT_COUNT  20
+
+static void
+noop__resume(void *user_data, struct cps_cont *next)
+{
+    cps_call(next);
+}
+
+START_TEST(test_cps_stats_01)
+{
+    DESCRIBE_TEST;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_cont  conts[STATS_CONT_COUNT];
+    struct cps_rr_stats  stats;
+    size_t  i;
+
+    for (i = 0; i < STATS_CONT_COUNT; i++) {
+        cps_cont_init(&conts[i]);
+        cps_cont_set(&conts[i], NULL, NULL, noop__resume);
+        cps_rr_add(rr, &conts[i]);
+    }
+    fail_if_error(cps_rr_drain(rr));
+    cps_rr_get_stats(rr, &stats);
+    fail_unless_equal("Queue length", "%zu", (size_t) 0, stats.queue_length);
+    for (i = 0; i < 3; i++) {
+        cps_rr_add(rr, &conts[i]);
+    }
+    fail_if_error(cps_rr_run_one_lap(rr));
+
+    cps_rr_get_stats(rr, &stats);
+    if (!stats.enabled) {
+        /* Statistics are compiled out, so there's nothing to count. */
+        fail_unless_equal("Resumed", "%" PRIu64, (uint64_t) 0, stats.resumed);
+    } else {
+        fail_unless_equal("Resumed", "%" PRIu64,
+                          (uint64_t) (STATS_CONT_COUNT + 3), stats.resumed);
+        fail_unless_equal("Drains", "%" PRIu64, (uint64_t) 1, stats.drains);
+        fail_unless_equal("Laps", "%" PRIu64, (uint64_t) 1, stats.laps);
+        fail_unless_equal("Last lap", "%" PRIu64,
+                          (uint64_t) 3, stats.last_lap_resumed);
+        fail_unless_equal("Peak queue length", "%zu",
+                          (size_t) STATS_CONT_COUNT, stats.peak_queue_length);
+        fail_unless_equal("Queue size", "%zu", (size_t) 32, stats.queue_size);
+        fail_unless_equal("Resizes", "%" PRIu64,
+                          (uint64_t) 1, stats.queue_resizes);
+
+        cps_rr_reset_stats(rr);
+        cps_rr_get_stats(rr, &stats);
+        fail_unless_equal("Resumed", "%" PRIu64, (uint64_t) 0, stats.resumed);
+        fail_unless_equal("Queue size", "%zu", (size_t) 32, stats.queue_size);
+    }
+
+    cps_rr_free(rr);
+    for (i = 0; i < STATS_CONT_COUNT; i++) {
+        cps_cont_done(&conts[i]);
+    }
+}
+END_TEST
+
 
 /*-----------------------------------------------------------------------
  * Testing harness
@@ -303,8 +927,40 @@ test_suite()
     tcase_add_test(tc_cps, test_cps_04);
     tcase_add_test(tc_cps, test_cps_05);
     tcase_add_test(tc_cps, test_cps_06);
+    tcase_add_test(tc_cps, test_cps_07);
     suite_add_tcase(s, tc_cps);
 
+    TCase  *tc_alloc = tcase_create("alloc");
+    tcase_add_test(tc_alloc, test_cps_cache_01);
+    tcase_add_test(tc_alloc, test_cps_embedded_01);
+    suite_add_tcase(s, tc_alloc);
+
+    TCase  *tc_trampoline = tcase_create("trampoline");
+    tcase_add_test(tc_trampoline, test_cps_trampoline_01);
+    tcase_add_test(tc_trampoline, test_cps_trampoline_02);
+    suite_add_tcase(s, tc_trampoline);
+
+    TCase  *tc_prio = tcase_create("prio");
+    tcase_add_test(tc_prio, test_cps_prio_01);
+    tcase_add_test(tc_prio, test_cps_prio_02);
+    suite_add_tcase(s, tc_prio);
+
+    TCase  *tc_remote = tcase_create("remote");
+    tcase_add_test(tc_remote, test_cps_remote_01);
+    tcase_add_test(tc_remote, test_cps_remote_02);
+    tcase_add_test(tc_remote, test_cps_remote_03);
+    suite_add_tcase(s, tc_remote);
+
+    TCase  *tc_ws = tcase_create("ws");
+    tcase_add_test(tc_ws, test_cps_ws_01);
+    tcase_add_test(tc_ws, test_cps_ws_02);
+    tcase_add_test(tc_ws, test_cps_ws_03);
+    suite_add_tcase(s, tc_ws);
+
+    TCase  *tc_stats = tcase_create("stats");
+    tcase_add_test(tc_stats, test_cps_stats_01);
+    suite_add_tcase(s, tc_stats);
+
     return s;
 }
 
@@ -18,6 +18,8 @@
 #include "copse/cps.h"
 #include "copse/fiber.h"
 #include "copse/round-robin.h"
+#include "copse/timer.h"
+#include "copse/trace.h"
 
 #include "helpers.h"
 
@@ -61,6 +63,20 @@ save_int_init(struct save_int *self, const char *name,
     self->cont = cps_fiber_cont(fiber);
 }
 
+static void
+save_int_init_from_pool(struct save_int *self, const char *name,
+                        unsigned int *dest, unsigned int value,
+                        struct cps_stack_pool *pool)
+{
+    struct cps_fiber  *fiber;
+    self->name = name;
+    self->dest = dest;
+    self->value = value;
+    self->run_count = 0;
+    fiber = cps_fiber_new_from_pool(self, NULL, save_int__run, pool);
+    self->cont = cps_fiber_cont(fiber);
+}
+
 static void
 save_int_done(struct save_int *self)
 {
@@ -293,6 +309,754 @@ START_TEST(test_fiber_06)
 }
 END_TEST
 
+START_TEST(test_fiber_fpu_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  result = 0;
+    struct save_int  i;
+    struct cps_fiber  *fiber;
+    i.name = "i";
+    i.dest = &result;
+    i.value = 10;
+    i.run_count = 0;
+    fiber = cps_fiber_new(&i, NULL, save_int__run, 0);
+    cps_fiber_set_preserve_fpu(fiber, false);
+    i.cont = cps_fiber_cont(fiber);
+    fail_if_error(cps_run(i.cont));
+    save_int_verify(&i, 1, 0);
+    fail_if_error(cps_run(i.cont));
+    save_int_verify(&i, 2, 10);
+    save_int_done(&i);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Symmetric transfer
+ */
+
+struct ping_pong {
+    struct cps_fiber  *fiber;
+    struct ping_pong  *partner;
+    const char  *name;
+    char  *trace;
+    unsigned int  rounds;
+};
+
+static void
+ping_pong__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct ping_pong  *self = user_data;
+    unsigned int  i;
+    for (i = 0; i < self->rounds; i++) {
+        printf("[%s] Round %u\n", self->name, i);
+        strcat(self->trace, self->name);
+        cps_fiber_transfer(fiber, self->partner->fiber);
+    }
+    printf("[%s] Finished\n", self->name);
+    strcat(self->trace, self->name);
+}
+
+static void
+ping_pong_init(struct ping_pong *self, const char *name, char *trace,
+               unsigned int rounds, struct ping_pong *partner)
+{
+    self->name = name;
+    self->trace = trace;
+    self->rounds = rounds;
+    self->partner = partner;
+    self->fiber = cps_fiber_new(self, NULL, ping_pong__run, 0);
+}
+
+START_TEST(test_fiber_transfer_01)
+{
+    DESCRIBE_TEST;
+    char  trace[16] = "";
+    struct ping_pong  a;
+    struct ping_pong  b;
+    ping_pong_init(&a, "a", trace, 2, &b);
+    ping_pong_init(&b, "b", trace, 2, &a);
+    /* a and b bounce back and forth until a finishes, which returns from
+     * cps_run.  b is left paused. */
+    fail_if_error(cps_run(cps_fiber_cont(a.fiber)));
+    fail_unless(strcmp(trace, "ababa") == 0, "Unexpected trace %s", trace);
+    /* Resuming b picks up where it left off. */
+    fail_if_error(cps_run(cps_fiber_cont(b.fiber)));
+    fail_unless(strcmp(trace, "ababab") == 0, "Unexpected trace %s", trace);
+    cps_fiber_free(a.fiber);
+    cps_fiber_free(b.fiber);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Generators
+ */
+
+/* Yields the numbers 1 through 5, and adds up whatever values are passed back
+ * in. */
+struct counter {
+    unsigned int  values[5];
+    unsigned int  sum;
+};
+
+static void
+counter__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct counter  *self = user_data;
+    unsigned int  i;
+    for (i = 0; i < 5; i++) {
+        unsigned int  *in;
+        self->values[i] = i + 1;
+        in = cps_fiber_yield_value(fiber, &self->values[i]);
+        self->sum += *in;
+    }
+}
+
+START_TEST(test_fiber_generator_01)
+{
+    DESCRIBE_TEST;
+    struct counter  counter = { { 0 }, 0 };
+    struct cps_fiber  *fiber = cps_fiber_new(&counter, NULL, counter__run, 0);
+    unsigned int  in[5] = { 10, 20, 30, 40, 50 };
+    unsigned int  *out;
+    unsigned int  i = 0;
+    unsigned int  total = 0;
+
+    /* The value passed into the first resume is dropped, since the fiber isn't
+     * in the middle of a yield yet. */
+    out = cps_fiber_resume_with(fiber, NULL);
+    while (!cps_fiber_is_finished(fiber)) {
+        fail_unless(out == &counter.values[i], "Unexpected yielded value");
+        total += *out;
+        out = cps_fiber_resume_with(fiber, &in[i++]);
+    }
+    fail_unless(out == NULL, "Finished fiber should yield NULL");
+    fail_unless_equal("Yielded values", "%u", 15, total);
+    fail_unless_equal("Passed-in values", "%u", 150, counter.sum);
+    cps_fiber_free(fiber);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Sleeping fibers
+ */
+
+#define SLEEP_COUNT  3
+#define SLEEP_INTERVAL  (10 * CPS_NSEC_PER_MSEC)
+
+struct sleeper {
+    uint64_t  start;
+    uint64_t  woke[SLEEP_COUNT];
+};
+
+static void
+sleeper__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct sleeper  *self = user_data;
+    unsigned int  i;
+    for (i = 0; i < SLEEP_COUNT; i++) {
+        cps_fiber_sleep_until(fiber, self->start + (i + 1) * SLEEP_INTERVAL);
+        self->woke[i] = cps_now();
+    }
+}
+
+static void
+ticker__run(void *user_data, struct cps_fiber *fiber)
+{
+    unsigned int  *count = user_data;
+    for (*count = 0; *count < 5; (*count)++) {
+        cps_fiber_yield(fiber);
+    }
+}
+
+START_TEST(test_fiber_sleep_01)
+{
+    DESCRIBE_TEST;
+    struct sleeper  sleeper;
+    unsigned int  ticks;
+    struct cps_fiber  *f1 = cps_fiber_new(&sleeper, NULL, sleeper__run, 0);
+    struct cps_fiber  *f2 = cps_fiber_new(&ticks, NULL, ticker__run, 0);
+    struct cps_rr  *rr = cps_rr_new();
+    unsigned int  i;
+
+    sleeper.start = cps_now();
+    cps_rr_add(rr, cps_fiber_cont(f1));
+    cps_rr_add(rr, cps_fiber_cont(f2));
+    /* The ticker finishes right away; the drain then blocks until each of the
+     * sleeper's deadlines. */
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless(cps_fiber_is_finished(f1), "Sleeper should be finished");
+    fail_unless_equal("Tick count", "%u", 5, ticks);
+    for (i = 0; i < SLEEP_COUNT; i++) {
+        fail_unless(sleeper.woke[i] >=
+                    sleeper.start + (i + 1) * SLEEP_INTERVAL,
+                    "Woke up too early");
+    }
+    cps_rr_free(rr);
+    cps_fiber_free(f1);
+    cps_fiber_free(f2);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Reusable fibers
+ */
+
+START_TEST(test_fiber_reset_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  result1 = 0;
+    unsigned int  result2 = 0;
+    struct save_int  i1;
+    struct save_int  i2;
+    struct cps_fiber  *fiber;
+    save_int_init(&i1, "i1", &result1, 10);
+    fail_if_error(cps_run(i1.cont));
+    fail_if_error(cps_run(i1.cont));
+    save_int_verify(&i1, 2, 10);
+
+    /* Reuse the finished fiber (and its continuation) for a new function. */
+    fiber = cps_fiber_from_cont(i1.cont);
+    fail_unless(cps_fiber_is_finished(fiber), "Fiber should be finished");
+    i2.name = "i2";
+    i2.dest = &result2;
+    i2.value = 20;
+    i2.run_count = 0;
+    cps_fiber_reset(fiber, &i2, NULL, save_int__run);
+    i2.cont = cps_fiber_cont(fiber);
+    fail_unless(i2.cont == i1.cont, "Reset fiber should keep continuation");
+    fail_if_error(cps_run(i2.cont));
+    fail_if_error(cps_run(i2.cont));
+    save_int_verify(&i2, 2, 20);
+    save_int_done(&i2);
+}
+END_TEST
+
+START_TEST(test_fiber_worker_pool_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  results[6] = { 0, 0, 0, 0, 0, 0 };
+    struct save_int  tasks[6];
+    struct cps_fiber  *fibers[6];
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_worker_pool  *pool = cps_worker_pool_new(64 * 1024, 0);
+    unsigned int  i;
+
+    for (i = 0; i < 6; i++) {
+        tasks[i].name = "task";
+        tasks[i].dest = &results[i];
+        tasks[i].value = (i + 1) * 10;
+        tasks[i].run_count = 0;
+    }
+
+    for (i = 0; i < 3; i++) {
+        fibers[i] = cps_worker_pool_spawn(pool, &tasks[i], NULL, save_int__run);
+        cps_rr_add(rr, cps_fiber_cont(fibers[i]));
+    }
+    fail_unless_equal("Busy fibers", "%zu",
+                      (size_t) 3, cps_worker_pool_busy_count(pool));
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless_equal("Idle fibers", "%zu",
+                      (size_t) 3, cps_worker_pool_idle_count(pool));
+
+    /* The second batch of tasks reuses the fibers from the first. */
+    for (i = 3; i < 6; i++) {
+        fibers[i] = cps_worker_pool_spawn(pool, &tasks[i], NULL, save_int__run);
+        fail_unless(fibers[i] == fibers[0] || fibers[i] == fibers[1] ||
+                    fibers[i] == fibers[2], "Fiber wasn't reused");
+        cps_rr_add(rr, cps_fiber_cont(fibers[i]));
+    }
+    fail_unless_equal("Idle fibers", "%zu",
+                      (size_t) 0, cps_worker_pool_idle_count(pool));
+    fail_if_error(cps_rr_drain(rr));
+
+    for (i = 0; i < 6; i++) {
+        save_int_verify(&tasks[i], 2, (i + 1) * 10);
+    }
+    fail_unless_equal("Busy fibers", "%zu",
+                      (size_t) 0, cps_worker_pool_busy_count(pool));
+    cps_rr_free(rr);
+    cps_worker_pool_free(pool);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Stack pools
+ */
+
+#define fail_unless_pool_counts(pool, idle, used) \
+    do { \
+        fail_unless_equal("Idle stacks", "%zu", \
+                          (size_t) (idle), cps_stack_pool_idle_count(pool)); \
+        fail_unless_equal("Used stacks", "%zu", \
+                          (size_t) (used), cps_stack_pool_used_count(pool)); \
+    } while (0)
+
+START_TEST(test_fiber_pool_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  result1 = 0;
+    unsigned int  result2 = 0;
+    unsigned int  result3 = 0;
+    struct save_int  i1;
+    struct save_int  i2;
+    struct save_int  i3;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_stack_pool  *pool = cps_stack_pool_new(64 * 1024, 0, 1, 2);
+    fail_unless_pool_counts(pool, 1, 0);
+    save_int_init_from_pool(&i1, "i1", &result1, 10, pool);
+    save_int_init_from_pool(&i2, "i2", &result2, 20, pool);
+    save_int_init_from_pool(&i3, "i3", &result3, 30, pool);
+    fail_unless_pool_counts(pool, 0, 3);
+    cps_rr_add(rr, i1.cont);
+    cps_rr_add(rr, i2.cont);
+    cps_rr_add(rr, i3.cont);
+    fail_if_error(cps_rr_drain(rr));
+    save_int_verify(&i1, 2, 10);
+    save_int_verify(&i2, 2, 20);
+    save_int_verify(&i3, 2, 30);
+    cps_rr_free(rr);
+    save_int_done(&i1);
+    save_int_done(&i2);
+    save_int_done(&i3);
+    /* Only high_watermark stacks are kept around after being released. */
+    fail_unless_pool_counts(pool, 2, 0);
+    cps_stack_pool_trim(pool);
+    fail_unless_pool_counts(pool, 1, 0);
+    cps_stack_pool_free(pool);
+}
+END_TEST
+
+START_TEST(test_fiber_pool_02)
+{
+    DESCRIBE_TEST;
+    /* Stacks are recycled through the pool. */
+    struct cps_stack_pool  *pool = cps_stack_pool_new(0, 0, 0, 1);
+    void  *stack1;
+    void  *stack2;
+    fail_unless_equal("Stack size", "%zu",
+                      (size_t) CPS_DEFAULT_STACK_SIZE,
+                      cps_stack_pool_stack_size(pool));
+    stack1 = cps_stack_pool_acquire(pool);
+    cps_stack_pool_release(pool, stack1);
+    stack2 = cps_stack_pool_acquire(pool);
+    fail_unless(stack1 == stack2, "Stack wasn't reused");
+    cps_stack_pool_release(pool, stack2);
+    cps_stack_pool_free(pool);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * mmap-backed stacks
+ */
+
+START_TEST(test_fiber_mmap_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  result = 0;
+    struct save_int  i;
+    struct cps_fiber  *fiber;
+    i.name = "i";
+    i.dest = &result;
+    i.value = 10;
+    i.run_count = 0;
+    fiber = cps_fiber_new_ex(&i, NULL, save_int__run, 0, CPS_STACK_MMAP);
+    i.cont = cps_fiber_cont(fiber);
+    fail_if_error(cps_run(i.cont));
+    save_int_verify(&i, 1, 0);
+    fail_if_error(cps_run(i.cont));
+    save_int_verify(&i, 2, 10);
+    save_int_done(&i);
+}
+END_TEST
+
+START_TEST(test_fiber_mmap_02)
+{
+    DESCRIBE_TEST;
+    unsigned int  result1 = 0;
+    unsigned int  result2 = 0;
+    struct save_int  i1;
+    struct save_int  i2;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_stack_pool  *pool =
+        cps_stack_pool_new(16 * 1024, CPS_STACK_MMAP, 1, 1);
+    save_int_init_from_pool(&i1, "i1", &result1, 10, pool);
+    save_int_init_from_pool(&i2, "i2", &result2, 20, pool);
+    cps_rr_add(rr, i1.cont);
+    cps_rr_add(rr, i2.cont);
+    fail_if_error(cps_rr_drain(rr));
+    save_int_verify(&i1, 2, 10);
+    save_int_verify(&i2, 2, 20);
+    cps_rr_free(rr);
+    save_int_done(&i1);
+    save_int_done(&i2);
+    fail_unless_pool_counts(pool, 1, 0);
+    cps_stack_pool_free(pool);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Embedded fibers
+ */
+
+START_TEST(test_fiber_embed_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  result = 0;
+    struct save_int  i;
+    struct cps_fiber  *fiber;
+    i.name = "i";
+    i.dest = &result;
+    i.value = 10;
+    i.run_count = 0;
+    fiber = cps_fiber_new_ex
+        (&i, NULL, save_int__run, 0, CPS_STACK_MMAP | CPS_STACK_EMBED_FIBER);
+    i.cont = cps_fiber_cont(fiber);
+    fail_if_error(cps_run(i.cont));
+    save_int_verify(&i, 1, 0);
+    fail_if_error(cps_run(i.cont));
+    save_int_verify(&i, 2, 10);
+    cps_fiber_free(fiber);
+}
+END_TEST
+
+START_TEST(test_fiber_embed_02)
+{
+    DESCRIBE_TEST;
+    unsigned int  result1 = 0;
+    unsigned int  result2 = 0;
+    struct save_int  i1;
+    struct save_int  i2;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_stack_pool  *pool =
+        cps_stack_pool_new(16 * 1024, CPS_STACK_EMBED_FIBER, 0, 2);
+    save_int_init_from_pool(&i1, "i1", &result1, 10, pool);
+    save_int_init_from_pool(&i2, "i2", &result2, 20, pool);
+    cps_rr_add(rr, i1.cont);
+    cps_rr_add(rr, i2.cont);
+    fail_if_error(cps_rr_drain(rr));
+    save_int_verify(&i1, 2, 10);
+    save_int_verify(&i2, 2, 20);
+    cps_rr_free(rr);
+    cps_fiber_free(cps_fiber_from_cont(i1.cont));
+    cps_fiber_free(cps_fiber_from_cont(i2.cont));
+    fail_unless_pool_counts(pool, 2, 0);
+    cps_stack_pool_free(pool);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Stack high-water marks
+ */
+
+#define DEEP_STACK_SIZE  8192
+
+struct deep_stack {
+    size_t  high_water;
+};
+
+static void
+deep_stack__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct deep_stack  *self = user_data;
+    volatile char  buf[DEEP_STACK_SIZE];
+    size_t  i;
+    for (i = 0; i < DEEP_STACK_SIZE; i++) {
+        buf[i] = 0;
+    }
+    (void) buf[0];
+    self->high_water = cps_fiber_stack_high_water(fiber);
+    cps_fiber_yield(fiber);
+}
+
+START_TEST(test_fiber_paint_01)
+{
+    DESCRIBE_TEST;
+    struct deep_stack  deep = { 0 };
+    struct cps_fiber  *fiber =
+        cps_fiber_new_ex(&deep, NULL, deep_stack__run, 64 * 1024,
+                         CPS_STACK_PAINT);
+    size_t  before = cps_fiber_stack_high_water(fiber);
+    fail_unless(before < 1024, "Unused fiber used %zu bytes of stack", before);
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_unless(deep.high_water >= DEEP_STACK_SIZE,
+                "Fiber only used %zu bytes of stack", deep.high_water);
+    fail_unless(deep.high_water < 64 * 1024,
+                "Fiber used %zu bytes of stack", deep.high_water);
+    /* Yielding uses a little more stack, depending on the compiler's frame
+     * layout, so the mark can only have gone up. */
+    fail_unless(cps_fiber_stack_high_water(fiber) >= deep.high_water,
+                "High-water mark went down to %zu bytes",
+                cps_fiber_stack_high_water(fiber));
+    cps_fiber_free(fiber);
+}
+END_TEST
+
+START_TEST(test_fiber_paint_02)
+{
+    DESCRIBE_TEST;
+    struct deep_stack  deep1 = { 0 };
+    struct deep_stack  deep2 = { 0 };
+    struct cps_stack_histogram  histogram;
+    struct cps_fiber  *fiber;
+    unsigned int  i;
+    size_t  total = 0;
+    struct cps_stack_pool  *pool =
+        cps_stack_pool_new(64 * 1024, CPS_STACK_PAINT, 1, 1);
+
+    /* The second fiber reuses the first fiber's stack, which must be repainted
+     * so that we don't overestimate its high-water mark. */
+    fiber = cps_fiber_new_from_pool(&deep1, NULL, deep_stack__run, pool);
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    cps_fiber_free(fiber);
+    fiber = cps_fiber_new_from_pool(&deep2, NULL, deep_stack__run, pool);
+    fail_unless(cps_fiber_stack_high_water(fiber) < 1024,
+                "Reused stack wasn't repainted");
+    cps_fiber_free(fiber);
+
+    cps_stack_pool_get_histogram(pool, &histogram);
+    for (i = 0; i < CPS_STACK_HISTOGRAM_SIZE; i++) {
+        total += histogram.counts[i];
+    }
+    fail_unless_equal("Histogram count", "%zu", (size_t) 2, total);
+    fail_unless(histogram.max >= deep1.high_water,
+                "Maximum high-water mark %zu is less than %zu",
+                histogram.max, deep1.high_water);
+    fail_unless(histogram.max < 64 * 1024,
+                "Maximum high-water mark %zu is too large", histogram.max);
+    cps_stack_pool_free(pool);
+}
+END_TEST
+
+/* Resetting a fiber repaints its stack, so that the new function's high-water
+ * mark doesn't include what the old function used. */
+static void
+test_paint_reset(unsigned int flags)
+{
+    struct deep_stack  deep1 = { 0 };
+    struct deep_stack  deep2 = { 0 };
+    struct cps_fiber  *fiber =
+        cps_fiber_new_ex(&deep1, NULL, deep_stack__run, 64 * 1024, flags);
+    size_t  after_reset;
+
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_unless(cps_fiber_is_finished(fiber), "Fiber should be finished");
+    fail_unless(cps_fiber_stack_high_water(fiber) >= DEEP_STACK_SIZE,
+                "Fiber only used %zu bytes of stack",
+                cps_fiber_stack_high_water(fiber));
+
+    cps_fiber_reset(fiber, &deep2, NULL, deep_stack__run);
+    after_reset = cps_fiber_stack_high_water(fiber);
+    fail_unless(after_reset < 1024,
+                "Reset fiber used %zu bytes of stack", after_reset);
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_unless(cps_fiber_is_finished(fiber), "Fiber should be finished");
+    fail_unless(deep2.high_water >= DEEP_STACK_SIZE,
+                "Fiber only used %zu bytes of stack", deep2.high_water);
+    cps_fiber_free(fiber);
+}
+
+START_TEST(test_fiber_paint_03)
+{
+    DESCRIBE_TEST;
+    test_paint_reset(CPS_STACK_PAINT);
+    test_paint_reset(CPS_STACK_PAINT | CPS_STACK_EMBED_FIBER);
+}
+END_TEST
+
+/* The fiber's own high-water mark, and the ones that its pool records when
+ * the fiber is reset or freed, should all measure the same part of the stack,
+ * even if the fiber is embedded in it. */
+static void
+test_paint_pool_histogram(unsigned int flags)
+{
+    struct deep_stack  deep1 = { 0 };
+    struct deep_stack  deep2 = { 0 };
+    struct cps_stack_histogram  histogram;
+    struct cps_stack_pool  *pool =
+        cps_stack_pool_new(64 * 1024, CPS_STACK_PAINT | flags, 1, 1);
+    struct cps_fiber  *fiber =
+        cps_fiber_new_from_pool(&deep1, NULL, deep_stack__run, pool);
+    size_t  high_water;
+
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    high_water = cps_fiber_stack_high_water(fiber);
+    cps_fiber_reset(fiber, &deep2, NULL, deep_stack__run);
+    cps_stack_pool_get_histogram(pool, &histogram);
+    fail_unless_equal("High-water mark after reset", "%zu",
+                      high_water, histogram.max);
+
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    if (cps_fiber_stack_high_water(fiber) > high_water) {
+        high_water = cps_fiber_stack_high_water(fiber);
+    }
+    cps_fiber_free(fiber);
+    cps_stack_pool_get_histogram(pool, &histogram);
+    fail_unless_equal("High-water mark after free", "%zu",
+                      high_water, histogram.max);
+    cps_stack_pool_free(pool);
+}
+
+START_TEST(test_fiber_paint_04)
+{
+    DESCRIBE_TEST;
+    test_paint_pool_histogram(0);
+    test_paint_pool_histogram(CPS_STACK_EMBED_FIBER);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * CPU accounting
+ */
+
+#define HOG_TIME  (2 * CPS_NSEC_PER_MSEC)
+
+/* Yields three times, and hogs the CPU during its second run. */
+static void
+hog__run(void *user_data, struct cps_fiber *fiber)
+{
+    uint64_t  deadline;
+    cps_fiber_yield(fiber);
+    deadline = cps_now() + HOG_TIME;
+    while (cps_now() < deadline) {
+        /* spin */
+    }
+    cps_fiber_yield(fiber);
+    cps_fiber_yield(fiber);
+}
+
+START_TEST(test_fiber_stats_01)
+{
+    DESCRIBE_TEST;
+    struct cps_fiber  *fiber = cps_fiber_new(NULL, NULL, hog__run, 0);
+    struct cps_fiber_stats  stats;
+    unsigned int  i;
+
+    for (i = 0; i < 4; i++) {
+        fail_if_error(cps_run(cps_fiber_cont(fiber)));
+    }
+    fail_unless(cps_fiber_is_finished(fiber), "Fiber should be finished");
+
+    cps_fiber_get_stats(fiber, &stats);
+    if (!stats.enabled) {
+        /* Statistics are compiled out, so there's nothing to count. */
+        fail_unless(stats.resumes == 0, "Fiber shouldn't count resumes");
+    } else {
+        fail_unless(stats.resumes == 4,
+                    "Fiber should have been resumed 4 times");
+        fail_unless(stats.max_run_ns >= HOG_TIME,
+                    "Longest run should include the busy loop");
+        fail_unless(stats.run_ns >= stats.max_run_ns,
+                    "Total run time should include the longest run");
+    }
+    cps_fiber_free(fiber);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Tracing
+ */
+
+START_TEST(test_fiber_trace_01)
+{
+    DESCRIBE_TEST;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *fiber;
+    FILE  *out = tmpfile();
+    char  json[4096];
+    size_t  length;
+
+    cps_trace_clear();
+    fiber = cps_fiber_new(NULL, NULL, hog__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(fiber));
+    fail_if_error(cps_rr_drain(rr));
+    fail_if_error(cps_trace_write_json(out));
+
+    rewind(out);
+    length = fread(json, 1, sizeof(json) - 1, out);
+    json[length] = '\0';
+    fclose(out);
+    fail_unless(strncmp(json, "{\"traceEvents\":[", 16) == 0,
+                "Unexpected trace output %s", json);
+    if (cps_trace_is_enabled()) {
+        /* One drain, and four runs of the fiber. */
+        fail_unless(strstr(json, "\"name\":\"drain ") != NULL,
+                    "Missing drain in trace output %s", json);
+        fail_unless(strstr(json, "\"name\":\"create fiber ") != NULL,
+                    "Missing fiber creation in trace output %s", json);
+        fail_unless(strstr(json, "\"end\":\"finish\"") != NULL,
+                    "Missing fiber finish in trace output %s", json);
+    } else {
+        fail_unless(strstr(json, "\"ph\":\"B\"") == NULL,
+                    "Trace output should be empty %s", json);
+    }
+    cps_fiber_free(fiber);
+    cps_rr_free(rr);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Fiber registry
+ */
+
+static void
+yield_once__run(void *user_data, struct cps_fiber *fiber)
+{
+    cps_fiber_yield(fiber);
+}
+
+START_TEST(test_fiber_dump_01)
+{
+    DESCRIBE_TEST;
+    struct cps_fiber  *paused = cps_fiber_new(NULL, NULL, yield_once__run, 0);
+    struct cps_fiber  *unstarted =
+        cps_fiber_new(NULL, NULL, yield_once__run, 0);
+    FILE  *out = tmpfile();
+    char  dump[4096];
+    size_t  length;
+
+    cps_fiber_resume_with(paused, NULL);
+    fail_if_error(cps_fiber_dump(out));
+    rewind(out);
+    length = fread(dump, 1, sizeof(dump) - 1, out);
+    dump[length] = '\0';
+    fclose(out);
+
+    if (cps_fiber_registry_is_enabled()) {
+        fail_unless(strstr(dump, ": paused, ") != NULL,
+                    "Missing paused fiber in dump %s", dump);
+        fail_unless(strstr(dump, ": not started, ") != NULL,
+                    "Missing unstarted fiber in dump %s", dump);
+#if defined(__x86_64__)
+        fail_unless(strstr(dump, "    #0 ") != NULL,
+                    "Missing backtrace in dump %s", dump);
+#endif
+    } else {
+        fail_unless(strstr(dump, "disabled") != NULL,
+                    "Unexpected dump %s", dump);
+    }
+
+    cps_fiber_resume_with(paused, NULL);
+    fail_unless(cps_fiber_is_finished(paused), "Fiber should be finished");
+    cps_fiber_free(paused);
+    cps_fiber_free(unstarted);
+}
+END_TEST
+
 
 /*-----------------------------------------------------------------------
  * Testing harness
@@ -310,8 +1074,60 @@ test_suite()
     tcase_add_test(tc_cps, test_fiber_04);
     tcase_add_test(tc_cps, test_fiber_05);
     tcase_add_test(tc_cps, test_fiber_06);
+    tcase_add_test(tc_cps, test_fiber_fpu_01);
     suite_add_tcase(s, tc_cps);
 
+    TCase  *tc_transfer = tcase_create("transfer");
+    tcase_add_test(tc_transfer, test_fiber_transfer_01);
+    suite_add_tcase(s, tc_transfer);
+
+    TCase  *tc_generator = tcase_create("generator");
+    tcase_add_test(tc_generator, test_fiber_generator_01);
+    suite_add_tcase(s, tc_generator);
+
+    TCase  *tc_sleep = tcase_create("sleep");
+    tcase_add_test(tc_sleep, test_fiber_sleep_01);
+    suite_add_tcase(s, tc_sleep);
+
+    TCase  *tc_reset = tcase_create("reset");
+    tcase_add_test(tc_reset, test_fiber_reset_01);
+    tcase_add_test(tc_reset, test_fiber_worker_pool_01);
+    suite_add_tcase(s, tc_reset);
+
+    TCase  *tc_pool = tcase_create("pool");
+    tcase_add_test(tc_pool, test_fiber_pool_01);
+    tcase_add_test(tc_pool, test_fiber_pool_02);
+    suite_add_tcase(s, tc_pool);
+
+    TCase  *tc_mmap = tcase_create("mmap");
+    tcase_add_test(tc_mmap, test_fiber_mmap_01);
+    tcase_add_test(tc_mmap, test_fiber_mmap_02);
+    suite_add_tcase(s, tc_mmap);
+
+    TCase  *tc_embed = tcase_create("embed");
+    tcase_add_test(tc_embed, test_fiber_embed_01);
+    tcase_add_test(tc_embed, test_fiber_embed_02);
+    suite_add_tcase(s, tc_embed);
+
+    TCase  *tc_paint = tcase_create("paint");
+    tcase_add_test(tc_paint, test_fiber_paint_01);
+    tcase_add_test(tc_paint, test_fiber_paint_02);
+    tcase_add_test(tc_paint, test_fiber_paint_03);
+    tcase_add_test(tc_paint, test_fiber_paint_04);
+    suite_add_tcase(s, tc_paint);
+
+    TCase  *tc_stats = tcase_create("stats");
+    tcase_add_test(tc_stats, test_fiber_stats_01);
+    suite_add_tcase(s, tc_stats);
+
+    TCase  *tc_trace = tcase_create("trace");
+    tcase_add_test(tc_trace, test_fiber_trace_01);
+    suite_add_tcase(s, tc_trace);
+
+    TCase  *tc_registry = tcase_create("registry");
+    tcase_add_test(tc_registry, test_fiber_dump_01);
+    suite_add_tcase(s, tc_registry);
+
     return s;
 }
 
@@ -0,0 +1,273 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/future.h"
+#include "copse/round-robin.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Waiters
+ */
+
+static void
+count_ready(struct cps_future_waiter *waiter)
+{
+    unsigned int  *count = waiter->user_data;
+    (*count)++;
+}
+
+START_TEST(test_future_waiter_01)
+{
+    DESCRIBE_TEST;
+    struct cps_future  future;
+    struct cps_future_waiter  waiters[3];
+    unsigned int  count = 0;
+    size_t  i;
+
+    cps_future_init(&future);
+    for (i = 0; i < 3; i++) {
+        cps_future_waiter_init(&waiters[i], count_ready, &count);
+    }
+    cps_future_add_waiter(&future, &waiters[0]);
+    cps_future_add_waiter(&future, &waiters[1]);
+    cps_future_remove_waiter(&future, &waiters[1]);
+    fail_if(cps_future_is_ready(&future), "Future shouldn't be ready");
+    cps_future_set(&future, (void *) (uintptr_t) 42);
+    fail_unless(cps_future_is_ready(&future), "Future should be ready");
+    fail_unless_equal("Ready count", "%u", 1, count);
+    /* Waiters added after the value is set are called right away. */
+    cps_future_add_waiter(&future, &waiters[2]);
+    fail_unless_equal("Ready count", "%u", 2, count);
+    fail_unless_equal("Value", "%zu",
+                      (size_t) 42, (size_t) cps_future_get(&future));
+    cps_future_done(&future);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Joining fibers
+ */
+
+#define CHILD_COUNT  4
+
+struct join_test {
+    struct cps_rr  *rr;
+    struct cps_fiber  *children[CHILD_COUNT];
+    size_t  sum;
+};
+
+/* Each child yields a different number of times, so that they finish in a
+ * different order than we join them in. */
+static void
+child__run(void *user_data, struct cps_fiber *fiber)
+{
+    uintptr_t  index = (uintptr_t) user_data;
+    uintptr_t  i;
+    for (i = 0; i < CHILD_COUNT - index; i++) {
+        cps_fiber_yield(fiber);
+    }
+    cps_fiber_set_result(fiber, (void *) (index * index));
+}
+
+static void
+parent__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct join_test  *self = user_data;
+    uintptr_t  i;
+    for (i = 0; i < CHILD_COUNT; i++) {
+        self->children[i] = cps_fiber_new((void *) i, NULL, child__run, 0);
+        cps_rr_add(self->rr, cps_fiber_cont(self->children[i]));
+    }
+    for (i = 0; i < CHILD_COUNT; i++) {
+        self->sum += (uintptr_t) cps_fiber_join(fiber, self->children[i]);
+    }
+    /* Joining a finished fiber doesn't wait. */
+    self->sum += (uintptr_t) cps_fiber_join(fiber, self->children[1]);
+}
+
+START_TEST(test_fiber_join_01)
+{
+    DESCRIBE_TEST;
+    struct join_test  test;
+    struct cps_fiber  *parent;
+    size_t  i;
+
+    test.rr = cps_rr_new();
+    test.sum = 0;
+    parent = cps_fiber_new(&test, NULL, parent__run, 0);
+    cps_rr_add(test.rr, cps_fiber_cont(parent));
+    fail_if_error(cps_rr_drain(test.rr));
+    fail_unless(cps_fiber_is_finished(parent), "Parent should be finished");
+    /* 0 + 1 + 4 + 9, plus 1 from the second join */
+    fail_unless_equal("Sum", "%zu", (size_t) 15, test.sum);
+    for (i = 0; i < CHILD_COUNT; i++) {
+        cps_fiber_free(test.children[i]);
+    }
+    cps_fiber_free(parent);
+    cps_rr_free(test.rr);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Combinators
+ */
+
+struct combinator_test {
+    struct cps_future  futures[2];
+    struct cps_future  *future_ptrs[2];
+    size_t  any_index;
+    bool  all_ready;
+};
+
+/* Set the second future after two yields, and the first after four. */
+static void
+setter__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct combinator_test  *self = user_data;
+    cps_fiber_yield(fiber);
+    cps_fiber_yield(fiber);
+    cps_future_set(&self->futures[1], NULL);
+    cps_fiber_yield(fiber);
+    cps_fiber_yield(fiber);
+    cps_future_set(&self->futures[0], NULL);
+}
+
+static void
+when_any__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct combinator_test  *self = user_data;
+    self->any_index = cps_future_when_any(fiber, self->future_ptrs, 2);
+}
+
+/* Wait on the second future twice, with the first one in between. */
+static void
+when_any_dup__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct combinator_test  *self = user_data;
+    struct cps_future  *futures[3] = {
+        &self->futures[1], &self->futures[0], &self->futures[1]
+    };
+    self->any_index = cps_future_when_any(fiber, futures, 3);
+}
+
+static void
+when_all__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct combinator_test  *self = user_data;
+    cps_future_when_all(fiber, self->future_ptrs, 2);
+    self->all_ready =
+        cps_future_is_ready(&self->futures[0]) &&
+        cps_future_is_ready(&self->futures[1]);
+}
+
+static void
+test_combinator(cps_fiber_f func, struct combinator_test *test)
+{
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *waiter;
+    struct cps_fiber  *setter;
+    size_t  i;
+
+    for (i = 0; i < 2; i++) {
+        cps_future_init(&test->futures[i]);
+        test->future_ptrs[i] = &test->futures[i];
+    }
+    test->any_index = SIZE_MAX;
+    test->all_ready = false;
+    waiter = cps_fiber_new(test, NULL, func, 0);
+    setter = cps_fiber_new(test, NULL, setter__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(waiter));
+    cps_rr_add(rr, cps_fiber_cont(setter));
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless(cps_fiber_is_finished(waiter), "Waiter should be finished");
+    /* cps_future_done verifies that no waiters were left behind. */
+    for (i = 0; i < 2; i++) {
+        cps_future_done(&test->futures[i]);
+    }
+    cps_fiber_free(waiter);
+    cps_fiber_free(setter);
+    cps_rr_free(rr);
+}
+
+START_TEST(test_future_when_any_01)
+{
+    DESCRIBE_TEST;
+    struct combinator_test  test;
+    test_combinator(when_any__run, &test);
+    fail_unless_equal("Ready future", "%zu", (size_t) 1, test.any_index);
+}
+END_TEST
+
+START_TEST(test_future_when_any_02)
+{
+    DESCRIBE_TEST;
+    struct combinator_test  test;
+    test_combinator(when_any_dup__run, &test);
+    fail_unless_equal("Ready future", "%zu", (size_t) 0, test.any_index);
+}
+END_TEST
+
+START_TEST(test_future_when_all_01)
+{
+    DESCRIBE_TEST;
+    struct combinator_test  test;
+    test_combinator(when_all__run, &test);
+    fail_unless(test.all_ready, "All futures should be ready");
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("future");
+
+    TCase  *tc_future = tcase_create("future");
+    tcase_add_test(tc_future, test_future_waiter_01);
+    tcase_add_test(tc_future, test_fiber_join_01);
+    tcase_add_test(tc_future, test_future_when_any_01);
+    tcase_add_test(tc_future, test_future_when_any_02);
+    tcase_add_test(tc_future, test_future_when_all_01);
+    suite_add_tcase(s, tc_future);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
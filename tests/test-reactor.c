@@ -0,0 +1,449 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/reactor.h"
+#include "copse/round-robin.h"
+#include "copse/timer.h"
+
+#include "helpers.h"
+
+
+/*-----------------------------------------------------------------------
+ * Helpers
+ */
+
+static void
+set_nonblocking(int fd)
+{
+    int  flags = fcntl(fd, F_GETFL);
+    fail_if(flags == -1, "Cannot get flags for fd %d", fd);
+    fail_if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1,
+            "Cannot set flags for fd %d", fd);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Waiting for readability
+ */
+
+struct pipe_test {
+    struct cps_io  read_io;
+    int  write_fd;
+    char  received[16];
+    size_t  received_size;
+    unsigned int  wait_count;
+};
+
+static void
+pipe_reader__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct pipe_test  *self = user_data;
+    while (true) {
+        ssize_t  rc;
+        /* The writer hasn't written anything yet the first time through, so
+         * we'll have to wait at least once. */
+        rc = read(self->read_io.fd, self->received + self->received_size,
+                  sizeof(self->received) - self->received_size);
+        if (rc == -1 && errno == EAGAIN) {
+            self->wait_count++;
+            cps_fiber_wait_io(fiber, &self->read_io, CPS_IO_READ);
+            continue;
+        }
+        fail_if(rc == -1, "Cannot read from pipe");
+        if (rc == 0) {
+            return;
+        }
+        self->received_size += rc;
+    }
+}
+
+static void
+pipe_writer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct pipe_test  *self = user_data;
+    const char  *chunks[] = { "abc", "de", "f" };
+    uint64_t  deadline = cps_now();
+    size_t  i;
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        deadline += 5 * CPS_NSEC_PER_MSEC;
+        cps_fiber_sleep_until(fiber, deadline);
+        fail_unless(write(self->write_fd, chunks[i], strlen(chunks[i]))
+                    == (ssize_t) strlen(chunks[i]), "Cannot write to pipe");
+    }
+    close(self->write_fd);
+}
+
+START_TEST(test_reactor_pipe_01)
+{
+    DESCRIBE_TEST;
+    struct pipe_test  test;
+    int  fds[2];
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *reader;
+    struct cps_fiber  *writer;
+
+    fail_if(pipe(fds) == -1, "Cannot create pipe");
+    set_nonblocking(fds[0]);
+    fail_if_error(cps_io_init(&test.read_io, rr, fds[0]));
+    test.write_fd = fds[1];
+    test.received_size = 0;
+    test.wait_count = 0;
+
+    reader = cps_fiber_new(&test, NULL, pipe_reader__run, 0);
+    writer = cps_fiber_new(&test, NULL, pipe_writer__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(reader));
+    cps_rr_add(rr, cps_fiber_cont(writer));
+    fail_if_error(cps_rr_drain(rr));
+
+    fail_unless(cps_fiber_is_finished(reader), "Reader should be finished");
+    fail_unless_equal("Received size", "%zu", (size_t) 6, test.received_size);
+    fail_unless(memcmp(test.received, "abcdef", 6) == 0,
+                "Unexpected pipe contents");
+    fail_unless(test.wait_count >= 3,
+                "Reader only waited %u times", test.wait_count);
+
+    cps_io_done(&test.read_io);
+    close(fds[0]);
+    cps_fiber_free(reader);
+    cps_fiber_free(writer);
+    cps_rr_free(rr);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Waiting for writability
+ */
+
+#define TRANSFER_SIZE  (1024 * 1024)
+#define CHUNK_SIZE  4096
+
+struct transfer_test {
+    struct cps_io  ios[2];
+    size_t  sent;
+    size_t  received;
+    unsigned int  checksum;
+};
+
+static void
+transfer_sender__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct transfer_test  *self = user_data;
+    unsigned char  buf[CHUNK_SIZE];
+    while (self->sent < TRANSFER_SIZE) {
+        size_t  i;
+        ssize_t  rc;
+        for (i = 0; i < CHUNK_SIZE; i++) {
+            buf[i] = (unsigned char) (self->sent + i);
+        }
+        rc = cps_fiber_write(fiber, &self->ios[0], buf, CHUNK_SIZE);
+        fail_if(rc <= 0, "Cannot write to socket");
+        self->sent += rc;
+    }
+    shutdown(self->ios[0].fd, SHUT_WR);
+}
+
+static void
+transfer_receiver__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct transfer_test  *self = user_data;
+    unsigned char  buf[CHUNK_SIZE / 4];
+    while (true) {
+        ssize_t  rc = cps_fiber_read(fiber, &self->ios[1], buf, sizeof(buf));
+        ssize_t  i;
+        fail_if(rc == -1, "Cannot read from socket");
+        if (rc == 0) {
+            return;
+        }
+        for (i = 0; i < rc; i++) {
+            if (buf[i] != (unsigned char) (self->received + i)) {
+                self->checksum++;
+            }
+        }
+        self->received += rc;
+    }
+}
+
+static void
+test_transfer(unsigned int reactor_flags)
+{
+    struct transfer_test  test;
+    int  fds[2];
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *sender;
+    struct cps_fiber  *receiver;
+
+    /* The transfer is much bigger than the socket buffers, so the sender will
+     * have to wait for the receiver to catch up. */
+    fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1,
+            "Cannot create socket pair");
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+    fail_if_error(cps_rr_enable_reactor(rr, reactor_flags));
+    fail_if_error(cps_io_init(&test.ios[0], rr, fds[0]));
+    fail_if_error(cps_io_init(&test.ios[1], rr, fds[1]));
+    test.sent = 0;
+    test.received = 0;
+    test.checksum = 0;
+
+    sender = cps_fiber_new(&test, NULL, transfer_sender__run, 0);
+    receiver = cps_fiber_new(&test, NULL, transfer_receiver__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(sender));
+    cps_rr_add(rr, cps_fiber_cont(receiver));
+    fail_if_error(cps_rr_drain(rr));
+
+    fail_unless(cps_fiber_is_finished(sender), "Sender should be finished");
+    fail_unless(cps_fiber_is_finished(receiver),
+                "Receiver should be finished");
+    fail_unless_equal("Bytes received", "%zu",
+                      (size_t) TRANSFER_SIZE, test.received);
+    fail_unless_equal("Corrupted bytes", "%u", 0, test.checksum);
+
+    cps_io_done(&test.ios[0]);
+    cps_io_done(&test.ios[1]);
+    close(fds[0]);
+    close(fds[1]);
+    cps_fiber_free(sender);
+    cps_fiber_free(receiver);
+    cps_rr_free(rr);
+}
+
+START_TEST(test_reactor_transfer_01)
+{
+    DESCRIBE_TEST;
+    test_transfer(0);
+}
+END_TEST
+
+START_TEST(test_reactor_transfer_02)
+{
+    DESCRIBE_TEST;
+    test_transfer(CPS_REACTOR_NO_URING);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Accepting connections
+ */
+
+struct accept_test {
+    struct cps_rr  *rr;
+    struct cps_io  listener;
+    struct sockaddr_in  addr;
+    char  received[8];
+};
+
+static void
+accept_server__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct accept_test  *self = user_data;
+    struct cps_io  conn;
+    int  fd = cps_fiber_accept(fiber, &self->listener, NULL, NULL);
+    ssize_t  rc;
+    fail_if(fd == -1, "Cannot accept connection");
+    fail_if_error(cps_io_init(&conn, self->rr, fd));
+    rc = cps_fiber_read(fiber, &conn, self->received, 5);
+    fail_unless_equal("Bytes received", "%zd", (ssize_t) 5, rc);
+    cps_io_done(&conn);
+    close(fd);
+}
+
+static void
+accept_client__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct accept_test  *self = user_data;
+    struct cps_io  conn;
+    int  fd = socket(AF_INET, SOCK_STREAM, 0);
+    fail_if(fd == -1, "Cannot create socket");
+    set_nonblocking(fd);
+    fail_if_error(cps_io_init(&conn, self->rr, fd));
+    if (connect(fd, (struct sockaddr *) &self->addr, sizeof(self->addr))
+        == -1) {
+        fail_unless(errno == EINPROGRESS, "Cannot connect");
+        cps_fiber_wait_io(fiber, &conn, CPS_IO_WRITE);
+    }
+    fail_unless_equal("Bytes sent", "%zd", (ssize_t) 5,
+                      cps_fiber_write(fiber, &conn, "hello", 5));
+    cps_io_done(&conn);
+    close(fd);
+}
+
+static void
+test_accept(unsigned int reactor_flags)
+{
+    struct accept_test  test;
+    socklen_t  addr_len = sizeof(test.addr);
+    int  fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct cps_fiber  *server;
+    struct cps_fiber  *client;
+
+    fail_if(fd == -1, "Cannot create socket");
+    memset(&test.addr, 0, sizeof(test.addr));
+    test.addr.sin_family = AF_INET;
+    test.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test.addr.sin_port = 0;
+    fail_if(bind(fd, (struct sockaddr *) &test.addr, sizeof(test.addr)) == -1,
+            "Cannot bind socket");
+    fail_if(listen(fd, 1) == -1, "Cannot listen on socket");
+    fail_if(getsockname(fd, (struct sockaddr *) &test.addr, &addr_len) == -1,
+            "Cannot get socket address");
+    set_nonblocking(fd);
+
+    test.rr = cps_rr_new();
+    fail_if_error(cps_rr_enable_reactor(test.rr, reactor_flags));
+    fail_if_error(cps_io_init(&test.listener, test.rr, fd));
+    server = cps_fiber_new(&test, NULL, accept_server__run, 0);
+    client = cps_fiber_new(&test, NULL, accept_client__run, 0);
+    cps_rr_add(test.rr, cps_fiber_cont(server));
+    cps_rr_add(test.rr, cps_fiber_cont(client));
+    fail_if_error(cps_rr_drain(test.rr));
+    fail_unless(memcmp(test.received, "hello", 5) == 0,
+                "Unexpected data from client");
+
+    cps_io_done(&test.listener);
+    close(fd);
+    cps_fiber_free(server);
+    cps_fiber_free(client);
+    cps_rr_free(test.rr);
+}
+
+START_TEST(test_reactor_accept_01)
+{
+    DESCRIBE_TEST;
+    test_accept(0);
+}
+END_TEST
+
+START_TEST(test_reactor_accept_02)
+{
+    DESCRIBE_TEST;
+    test_accept(CPS_REACTOR_NO_URING);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Regular files
+ */
+
+struct file_test {
+    struct cps_io  io;
+    int  fsync_result;
+};
+
+static void
+file_writer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct file_test  *self = user_data;
+    fail_unless_equal("Bytes written", "%zd", (ssize_t) 6,
+                      cps_fiber_write(fiber, &self->io, "abcdef", 6));
+    self->fsync_result = cps_fiber_fsync(fiber, &self->io);
+}
+
+static void
+test_file(unsigned int reactor_flags)
+{
+    struct file_test  test;
+    char  path[] = "/tmp/copse-test-XXXXXX";
+    char  buf[6];
+    int  fd = mkstemp(path);
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *writer;
+
+    fail_if(fd == -1, "Cannot create temporary file");
+    unlink(path);
+    /* epoll doesn't support regular files, but that shouldn't stop us from
+     * registering one. */
+    fail_if_error(cps_rr_enable_reactor(rr, reactor_flags));
+    fail_if_error(cps_io_init(&test.io, rr, fd));
+    test.fsync_result = -1;
+    writer = cps_fiber_new(&test, NULL, file_writer__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(writer));
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless_equal("fsync result", "%d", 0, test.fsync_result);
+    fail_unless(pread(fd, buf, sizeof(buf), 0) == sizeof(buf),
+                "Cannot read back file");
+    fail_unless(memcmp(buf, "abcdef", 6) == 0, "Unexpected file contents");
+
+    cps_io_done(&test.io);
+    close(fd);
+    cps_fiber_free(writer);
+    cps_rr_free(rr);
+}
+
+START_TEST(test_reactor_file_01)
+{
+    DESCRIBE_TEST;
+    test_file(0);
+}
+END_TEST
+
+START_TEST(test_reactor_file_02)
+{
+    DESCRIBE_TEST;
+    test_file(CPS_REACTOR_NO_URING);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("reactor");
+
+    TCase  *tc_reactor = tcase_create("reactor");
+    tcase_add_test(tc_reactor, test_reactor_pipe_01);
+    tcase_add_test(tc_reactor, test_reactor_transfer_01);
+    suite_add_tcase(s, tc_reactor);
+
+    TCase  *tc_fiber_io = tcase_create("fiber-io");
+    tcase_add_test(tc_fiber_io, test_reactor_transfer_02);
+    tcase_add_test(tc_fiber_io, test_reactor_accept_01);
+    tcase_add_test(tc_fiber_io, test_reactor_accept_02);
+    tcase_add_test(tc_fiber_io, test_reactor_file_01);
+    tcase_add_test(tc_fiber_io, test_reactor_file_02);
+    suite_add_tcase(s, tc_fiber_io);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,268 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "copse/cps.h"
+#include "copse/fiber.h"
+#include "copse/round-robin.h"
+#include "copse/sync.h"
+
+#include "helpers.h"
+
+
+#define FIBER_COUNT  5
+
+/* Run a function in several fibers, all in the same scheduler, until they all
+ * finish. */
+static void
+run_fibers(void *user_data, cps_fiber_f func, size_t count)
+{
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *fibers[FIBER_COUNT];
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        fibers[i] = cps_fiber_new(user_data, NULL, func, 0);
+        cps_rr_add(rr, cps_fiber_cont(fibers[i]));
+    }
+    fail_if_error(cps_rr_drain(rr));
+    for (i = 0; i < count; i++) {
+        fail_unless(cps_fiber_is_finished(fibers[i]),
+                    "Fiber %zu should be finished", i);
+        cps_fiber_free(fibers[i]);
+    }
+    cps_rr_free(rr);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Mutexes
+ */
+
+struct mutex_test {
+    struct cps_mutex  mutex;
+    bool  in_critical_section;
+    unsigned int  violations;
+    unsigned int  count;
+};
+
+static void
+mutex_test__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct mutex_test  *self = user_data;
+    unsigned int  i;
+    for (i = 0; i < 10; i++) {
+        cps_mutex_lock(&self->mutex, fiber);
+        if (self->in_critical_section) {
+            self->violations++;
+        }
+        self->in_critical_section = true;
+        /* Give the other fibers a chance to try to get in. */
+        cps_fiber_yield(fiber);
+        cps_fiber_yield(fiber);
+        self->in_critical_section = false;
+        self->count++;
+        cps_mutex_unlock(&self->mutex);
+        cps_fiber_yield(fiber);
+    }
+}
+
+START_TEST(test_mutex_01)
+{
+    DESCRIBE_TEST;
+    struct mutex_test  test;
+    cps_mutex_init(&test.mutex);
+    test.in_critical_section = false;
+    test.violations = 0;
+    test.count = 0;
+    run_fibers(&test, mutex_test__run, FIBER_COUNT);
+    fail_unless_equal("Violations", "%u", 0, test.violations);
+    fail_unless_equal("Count", "%u", FIBER_COUNT * 10, test.count);
+    fail_unless(cps_mutex_try_lock(&test.mutex), "Mutex should be unlocked");
+    fail_if(cps_mutex_try_lock(&test.mutex), "Mutex should be locked");
+    cps_mutex_unlock(&test.mutex);
+    cps_mutex_done(&test.mutex);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Condition variables
+ */
+
+#define BUFFER_SIZE  2
+#define ITEM_COUNT  20
+
+struct queue_test {
+    struct cps_mutex  mutex;
+    struct cps_cond  not_empty;
+    struct cps_cond  not_full;
+    unsigned int  buffer[BUFFER_SIZE];
+    size_t  used;
+    unsigned int  next_item;
+    unsigned int  received[ITEM_COUNT];
+    size_t  received_count;
+};
+
+static void
+producer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct queue_test  *self = user_data;
+    unsigned int  i;
+    for (i = 0; i < ITEM_COUNT; i++) {
+        cps_mutex_lock(&self->mutex, fiber);
+        while (self->used == BUFFER_SIZE) {
+            cps_cond_wait(&self->not_full, &self->mutex, fiber);
+        }
+        self->buffer[self->used++] = self->next_item++;
+        cps_cond_signal(&self->not_empty);
+        cps_mutex_unlock(&self->mutex);
+    }
+}
+
+static void
+consumer__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct queue_test  *self = user_data;
+    while (self->received_count < ITEM_COUNT) {
+        cps_mutex_lock(&self->mutex, fiber);
+        while (self->used == 0) {
+            cps_cond_wait(&self->not_empty, &self->mutex, fiber);
+        }
+        self->received[self->received_count++] = self->buffer[0];
+        self->buffer[0] = self->buffer[1];
+        self->used--;
+        cps_cond_broadcast(&self->not_full);
+        cps_mutex_unlock(&self->mutex);
+    }
+}
+
+START_TEST(test_cond_01)
+{
+    DESCRIBE_TEST;
+    struct queue_test  test;
+    struct cps_rr  *rr = cps_rr_new();
+    struct cps_fiber  *consumer;
+    struct cps_fiber  *producer;
+    unsigned int  i;
+    cps_mutex_init(&test.mutex);
+    cps_cond_init(&test.not_empty);
+    cps_cond_init(&test.not_full);
+    test.used = 0;
+    test.next_item = 0;
+    test.received_count = 0;
+    /* Start the consumer first, so that it has to wait for the producer. */
+    consumer = cps_fiber_new(&test, NULL, consumer__run, 0);
+    producer = cps_fiber_new(&test, NULL, producer__run, 0);
+    cps_rr_add(rr, cps_fiber_cont(consumer));
+    cps_rr_add(rr, cps_fiber_cont(producer));
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless(cps_fiber_is_finished(consumer), "Consumer should be finished");
+    fail_unless_equal("Items received", "%zu",
+                      (size_t) ITEM_COUNT, test.received_count);
+    for (i = 0; i < ITEM_COUNT; i++) {
+        fail_unless_equal("Item", "%u", i, test.received[i]);
+    }
+    cps_cond_done(&test.not_empty);
+    cps_cond_done(&test.not_full);
+    cps_mutex_done(&test.mutex);
+    cps_fiber_free(consumer);
+    cps_fiber_free(producer);
+    cps_rr_free(rr);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Semaphores
+ */
+
+#define SEM_VALUE  2
+
+struct sem_test {
+    struct cps_sem  sem;
+    unsigned int  active;
+    unsigned int  max_active;
+    unsigned int  finished;
+};
+
+static void
+sem_test__run(void *user_data, struct cps_fiber *fiber)
+{
+    struct sem_test  *self = user_data;
+    unsigned int  i;
+    cps_sem_wait(&self->sem, fiber);
+    self->active++;
+    if (self->active > self->max_active) {
+        self->max_active = self->active;
+    }
+    for (i = 0; i < 3; i++) {
+        cps_fiber_yield(fiber);
+    }
+    self->active--;
+    self->finished++;
+    cps_sem_post(&self->sem);
+}
+
+START_TEST(test_sem_01)
+{
+    DESCRIBE_TEST;
+    struct sem_test  test;
+    cps_sem_init(&test.sem, SEM_VALUE);
+    test.active = 0;
+    test.max_active = 0;
+    test.finished = 0;
+    run_fibers(&test, sem_test__run, FIBER_COUNT);
+    fail_unless_equal("Max active", "%u", SEM_VALUE, test.max_active);
+    fail_unless_equal("Finished", "%u", FIBER_COUNT, test.finished);
+    fail_unless(cps_sem_try_wait(&test.sem), "Semaphore should be positive");
+    fail_unless(cps_sem_try_wait(&test.sem), "Semaphore should be positive");
+    fail_if(cps_sem_try_wait(&test.sem), "Semaphore should be zero");
+    cps_sem_done(&test.sem);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("sync");
+
+    TCase  *tc_sync = tcase_create("sync");
+    tcase_add_test(tc_sync, test_mutex_01);
+    tcase_add_test(tc_sync, test_cond_01);
+    tcase_add_test(tc_sync, test_sem_01);
+    suite_add_tcase(s, tc_sync);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -0,0 +1,258 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "copse/cps.h"
+#include "copse/round-robin.h"
+#include "copse/timer.h"
+
+#include "helpers.h"
+
+
+#define MSEC  CPS_NSEC_PER_MSEC
+
+
+/*-----------------------------------------------------------------------
+ * Timer wheels
+ */
+
+struct counted_timer {
+    struct cps_timer  timer;
+    unsigned int  fire_count;
+};
+
+static void
+counted_timer__fire(struct cps_timer *timer)
+{
+    struct counted_timer  *self =
+        cork_container_of(timer, struct counted_timer, timer);
+    self->fire_count++;
+}
+
+static void
+counted_timer_init(struct counted_timer *self, uint64_t deadline)
+{
+    cps_timer_init(&self->timer, deadline, counted_timer__fire, NULL);
+    self->fire_count = 0;
+}
+
+START_TEST(test_timer_wheel_01)
+{
+    DESCRIBE_TEST;
+    /* Deadlines that land in each level of the wheel, plus one that has
+     * already passed, and one that's beyond the top level. */
+    static const uint64_t  offsets[] = {
+        0, 3, 70, 5000, 300000, 20000000
+    };
+#define OFFSET_COUNT  (sizeof(offsets) / sizeof(offsets[0]))
+    struct counted_timer  timers[OFFSET_COUNT];
+    uint64_t  base = cps_now();
+    struct cps_timer_wheel  *wheel = cps_timer_wheel_new();
+    size_t  i;
+    size_t  j;
+
+    for (i = 0; i < OFFSET_COUNT; i++) {
+        counted_timer_init(&timers[i], base + offsets[i] * MSEC);
+        cps_timer_wheel_add(wheel, &timers[i].timer);
+    }
+    fail_unless_equal("Timer count", "%zu",
+                      OFFSET_COUNT, cps_timer_wheel_count(wheel));
+
+    for (i = 0; i < OFFSET_COUNT; i++) {
+        uint64_t  deadline = timers[i].timer.deadline;
+        /* Nothing fires early... */
+        if (offsets[i] > 0) {
+            cps_timer_wheel_advance(wheel, deadline - MSEC);
+            fail_unless_equal("Fire count", "%u", 0, timers[i].fire_count);
+        }
+        /* ...and everything fires once its deadline passes. */
+        cps_timer_wheel_advance(wheel, deadline + MSEC);
+        for (j = 0; j <= i; j++) {
+            fail_unless_equal("Fire count", "%u", 1, timers[j].fire_count);
+        }
+    }
+    fail_unless_equal("Timer count", "%zu",
+                      (size_t) 0, cps_timer_wheel_count(wheel));
+    cps_timer_wheel_free(wheel);
+#undef OFFSET_COUNT
+}
+END_TEST
+
+START_TEST(test_timer_wheel_02)
+{
+    DESCRIBE_TEST;
+    struct counted_timer  t1;
+    struct counted_timer  t2;
+    uint64_t  base = cps_now();
+    uint64_t  deadline;
+    unsigned int  steps = 0;
+    struct cps_timer_wheel  *wheel = cps_timer_wheel_new();
+
+    fail_unless(cps_timer_wheel_next_deadline(wheel) == UINT64_MAX,
+                "Empty wheel should have no deadline");
+
+    counted_timer_init(&t1, base + 10 * MSEC);
+    counted_timer_init(&t2, base + 5000 * MSEC);
+    cps_timer_wheel_add(wheel, &t1.timer);
+    cps_timer_wheel_add(wheel, &t2.timer);
+    cps_timer_wheel_cancel(wheel, &t1.timer);
+    fail_if(cps_timer_is_active(&t1.timer), "Timer should be cancelled");
+
+    /* Following the wheel's next deadline should get us to the timer in a
+     * handful of steps, without overshooting the tick that it fires at. */
+    while (cps_timer_is_active(&t2.timer)) {
+        deadline = cps_timer_wheel_next_deadline(wheel);
+        fail_unless(deadline < t2.timer.deadline + MSEC, "Deadline overshot");
+        cps_timer_wheel_advance(wheel, deadline);
+        fail_unless(++steps <= 4, "Too many steps to reach deadline");
+    }
+    fail_unless_equal("Fire count", "%u", 0, t1.fire_count);
+    fail_unless_equal("Fire count", "%u", 1, t2.fire_count);
+    cps_timer_wheel_free(wheel);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Sleeping continuations
+ */
+
+struct log_cont {
+    struct cps_cont  cont;
+    unsigned int  id;
+    unsigned int  *log;
+    size_t  *log_length;
+    uint64_t  ran_at;
+};
+
+static void
+log_cont__resume(void *user_data, struct cps_cont *next)
+{
+    struct log_cont  *self = user_data;
+    self->log[(*self->log_length)++] = self->id;
+    self->ran_at = cps_now();
+    cps_call(next);
+}
+
+static void
+log_cont_init(struct log_cont *self, unsigned int id,
+              unsigned int *log, size_t *log_length)
+{
+    cps_cont_init(&self->cont);
+    cps_cont_set(&self->cont, self, NULL, log_cont__resume);
+    self->id = id;
+    self->log = log;
+    self->log_length = log_length;
+    self->ran_at = 0;
+}
+
+START_TEST(test_timer_sleep_01)
+{
+    DESCRIBE_TEST;
+    unsigned int  log[3];
+    size_t  log_length = 0;
+    struct log_cont  c[3];
+    struct cps_rr  *rr = cps_rr_new();
+    uint64_t  start = cps_now();
+    size_t  i;
+
+    for (i = 0; i < 3; i++) {
+        log_cont_init(&c[i], i, log, &log_length);
+    }
+    cps_sleep_cont(rr, start + 20 * MSEC, &c[0].cont);
+    cps_sleep_cont(rr, start + 10 * MSEC, &c[1].cont);
+    cps_rr_add(rr, &c[2].cont);
+
+    /* The drain blocks until both sleeping continuations have run. */
+    fail_if_error(cps_rr_drain(rr));
+    fail_unless_equal("Log length", "%zu", (size_t) 3, log_length);
+    fail_unless_equal("Log entry", "%u", 2, log[0]);
+    fail_unless_equal("Log entry", "%u", 1, log[1]);
+    fail_unless_equal("Log entry", "%u", 0, log[2]);
+    fail_unless(c[1].ran_at >= start + 10 * MSEC, "Woke up too early");
+    fail_unless(c[0].ran_at >= start + 20 * MSEC, "Woke up too early");
+
+    for (i = 0; i < 3; i++) {
+        cps_cont_done(&c[i].cont);
+    }
+    cps_rr_free(rr);
+}
+END_TEST
+
+START_TEST(test_timer_sleep_02)
+{
+    DESCRIBE_TEST;
+    /* Freeing a scheduler while continuations are still asleep shouldn't
+     * leak anything, or run them. */
+    unsigned int  log[2];
+    size_t  log_length = 0;
+    struct log_cont  c[2];
+    struct cps_rr  *rr = cps_rr_new();
+    uint64_t  start = cps_now();
+    size_t  i;
+
+    for (i = 0; i < 2; i++) {
+        log_cont_init(&c[i], i, log, &log_length);
+    }
+    cps_sleep_cont(rr, start + 60 * CPS_NSEC_PER_SEC, &c[0].cont);
+    cps_sleep_cont(rr, start + 120 * CPS_NSEC_PER_SEC, &c[1].cont);
+    fail_if_error(cps_rr_run_one_lap(rr));
+    cps_rr_free(rr);
+    fail_unless_equal("Log length", "%zu", (size_t) 0, log_length);
+
+    for (i = 0; i < 2; i++) {
+        cps_cont_done(&c[i].cont);
+    }
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("timer");
+
+    TCase  *tc_wheel = tcase_create("wheel");
+    tcase_add_test(tc_wheel, test_timer_wheel_01);
+    tcase_add_test(tc_wheel, test_timer_wheel_02);
+    suite_add_tcase(s, tc_wheel);
+
+    TCase  *tc_sleep = tcase_create("sleep");
+    tcase_add_test(tc_sleep, test_timer_sleep_01);
+    tcase_add_test(tc_sleep, test_timer_sleep_02);
+    suite_add_tcase(s, tc_sleep);
+
+    return s;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    int  number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}